@@ -19,190 +19,496 @@
 #endif
 #define MOD_ID                  MOD_CONSOLE
 
+//
+// The binary dump is formatted with SSE2 on x64 and on x86 when the
+// compiler targets it (/arch:SSE2, which the NetTerm project sets).
+//
+#if defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+    #define DUMPBIN_SSE2
+#endif
+
 class Console: public WsaCallback
 {
 private:
-    #define FOREGROUND_MASK     0x000f
-    #define BACKGROUND_MASK     0x00f0
-    #define FOREGROUND_BLACK    0x0000
-    #define FOREGROUND_CYAN     (FOREGROUND_GREEN | FOREGROUND_BLUE)
-    #define FOREGROUND_MAGENTA  (FOREGROUND_RED | FOREGROUND_BLUE)
-    #define FOREGROUND_YELLOW   (FOREGROUND_RED | FOREGROUND_GREEN)
-    #define FOREGROUND_WHITE    (FOREGROUND_RED | \
-                                 FOREGROUND_GREEN | \
-                                 FOREGROUND_BLUE)
-    #define BACKGROUND_BLACK    0x0000
-    #define BACKGROUND_CYAN     (BACKGROUND_GREEN | BACKGROUND_BLUE)
-    #define BACKGROUND_MAGENTA  (BACKGROUND_RED | BACKGROUND_BLUE)
-    #define BACKGROUND_YELLOW   (BACKGROUND_RED | BACKGROUND_GREEN)
-    #define BACKGROUND_WHITE    (BACKGROUND_RED | \
-                                 BACKGROUND_GREEN | \
-                                 BACKGROUND_BLUE)
-
     #define DEF_TEXT_ATTRIB     FOREGROUND_WHITE
 
+    //
+    // The console limits how much a single WriteConsoleOutput call may
+    // transfer, larger updates are written in several calls.
+    //
+    #define MAX_CONSOLE_IO_CELLS 8192
+    //
+    // Marks a frame cell whose console content is not known, so it never
+    // matches a screen cell.
+    //
+    #define UNKNOWN_ATTRIB      0xffff
+    //
+    // A dump line is "oooooooo:", " xx" per byte, two spaces, the bytes as
+    // characters and a newline. The dump buffer holds a full receive buffer
+    // and the blank line following it.
+    //
+    #define DUMP_BYTES_PER_LINE 16
+    #define DUMP_LINE_LEN       (9 + 4*DUMP_BYTES_PER_LINE + 3)
+    #define DUMP_BUFF_SIZE      (((RECV_BUFF_SIZE + DUMP_BYTES_PER_LINE - 1)/ \
+                                  DUMP_BYTES_PER_LINE)*DUMP_LINE_LEN + 1)
+
+    #define RENDERF_PENDING     0x00000001
+    #define RENDERF_STOP        0x00000002
+
     PHANDLER_ROUTINE    m_ctrlHandler;
-    WORD                m_currTextAttrib;
     HANDLE              m_hConOut;
     WORD                m_origTextAttrib;
-    char                m_szRecvBuff[RECV_BUFF_SIZE];
+    AnsiScan            m_ansiScan;
+    VtScreen            m_screen;
+    SHORT               m_screenTop;
+    BOOL                m_fCursorVisible;
+    COORD               m_cursorPos;
+    WORD                m_textAttrib;
+    PCHAR_INFO          m_frame;
+    //
+    // Render scheduler. Received data only updates the screen model, the
+    // console is drawn at most once per frame time. Data arriving after the
+    // console has been idle for a frame time is drawn right away.
+    //
+    CRITICAL_SECTION    m_renderCritSect;
+    HANDLE              m_hRenderThread;
+    HANDLE              m_hRenderEvent;
+    DWORD               m_renderFlags;
+    DWORD               m_frameTime;
+    DWORD               m_renderTime;
+    DWORD               m_dumpOffset;
+    char                m_dumpBuff[DUMP_BUFF_SIZE];
+
+    friend
+    DWORD WINAPI
+    RenderThreadProc(
+        __in LPVOID lpParam
+        );
 
     /**
-     *  This function translates the ANSI SGR code into console text
-     *  attributes.
-     *
-     *  @param code Specifies the ANSI SGR code string to translate.
-     *  @param textAttrib Specifies the current text attribute.
+     *  This function clears the console screen by writing spaces and default
+     *  text attributes to screen buffer.
      *
-     *  @return Returns the new text attributes.
+     *  @param fFullScreen If TRUE, clear the whole screen, otherwise clear
+     *         from the cursor to the end of the screen.
      */
-    WORD
-    AnsiCodeToTextAttrib(
-        __in LPCSTR code,
-        __in WORD textAttrib
+    VOID
+    ClearScreen(
+        __in BOOL fFullScreen
         )
     {
-        static struct _XlatEntry
-        {
-            LPSTR code;
-            WORD  mask;
-            WORD  attrib;
-        } AnsiTable[] = {
-            {SGR_FG_BLACK,   FOREGROUND_MASK, FOREGROUND_BLACK},
-            {SGR_FG_RED,     FOREGROUND_MASK, FOREGROUND_RED},
-            {SGR_FG_GREEN,   FOREGROUND_MASK, FOREGROUND_GREEN},
-            {SGR_FG_YELLOW,  FOREGROUND_MASK, FOREGROUND_YELLOW},
-            {SGR_FG_BLUE,    FOREGROUND_MASK, FOREGROUND_BLUE},
-            {SGR_FG_MAGENTA, FOREGROUND_MASK, FOREGROUND_MAGENTA},
-            {SGR_FG_CYAN,    FOREGROUND_MASK, FOREGROUND_CYAN},
-            {SGR_FG_WHITE,   FOREGROUND_MASK, FOREGROUND_WHITE},
-            {SGR_BG_BLACK,   BACKGROUND_MASK, BACKGROUND_BLACK},
-            {SGR_BG_RED,     BACKGROUND_MASK, BACKGROUND_RED},
-            {SGR_BG_GREEN,   BACKGROUND_MASK, BACKGROUND_GREEN},
-            {SGR_BG_YELLOW,  BACKGROUND_MASK, BACKGROUND_YELLOW},
-            {SGR_BG_BLUE,    BACKGROUND_MASK, BACKGROUND_BLUE},
-            {SGR_BG_MAGENTA, BACKGROUND_MASK, BACKGROUND_MAGENTA},
-            {SGR_BG_CYAN,    BACKGROUND_MASK, BACKGROUND_CYAN},
-            {SGR_BG_WHITE,   BACKGROUND_MASK, BACKGROUND_WHITE},
-        };
+        CONSOLE_SCREEN_BUFFER_INFO csbi;
 
-        TLevel(FUNC);
-        TEnterMsg(("code=%s,attrib=%x", code, textAttrib));
+        TLevel(API);
+        TEnterMsg(("fFullScreen=%d", fFullScreen));
 
-        if ((strlen(code) == 0) || (strcmp(code, SGR_RESET) == 0))
+        if (!GetConsoleScreenBufferInfo(m_hConOut, &csbi))
         {
-            textAttrib = DEF_TEXT_ATTRIB;
+            TErr(("Failed to get console screen buffer info (err=%d).",
+                  GetLastError()));
         }
-        else if (strcmp(code, SGR_BRIGHT) == 0)
+        else
         {
-            textAttrib |= FOREGROUND_INTENSITY;
+            COORD coordScreen = {0, 0};
+            DWORD dwScreenLen;
+            DWORD cchWritten;
+
+            if (fFullScreen)
+            {
+                dwScreenLen = csbi.dwSize.X*csbi.dwSize.Y;
+            }
+            else
+            {
+                coordScreen = csbi.dwCursorPosition;
+                dwScreenLen = (csbi.dwSize.Y - csbi.dwCursorPosition.Y)*
+                              csbi.dwSize.X - csbi.dwCursorPosition.X;
+            }
+
+            if (!FillConsoleOutputCharacterA(m_hConOut,
+                                             ' ',
+                                             dwScreenLen,
+                                             coordScreen,
+                                             &cchWritten))
+            {
+                TErr(("Failed to clear screen (x=%d,y=%d,err=%d).",
+                      csbi.dwSize.X, csbi.dwSize.Y, GetLastError()));
+            }
+            else if (!FillConsoleOutputAttribute(m_hConOut,
+                                                 csbi.wAttributes,
+                                                 dwScreenLen,
+                                                 coordScreen,
+                                                 &cchWritten))
+            {
+                TErr(("Failed to set screen attribute (x=%d,y=%d,err=%d).",
+                      csbi.dwSize.X, csbi.dwSize.Y, GetLastError()));
+            }
+            else if (fFullScreen &&
+                     !SetConsoleCursorPosition(m_hConOut, coordScreen))
+            {
+                TErr(("Failed to set cursor position (err=%d).",
+                      GetLastError()));
+            }
         }
-        else if (strcmp(code, SGR_REVERSE) == 0)
+
+        TExit();
+        return;
+    }   //ClearScreen
+
+    /**
+     *  This function formats one line of the binary dump: the offset, the
+     *  bytes in hex and the bytes as characters. A full line is converted
+     *  16 bytes at a time with SSE2.
+     *
+     *  @param data Points to the bytes of the line.
+     *  @param len Specifies the number of bytes, 1 to DUMP_BYTES_PER_LINE.
+     *  @param offset Specifies the stream offset of the first byte.
+     *  @param line Points to the buffer to hold the line, it must hold at
+     *         least DUMP_LINE_LEN characters.
+     *
+     *  @return Returns the length of the line.
+     */
+    static
+    DWORD
+    FormatDumpLine(
+        __in_bcount(len) const BYTE *data,
+        __in             DWORD len,
+        __in             DWORD offset,
+        __out            LPSTR line
+        )
+    {
+        static const char hexDigits[] = "0123456789abcdef";
+        char hex[2*DUMP_BYTES_PER_LINE];
+        char text[DUMP_BYTES_PER_LINE];
+        LPSTR psz = line;
+
+        TLevel(HIFREQ);
+        TEnterMsg(("data=%p,len=%d,offset=%x", data, len, offset));
+
+#if defined(DUMPBIN_SSE2)
+        if (len == DUMP_BYTES_PER_LINE)
         {
-            textAttrib = ((textAttrib & FOREGROUND_MASK) << 4) |
-                         ((textAttrib & BACKGROUND_MASK) >> 4);
+            __m128i bytes = _mm_loadu_si128((const __m128i *)data);
+            __m128i nibbleMask = _mm_set1_epi8(0x0f);
+            __m128i nine = _mm_set1_epi8(9);
+            __m128i zero = _mm_set1_epi8('0');
+            __m128i letterAdj = _mm_set1_epi8('a' - '0' - 10);
+            __m128i hi = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibbleMask);
+            __m128i lo = _mm_and_si128(bytes, nibbleMask);
+            __m128i printable;
+
+            //
+            // Nibble to digit: add '0', and move 10-15 on to 'a'-'f'.
+            //
+            hi = _mm_add_epi8(_mm_add_epi8(hi, zero),
+                              _mm_and_si128(_mm_cmpgt_epi8(hi, nine),
+                                            letterAdj));
+            lo = _mm_add_epi8(_mm_add_epi8(lo, zero),
+                              _mm_and_si128(_mm_cmpgt_epi8(lo, nine),
+                                            letterAdj));
+            _mm_storeu_si128((__m128i *)hex, _mm_unpacklo_epi8(hi, lo));
+            _mm_storeu_si128((__m128i *)&hex[16], _mm_unpackhi_epi8(hi, lo));
+
+            //
+            // Bytes 0x20-0x7e are shown as is, others as '.'. The compares
+            // are signed, so bytes 0x80-0xff fail the first one.
+            //
+            printable = _mm_and_si128(
+                            _mm_cmpgt_epi8(bytes, _mm_set1_epi8(0x1f)),
+                            _mm_cmplt_epi8(bytes, _mm_set1_epi8(0x7f)));
+            _mm_storeu_si128((__m128i *)text,
+                             _mm_or_si128(
+                                _mm_and_si128(printable, bytes),
+                                _mm_andnot_si128(printable,
+                                                 _mm_set1_epi8('.'))));
         }
         else
+#endif
+        {
+            for (DWORD i = 0; i < len; i++)
+            {
+                hex[2*i] = hexDigits[data[i] >> 4];
+                hex[2*i + 1] = hexDigits[data[i] & 0x0f];
+                text[i] = ((data[i] >= 0x20) && (data[i] < 0x7f))?
+                          (char)data[i]: '.';
+            }
+        }
+
+        for (int shift = 28; shift >= 0; shift -= 4)
+        {
+            *psz++ = hexDigits[(offset >> shift) & 0x0f];
+        }
+        *psz++ = ':';
+
+        for (DWORD i = 0; i < DUMP_BYTES_PER_LINE; i++)
+        {
+            psz[0] = ' ';
+            if (i < len)
+            {
+                psz[1] = hex[2*i];
+                psz[2] = hex[2*i + 1];
+            }
+            else
+            {
+                psz[1] = ' ';
+                psz[2] = ' ';
+            }
+            psz += 3;
+        }
+
+        *psz++ = ' ';
+        *psz++ = ' ';
+        CopyMemory(psz, text, len);
+        psz += len;
+        *psz++ = '\n';
+
+        TExitMsg(("=%d", psz - line));
+        return (DWORD)(psz - line);
+    }   //FormatDumpLine
+
+    /**
+     *  This function dumps the data buffer as binary data in hex and char
+     *  format. The offsets continue from the previous buffer. The dump of a
+     *  receive buffer is written with one call.
+     *
+     *  @param buffer Points to the buffer that contains the data.
+     *  @param len Specifies the length of the buffer.
+     */
+    VOID
+    DumpBin(
+        __in_bcount(len) LPBYTE buffer,
+        __in             DWORD len
+        )
+    {
+        DWORD dumpLen = 0;
+
+        TLevel(FUNC);
+        TEnterMsg(("buffer=%p,len=%d,offset=%x", buffer, len, m_dumpOffset));
+
+        for (DWORD i = 0; i < len; i += DUMP_BYTES_PER_LINE)
+        {
+            if (dumpLen + DUMP_LINE_LEN + 1 > sizeof(m_dumpBuff))
+            {
+                //
+                // Only a buffer larger than a receive buffer gets here.
+                //
+                fwrite(m_dumpBuff, 1, dumpLen, stdout);
+                dumpLen = 0;
+            }
+            dumpLen += FormatDumpLine(&buffer[i],
+                                      min(len - i, DUMP_BYTES_PER_LINE),
+                                      m_dumpOffset + i,
+                                      &m_dumpBuff[dumpLen]);
+        }
+        m_dumpBuff[dumpLen++] = '\n';
+        fwrite(m_dumpBuff, 1, dumpLen, stdout);
+        m_dumpOffset += len;
+
+        TExit();
+        return;
+    }   //DumpBin
+
+    /**
+     *  This function marks frame rows as unknown, so they are rewritten in
+     *  full the next time they are drawn.
+     *
+     *  @param first Specifies the first row.
+     *  @param numRows Specifies the number of rows.
+     */
+    VOID
+    InvalidateFrame(
+        __in SHORT first,
+        __in SHORT numRows
+        )
+    {
+        SHORT width = m_screen.GetWidth();
+
+        TLevel(FUNC);
+        TEnterMsg(("first=%d,rows=%d", first, numRows));
+
+        for (int i = first*width; i < (first + numRows)*width; i++)
+        {
+            m_frame[i].Char.AsciiChar = 0;
+            m_frame[i].Attributes = UNKNOWN_ATTRIB;
+        }
+
+        TExit();
+        return;
+    }   //InvalidateFrame
+
+    /**
+     *  This function compares a screen row with what the console shows and
+     *  updates the frame to match.
+     *
+     *  @param row Specifies the screen row.
+     *  @param first Points to a variable to hold the first changed column.
+     *  @param last Points to a variable to hold the last changed column.
+     *
+     *  @return Returns TRUE if any cell changed.
+     */
+    BOOL
+    DiffRow(
+        __in  SHORT row,
+        __out PSHORT first,
+        __out PSHORT last
+        )
+    {
+        SHORT width = m_screen.GetWidth();
+        const VtScreen::VTCELL *cells = m_screen.GetRow(row);
+        PCHAR_INFO shown = &m_frame[row*width];
+        BOOL rc;
+
+        TLevel(FUNC);
+        TEnterMsg(("row=%d", row));
+
+        *first = width;
+        *last = -1;
+        for (SHORT col = 0; col < width; col++)
         {
-            for (int i = 0; i < ARRAYSIZE(AnsiTable); i++)
+            if ((shown[col].Char.AsciiChar != cells[col].ch) ||
+                (shown[col].Attributes != cells[col].attrib))
             {
-                if (strcmp(code, AnsiTable[i].code) == 0)
+                shown[col].Char.AsciiChar = cells[col].ch;
+                shown[col].Attributes = cells[col].attrib;
+                if (col < *first)
                 {
-                    textAttrib &= ~AnsiTable[i].mask;
-                    textAttrib |= AnsiTable[i].attrib;
-                    break;
+                    *first = col;
                 }
+                *last = col;
             }
         }
 
-        TExitMsg(("=%x", textAttrib));
-        return textAttrib;
-    }   //AnsiCodeToTextAttrib
+        rc = (*last >= 0);
+
+        TExitMsg(("=%d (first=%d,last=%d)", rc, *first, *last));
+        return rc;
+    }   //DiffRow
 
     /**
-     *  This function parses the string for embedded ANSI escape sequence and
-     *  process it. The caller should call this in a loop and passing the
-     *  pointer to the character past the end of the previous escape sequence
-     *  as the start of the string.
+     *  This function writes a rectangle of the frame to the console with
+     *  one call.
      *
-     *  @param string Specifies the string to be parsed.
-     *  @param startSeq Points to a variable to hold the pointer to the
-     *         beginning of the escape sequence found.
-     *  @param endSeq Points to a variable to hold the pointer to the end of
-     *         the escape seqence found. The caller should call this function
-     *         again with one character past this pointer as the next string
-     *         to parse.
+     *  @param rect Specifies the rectangle in screen rows and columns.
+     */
+    VOID
+    WriteRect(
+        __in SMALL_RECT rect
+        )
+    {
+        COORD size = {m_screen.GetWidth(), m_screen.GetHeight()};
+        COORD origin = {rect.Left, rect.Top};
+
+        TLevel(FUNC);
+        TEnterMsg(("rect=(%d,%d,%d,%d)",
+                   rect.Left, rect.Top, rect.Right, rect.Bottom));
+
+        rect.Top = (SHORT)(rect.Top + m_screenTop);
+        rect.Bottom = (SHORT)(rect.Bottom + m_screenTop);
+        if (!WriteConsoleOutputA(m_hConOut, m_frame, size, origin, &rect))
+        {
+            TErr(("Failed to write console output (err=%d).",
+                  GetLastError()));
+        }
+
+        TExit();
+        return;
+    }   //WriteRect
+
+    /**
+     *  This function fits the screen to the console buffer before it is
+     *  drawn. The screen is placed at the console cursor when it is first
+     *  drawn, below whatever was printed before the first data arrived. If
+     *  the console buffer or window changed size since, the screen and the
+     *  frame are resized to match, and the screen is moved up if it no
+     *  longer fits in the buffer.
      *
-     *  @return Returns the new text attributes.
+     *  @return Returns TRUE if the frame was invalidated and all rows must
+     *          be redrawn.
      */
-    WORD
-    ParseAnsiSeq(
-        __in  LPSTR  string,
-        __out LPSTR *startSeq,
-        __out LPSTR *endSeq
+    BOOL
+    FitScreen(
+        VOID
         )
     {
-        WORD textAttrib = m_currTextAttrib;
+        BOOL fRedraw = FALSE;
+        CONSOLE_SCREEN_BUFFER_INFO csbi;
 
         TLevel(FUNC);
-        TEnterMsg(("string=%s,pstartSeq=%p,pendSeq=%p",
-                   string, startSeq, endSeq));
+        TEnterMsg(("top=%d", m_screenTop));
 
-        *startSeq = strstr(string, ESC_PREFIX);
-        if (*startSeq == NULL)
+        if (!GetConsoleScreenBufferInfo(m_hConOut, &csbi))
         {
-            *endSeq = NULL;
+            TErr(("Failed to get console screen buffer info (err=%d).",
+                  GetLastError()));
+            m_screenTop = (SHORT)max(m_screenTop, 0);
         }
         else
         {
-            *endSeq = strstr(&(*startSeq)[2], ESC_SUFFIX);
-            if (*endSeq != NULL)
+            SHORT width = csbi.dwSize.X;
+            SHORT height = (SHORT)min(csbi.srWindow.Bottom -
+                                      csbi.srWindow.Top + 1,
+                                      csbi.dwSize.Y);
+
+            if ((width != m_screen.GetWidth()) ||
+                (height != m_screen.GetHeight()))
             {
-                LPSTR psz;
-                LPSTR pszCtxt = NULL;
+                PCHAR_INFO frame = new CHAR_INFO[width*height];
 
-                **endSeq = '\0';
-                if (strlen(&(*startSeq)[2]) == 0)
+                if (frame == NULL)
                 {
-                    textAttrib = DEF_TEXT_ATTRIB;
+                    TErr(("Failed to allocate console frame (%dx%d).",
+                          width, height));
+                }
+                else if (FAILED(m_screen.Resize(width, height)))
+                {
+                    delete [] frame;
                 }
                 else
                 {
-                    psz = strtok_s(&(*startSeq)[2], ESC_SEP, &pszCtxt);
-                    while (psz != NULL)
-                    {
-                        textAttrib = AnsiCodeToTextAttrib(psz, textAttrib);
-                        psz = strtok_s(NULL, ESC_SEP, &pszCtxt);
-                    }
+                    delete [] m_frame;
+                    m_frame = frame;
+                    InvalidateFrame(0, height);
+                    m_cursorPos.X = -1;
+                    m_cursorPos.Y = -1;
+                    fRedraw = TRUE;
                 }
             }
-            else
+
+            height = m_screen.GetHeight();
+            if (m_screenTop < 0)
+            {
+                m_screenTop = (SHORT)min(csbi.dwCursorPosition.Y,
+                                         csbi.dwSize.Y - height);
+            }
+            else if (m_screenTop + height > csbi.dwSize.Y)
             {
-                *startSeq = NULL;
+                m_screenTop = (SHORT)(csbi.dwSize.Y - height);
+                InvalidateFrame(0, height);
+                fRedraw = TRUE;
             }
+            m_screenTop = (SHORT)max(m_screenTop, 0);
         }
 
-        TExitMsg(("=%x (start=%p,end=%p,attrib=%x)",
-                  textAttrib, *startSeq, *endSeq, m_currTextAttrib));
-        return textAttrib;
-    }   //ParseAnsiSeq
+        TExitMsg(("=%d (top=%d)", fRedraw, m_screenTop));
+        return fRedraw;
+    }   //FitScreen
 
     /**
-     *  This function clears the console screen by writing spaces and default
-     *  text attributes to screen buffer.
+     *  This function scrolls the console output up with the screen. While
+     *  the console buffer has room, the screen just moves down in it and
+     *  the rows scrolled off are kept for scrollback. After that, the whole
+     *  buffer is scrolled.
      *
-     *  @param fFullScreen If TRUE, clear the whole screen, otherwise clear
-     *         from the cursor to the end of the screen.
+     *  @param numRows Specifies the number of rows the screen scrolled.
      */
     VOID
-    ClearScreen(
-        __in BOOL fFullScreen
+    ScrollOutput(
+        __in DWORD numRows
         )
     {
         CONSOLE_SCREEN_BUFFER_INFO csbi;
 
-        TLevel(API);
-        TEnterMsg(("fFullScreen=%d", fFullScreen));
+        TLevel(FUNC);
+        TEnterMsg(("rows=%d,top=%d", numRows, m_screenTop));
 
         if (!GetConsoleScreenBufferInfo(m_hConOut, &csbi))
         {
@@ -211,122 +517,432 @@ private:
         }
         else
         {
-            COORD coordScreen = {0, 0};
-            DWORD dwScreenLen;
-            DWORD cchWritten;
+            SHORT height = m_screen.GetHeight();
+            DWORD room = (DWORD)max(csbi.dwSize.Y - (m_screenTop + height),
+                                    0);
+            SMALL_RECT rectWindow = csbi.srWindow;
 
-            if (fFullScreen)
+            if (numRows <= room)
             {
-                dwScreenLen = csbi.dwSize.X*csbi.dwSize.Y;
+                m_screenTop = (SHORT)(m_screenTop + numRows);
             }
             else
             {
-                coordScreen = csbi.dwCursorPosition;
-                dwScreenLen = (csbi.dwSize.Y - csbi.dwCursorPosition.Y)*
-                              csbi.dwSize.X - csbi.dwCursorPosition.X;
-            }
+                DWORD excess = numRows - room;
 
-            if (!FillConsoleOutputCharacterA(m_hConOut,
-                                             ' ',
-                                             dwScreenLen,
-                                             coordScreen,
-                                             &cchWritten))
-            {
-                TErr(("Failed to clear screen (x=%d,y=%d,err=%d).",
-                      csbi.dwSize.X, csbi.dwSize.Y, GetLastError()));
+                m_screenTop = (SHORT)max(csbi.dwSize.Y - height, 0);
+                if (excess < (DWORD)csbi.dwSize.Y)
+                {
+                    SMALL_RECT rectScroll = {0, (SHORT)excess,
+                                             (SHORT)(csbi.dwSize.X - 1),
+                                             (SHORT)(csbi.dwSize.Y - 1)};
+                    COORD dest = {0, 0};
+                    CHAR_INFO fill;
+
+                    fill.Char.AsciiChar = ' ';
+                    fill.Attributes = DEF_TEXT_ATTRIB;
+                    ScrollConsoleScreenBufferA(m_hConOut,
+                                               &rectScroll,
+                                               NULL,
+                                               dest,
+                                               &fill);
+                }
             }
-            else if (!FillConsoleOutputAttribute(m_hConOut,
-                                                 csbi.wAttributes,
-                                                 dwScreenLen,
-                                                 coordScreen,
-                                                 &cchWritten))
+
+            //
+            // The frame scrolls with the output. The rows coming in at the
+            // bottom are not known.
+            //
+            if (numRows < (DWORD)height)
             {
-                TErr(("Failed to set screen attribute (x=%d,y=%d,err=%d).",
-                      csbi.dwSize.X, csbi.dwSize.Y, GetLastError()));
+                SHORT width = m_screen.GetWidth();
+
+                MoveMemory(m_frame,
+                           &m_frame[numRows*width],
+                           (height - numRows)*width*sizeof(CHAR_INFO));
+                InvalidateFrame((SHORT)(height - numRows), (SHORT)numRows);
             }
-            else if (fFullScreen &&
-                     !SetConsoleCursorPosition(m_hConOut, coordScreen))
+            else
             {
-                TErr(("Failed to set cursor position (err=%d).",
-                      GetLastError()));
+                InvalidateFrame(0, height);
             }
+
+            //
+            // Keep the screen in view.
+            //
+            rectWindow.Top = m_screenTop;
+            rectWindow.Bottom = (SHORT)(m_screenTop + height - 1);
+            SetConsoleWindowInfo(m_hConOut, TRUE, &rectWindow);
         }
 
-        TExit();
+        TExitMsg(("(top=%d)", m_screenTop));
         return;
-    }   //ClearScreen
+    }   //ScrollOutput
 
     /**
-     *  This function dumps the data buffer as binary data in hex and char
-     *  format.
-     *
-     *  @param buffer Points to the buffer that contains the data.
-     *  @param len Specifies the length of the buffer.
+     *  This function draws the screen model to the console. The screen is
+     *  first fitted to the console buffer and the output is scrolled the
+     *  way the screen scrolled. Each dirty row is then
+     *  compared with what the console shows, so rows redrawn with the same
+     *  content cost nothing. The changed columns of consecutive changed
+     *  rows are written as one rectangle, and the cursor and the text
+     *  attributes are only set when they change.
      */
     VOID
-    DumpBin(
-        __in_bcount(len) LPBYTE buffer,
-        __in             DWORD len
+    RenderScreen(
+        VOID
         )
     {
+        BOOL fRedraw;
+        SHORT height;
+        DWORD scrollCount;
+        SMALL_RECT rect = {0, 0, -1, -1};
+        COORD pos;
+
         TLevel(FUNC);
-        TEnterMsg(("buffer=%p,len=%d", buffer, len));
+        TEnter();
 
-        for (DWORD i = 0; i < len; i++)
+        //
+        // A resized screen has no scroll count, so get it after fitting.
+        //
+        fRedraw = FitScreen();
+        height = m_screen.GetHeight();
+        scrollCount = m_screen.GetScrollCount();
+        if (scrollCount > 0)
         {
-            if ((i % 16) == 0)
+            ScrollOutput(scrollCount);
+        }
+
+        for (SHORT row = 0; row < height; row++)
+        {
+            SHORT first, last;
+
+            if ((fRedraw || m_screen.IsRowDirty(row)) &&
+                DiffRow(row, &first, &last))
             {
-                printf("%08x:", i);
+                SMALL_RECT rectNew = {min(rect.Left, first),
+                                      rect.Top,
+                                      max(rect.Right, last),
+                                      row};
+
+                if ((rect.Bottom >= 0) &&
+                    ((rect.Bottom != row - 1) ||
+                     ((rectNew.Right - rectNew.Left + 1)*
+                      (rectNew.Bottom - rectNew.Top + 1) >
+                      MAX_CONSOLE_IO_CELLS)))
+                {
+                    //
+                    // Not adjacent or too big, write what we have and
+                    // start over.
+                    //
+                    WriteRect(rect);
+                    rect.Bottom = -1;
+                }
+
+                if (rect.Bottom < 0)
+                {
+                    rect.Left = first;
+                    rect.Top = row;
+                    rect.Right = last;
+                    rect.Bottom = row;
+                }
+                else
+                {
+                    rect = rectNew;
+                }
             }
+        }
 
-            printf(" %02x", buffer[i]);
+        if (rect.Bottom >= 0)
+        {
+            WriteRect(rect);
+        }
+
+        pos = m_screen.GetCursor();
+        pos.Y = (SHORT)(pos.Y + m_screenTop);
+        if ((pos.X != m_cursorPos.X) || (pos.Y != m_cursorPos.Y))
+        {
+            SetConsoleCursorPosition(m_hConOut, pos);
+            m_cursorPos = pos;
+        }
+
+        if (m_screen.IsCursorVisible() != m_fCursorVisible)
+        {
+            CONSOLE_CURSOR_INFO cci;
 
-            if (((i + 1) == len) && ((i + 1)%16 != 0))
+            if (GetConsoleCursorInfo(m_hConOut, &cci))
             {
-                for (DWORD j = 0; j < (16 - ((i + 1)%16)); j++)
+                m_fCursorVisible = m_screen.IsCursorVisible();
+                cci.bVisible = m_fCursorVisible;
+                SetConsoleCursorInfo(m_hConOut, &cci);
+            }
+        }
+
+        if (m_screen.GetAttrib() != m_textAttrib)
+        {
+            m_textAttrib = m_screen.GetAttrib();
+            SetConsoleTextAttribute(m_hConOut, m_textAttrib);
+        }
+        m_screen.ClearDamage();
+        m_renderFlags &= ~RENDERF_PENDING;
+        m_renderTime = GetTickCount();
+
+        TExit();
+        return;
+    }   //RenderScreen
+
+    /**
+     *  This function implements the render thread. It waits for screen
+     *  updates and draws them once the current frame time has passed, so
+     *  a flood of received data is drawn at the frame rate instead of once
+     *  per packet.
+     *
+     *  @return Success: Returns S_OK.
+     */
+    HRESULT
+    RenderThread(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+        BOOL fStop = FALSE;
+
+        TLevel(FUNC);
+        TEnter();
+
+        while (!fStop)
+        {
+            DWORD dwTimeout = INFINITE;
+
+            EnterCriticalSection(&m_renderCritSect);
+            fStop = (m_renderFlags & RENDERF_STOP) != 0;
+            if (m_renderFlags & RENDERF_PENDING)
+            {
+                DWORD elapsed = GetTickCount() - m_renderTime;
+
+                if (fStop || (elapsed >= m_frameTime))
                 {
-                    printf("   ");
+                    RenderScreen();
+                }
+                else
+                {
+                    dwTimeout = m_frameTime - elapsed;
                 }
             }
+            LeaveCriticalSection(&m_renderCritSect);
 
-            if ((((i + 1)%16) == 0) || ((i + 1) == len))
+            if (!fStop)
             {
-                ULONG j;
+                WaitForSingleObject(m_hRenderEvent, dwTimeout);
+            }
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //RenderThread
+
+    /**
+     *  This function starts the render thread.
+     *
+     *  @param frameRate Specifies the maximum number of frames per second.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    StartRenderThread(
+        __in DWORD frameRate
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(FUNC);
+        TEnterMsg(("frameRate=%d", frameRate));
+
+        m_frameTime = 1000/frameRate;
+        if ((m_hRenderEvent = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL)
+        {
+            hr = GETLASTHRESULT();
+            TErr(("Failed to create render event (hr=%x).", hr));
+        }
+        else if ((m_hRenderThread = CreateThread(NULL,
+                                                 0,
+                                                 RenderThreadProc,
+                                                 this,
+                                                 0,
+                                                 NULL)) == NULL)
+        {
+            hr = GETLASTHRESULT();
+            TErr(("Failed to create render thread (hr=%x).", hr));
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //StartRenderThread
+
+    /**
+     *  This function stops the render thread after it has drawn whatever is
+     *  still pending. If the thread does not die in time, its event is left
+     *  open since it may still be using it.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    StopRenderThread(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(FUNC);
+        TEnter();
+
+        if (m_hRenderThread != NULL)
+        {
+            DWORD rcWait;
+
+            EnterCriticalSection(&m_renderCritSect);
+            m_renderFlags |= RENDERF_STOP;
+            LeaveCriticalSection(&m_renderCritSect);
+            SetEvent(m_hRenderEvent);
+            rcWait = WaitForSingleObject(m_hRenderThread, RENDER_STOP_TIMEOUT);
+            if (rcWait == WAIT_OBJECT_0)
+            {
+                CloseHandle(m_hRenderThread);
+                m_hRenderThread = NULL;
+            }
+            else
+            {
+                hr = (rcWait == WAIT_FAILED)?
+                        GETLASTHRESULT(): HRESULT_FROM_WIN32(WAIT_TIMEOUT);
+                TErr(("Failed waiting for the render thread to die (hr=%x).",
+                      hr));
+            }
+        }
+
+        if (SUCCEEDED(hr) && (m_hRenderEvent != NULL))
+        {
+            CloseHandle(m_hRenderEvent);
+            m_hRenderEvent = NULL;
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //StopRenderThread
+
+    /**
+     *  This function logs and displays a buffer of received data. The
+     *  buffer may be of any length and may contain NUL bytes.
+     *
+     *  @param recvBuff Points to the buffer containing the received data.
+     *  @param recvLen Specifies the length of the received data.
+     */
+    VOID
+    ProcessData(
+        __in_bcount(recvLen) LPBYTE recvBuff,
+        __in                 DWORD recvLen
+        )
+    {
+        TLevel(FUNC);
+        TEnterMsg(("buff=%p,len=%d", recvBuff, recvLen));
+
+        if (g_logWriter != NULL)
+        {
+            g_logWriter->Write(recvBuff, recvLen);
+        }
 
-                printf("  ");
-                for (j = (i/16)*16; j <= i; j++)
+        if (g_progFlags & NETTERMF_DUMPBIN)
+        {
+            DumpBin(recvBuff, recvLen);
+        }
+        else if (m_frame == NULL)
+        {
+            AnsiScan::ANSISPAN span;
+
+            //
+            // Output is not a console, pass the text through without the
+            // escape sequences.
+            //
+            m_ansiScan.SetText((LPCSTR)recvBuff, recvLen);
+            while (m_ansiScan.NextSpan(&span))
+            {
+                if (span.textLen > 0)
                 {
-                    printf("%c",
-                            (__isascii(buffer[j]) &&
-                            !iscntrl(buffer[j]))?
-                            buffer[j]: '.');
+                    fwrite(span.text, span.textLen, 1, stdout);
                 }
-                printf("\n");
             }
         }
-        printf("\n");
+        else
+        {
+            EnterCriticalSection(&m_renderCritSect);
+            m_screen.Write((LPCSTR)recvBuff, recvLen);
+            if ((g_progFlags & NETTERMF_APPENDLF) &&
+                (recvLen > 0) && (recvBuff[recvLen - 1] == '\r'))
+            {
+                m_screen.Write("\n", 1);
+            }
+
+            if ((m_hRenderThread == NULL) ||
+                (GetTickCount() - m_renderTime >= m_frameTime))
+            {
+                //
+                // The console has been idle for a frame, draw it now.
+                //
+                RenderScreen();
+            }
+            else if (!(m_renderFlags & RENDERF_PENDING))
+            {
+                m_renderFlags |= RENDERF_PENDING;
+                SetEvent(m_hRenderEvent);
+            }
+            LeaveCriticalSection(&m_renderCritSect);
+        }
 
         TExit();
         return;
-    }   //DumpBin
+    }   //ProcessData
 
 public:
     /**
      *  Constructor for the NetConn class.
      *
      *  @param ctrlHandler Specifies the console control handler.
+     *  @param frameRate Specifies the maximum number of times per second
+     *         the console is redrawn, 0 redraws it for every packet.
      */
     Console(
-        __in_opt PHANDLER_ROUTINE ctrlHandler = NULL
+        __in_opt PHANDLER_ROUTINE ctrlHandler = NULL,
+        __in     DWORD frameRate = DEF_FRAME_RATE
         ): m_ctrlHandler(ctrlHandler)
-         , m_currTextAttrib(DEF_TEXT_ATTRIB)
          , m_origTextAttrib(0)
+         , m_screenTop(-1)
+         , m_fCursorVisible(TRUE)
+         , m_textAttrib(DEF_TEXT_ATTRIB)
+         , m_frame(NULL)
+         , m_hRenderThread(NULL)
+         , m_hRenderEvent(NULL)
+         , m_renderFlags(0)
+         , m_frameTime(0)
+         , m_renderTime(0)
+         , m_dumpOffset(0)
     {
         CONSOLE_SCREEN_BUFFER_INFO csbi;
 
         TLevel(INIT);
-        TEnterMsg(("ctrlHandler=%p", ctrlHandler));
+        TEnterMsg(("ctrlHandler=%p,frameRate=%d", ctrlHandler, frameRate));
 
+        __try
+        {
+            InitializeCriticalSection(&m_renderCritSect);
+        }
+        __except(EXCEPTION_EXECUTE_HANDLER)
+        {
+            TErr(("Failed to initialize critical section (err=%d).",
+                  GetExceptionCode()));
+        }
+        m_cursorPos.X = -1;
+        m_cursorPos.Y = -1;
         m_hConOut = GetStdHandle(STD_OUTPUT_HANDLE);
         if ((m_hConOut == INVALID_HANDLE_VALUE) || (m_hConOut == NULL))
         {
@@ -347,10 +963,38 @@ public:
         }
         else
         {
-            m_szRecvBuff[0] = '\0';
+            SHORT width = csbi.dwSize.X;
+            SHORT height = (SHORT)(csbi.srWindow.Bottom -
+                                   csbi.srWindow.Top + 1);
+
             m_origTextAttrib = csbi.wAttributes;
-            SetConsoleTextAttribute(m_hConOut, m_currTextAttrib);
+            SetConsoleTextAttribute(m_hConOut, DEF_TEXT_ATTRIB);
             ClearScreen(TRUE);
+            //
+            // The screen model covers the console window. It is placed in
+            // the buffer when it is first drawn.
+            //
+            if (FAILED(m_screen.Initialize(width, height, DEF_TEXT_ATTRIB)))
+            {
+                MsgPrintf(g_progName, MSGTYPE_ERR, 0,
+                          L"Failed to create screen model.");
+            }
+            else if ((m_frame = new CHAR_INFO[width*height]) == NULL)
+            {
+                MsgPrintf(g_progName, MSGTYPE_ERR, 0,
+                          L"Failed to allocate console frame.");
+            }
+            else
+            {
+                InvalidateFrame(0, height);
+                if ((frameRate > 0) && FAILED(StartRenderThread(frameRate)))
+                {
+                    //
+                    // Fall back to drawing every packet.
+                    //
+                    StopRenderThread();
+                }
+            }
         }
 
         TExit();
@@ -358,7 +1002,8 @@ public:
     }   //Console
 
     /**
-     *  Destructor for the NetConn class.
+     *  Destructor for the NetConn class. The owner must call Uninitialize
+     *  first and must not delete the object if it fails.
      */
     ~Console(
         VOID
@@ -367,21 +1012,48 @@ public:
         TLevel(INIT);
         TEnter();
 
-        if (m_origTextAttrib != 0)
-        {
-            SetConsoleTextAttribute(m_hConOut, m_origTextAttrib);
-            ClearScreen(FALSE);
-        }
-
+        Uninitialize();
         if (m_ctrlHandler != NULL)
         {
             SetConsoleCtrlHandler(m_ctrlHandler, FALSE);
         }
+        SAFE_DELETE_ARRAY(m_frame);
+        DeleteCriticalSection(&m_renderCritSect);
 
         TExit();
         return;
     }   //~Console
 
+    /**
+     *  This function stops the render thread and restores the console text
+     *  attributes. If the render thread does not die in time, it is still
+     *  using the object, so the caller must leave the object to it instead
+     *  of deleting it.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    Uninitialize(
+        VOID
+        )
+    {
+        HRESULT hr;
+
+        TLevel(API);
+        TEnter();
+
+        if (SUCCEEDED(hr = StopRenderThread()) && (m_origTextAttrib != 0))
+        {
+            SetConsoleTextAttribute(m_hConOut, m_origTextAttrib);
+            ClearScreen(FALSE);
+            m_origTextAttrib = 0;
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //Uninitialize
+
     /**
      *  This is a callback from the server when a buffer of data is received
      *  so that the buffer can be processed.
@@ -407,55 +1079,72 @@ public:
         UNREFERENCED_PARAMETER(connHandle);
         UNREFERENCED_PARAMETER(context);
 
-        if (g_hLogFile != NULL)
-        {
-            fwrite(recvBuff, recvLen, 1, g_hLogFile);
-        }
+        ProcessData(recvBuff, recvLen);
 
-        if (g_progFlags & NETTERMF_DUMPBIN)
-        {
-            DumpBin(recvBuff, recvLen);
-        }
-        else if (recvLen + 1 > sizeof(m_szRecvBuff))
-        {
-            TErr(("Receive length exceeds buffer size (len=%d).", recvLen));
-        }
-        else
-        {
-            WORD textAttrib;
-            LPSTR pszLine;
-            LPSTR pszStart;
-            LPSTR pszEnd;
+        TExit();
+        return;
+    }   //DataReceived
 
-            pszLine = m_szRecvBuff;
-            RtlCopyMemory(pszLine, recvBuff, recvLen);
-            pszLine[recvLen] = '\0';
-            for (;;)
-            {
-                textAttrib = ParseAnsiSeq(pszLine, &pszStart, &pszEnd);
-                if (pszStart != NULL)
-                {
-                    *pszStart = '\0';
-                    printf(pszLine);
-                    pszLine = pszEnd + 1;
-                    SetConsoleTextAttribute(m_hConOut, textAttrib);
-                    m_currTextAttrib = textAttrib;
-                }
-                else
-                {
-                    printf(pszLine);
-                    if ((g_progFlags & NETTERMF_APPENDLF) &&
-                        (pszLine[strlen(pszLine) - 1] == '\r'))
-                    {
-                        printf("\n");
-                    }
-                    break;
-                }
-            }
-        }
+    /**
+     *  This is a callback from the server with a leased receive buffer. The
+     *  buffer is processed in place.
+     *
+     *  @param connHandle Specifies the handle of the connection receiving
+     *         the data.
+     *  @param context Specifies the callback context.
+     *  @param hLease Specifies the lease handle of the buffer.
+     *  @param recvBuff Points to the buffer containing the received data.
+     *  @param recvLen Specifies the length of the received data.
+     */
+    VOID
+    DataLeased(
+        __in                        HANDLE connHandle,
+        __in_opt                    LPVOID context,
+        __in                        HANDLE hLease,
+        __inout_bcount(recvLen + 1) LPBYTE recvBuff,
+        __in                        DWORD recvLen
+        )
+    {
+        TLevel(CALLBK);
+        TEnterMsg(("hConn=%p,ctxt=%p,hLease=%p,buff=%p,len=%d",
+                   connHandle, context, hLease, recvBuff, recvLen));
+
+        UNREFERENCED_PARAMETER(connHandle);
+        UNREFERENCED_PARAMETER(context);
+        UNREFERENCED_PARAMETER(hLease);
+
+        ProcessData(recvBuff, recvLen);
 
         TExit();
         return;
-    }   //DataReceived
+    }   //DataLeased
 
 };  //class Console
+
+#ifdef _MAIN_FILE
+/**
+ *  This function implements the render thread.
+ *
+ *  @param lpParam Points to thread data passed to the function.
+ *
+ *  @return Success: Returns ERROR_SUCCESS.
+ *  @return Failure: Returns Win32 error code.
+ */
+DWORD WINAPI
+RenderThreadProc(
+    __in LPVOID lpParam
+    )
+{
+    DWORD rc;
+    Console *console = (Console *)lpParam;
+
+    TLevel(CALLBK);
+    TEnterMsg(("param=%p", lpParam));
+
+    rc = (DWORD)console->RenderThread();
+
+    TExitMsg(("=%x", rc));
+    return rc;
+}   //RenderThreadProc
+
+#endif
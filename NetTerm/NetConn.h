@@ -22,8 +22,253 @@
 class NetConn
 {
 private:
+    #define SENDF_FLUSH                 0x00000001
+    #define SENDF_STOP                  0x00000002
+
     WsaServer  *m_server;
     WsaClient  *m_client;
+    //
+    // Send queue. Queued keys are coalesced into one send until the window
+    // expires, the byte threshold is reached or a control key is queued.
+    //
+    CRITICAL_SECTION m_sendCritSect;
+    HANDLE      m_hSendThread;
+    HANDLE      m_hSendEvent;
+    HANDLE      m_hSpaceEvent;
+    DWORD       m_sendFlags;
+    DWORD       m_coalesceTime;
+    DWORD       m_coalesceBytes;
+    DWORD       m_queueTime;
+    DWORD       m_queueLen;
+    HRESULT     m_hrSend;
+    BYTE        m_queueBuff[SEND_BUFF_SIZE];
+    BYTE        m_sendBuff[SEND_BUFF_SIZE];
+
+    friend
+    DWORD WINAPI
+    SendThreadProc(
+        __in LPVOID lpParam
+        );
+
+    /**
+     *  This function checks if the queued data must be sent right away.
+     *  Extended keys and control characters such as Enter, Backspace, Esc
+     *  and Ctrl+C flush the queue, so interactive editing is not delayed by
+     *  the coalescing window.
+     *
+     *  @param pbBuff Points to the data.
+     *  @param dwcbLen Specifies the data length in bytes.
+     *
+     *  @return Returns TRUE if the data must be flushed immediately.
+     */
+    BOOL
+    IsFlushData(
+        __in_bcount(dwcbLen) LPBYTE pbBuff,
+        __in                 DWORD  dwcbLen
+        )
+    {
+        BOOL rc = FALSE;
+
+        TLevel(HIFREQ);
+        TEnterMsg(("pbBuff=%p,dwcbLen=%d", pbBuff, dwcbLen));
+
+        for (DWORD i = 0; i < dwcbLen; i++)
+        {
+            if ((pbBuff[i] < 0x20) || (pbBuff[i] == 0x7f) ||
+                (pbBuff[i] == KEYCODE_EXTENDED))
+            {
+                rc = TRUE;
+                break;
+            }
+        }
+
+        TExitMsg(("=%d", rc));
+        return rc;
+    }   //IsFlushData
+
+    /**
+     *  This function implements the send thread. It waits for queued data,
+     *  holds it back until it is due and sends it in one write.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    SendThread(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+        BOOL fStop = FALSE;
+
+        TLevel(FUNC);
+        TEnter();
+
+        while (!fStop)
+        {
+            DWORD dwTimeout = INFINITE;
+            DWORD dwcbSend = 0;
+
+            EnterCriticalSection(&m_sendCritSect);
+            fStop = (m_sendFlags & SENDF_STOP) != 0;
+            if (m_queueLen > 0)
+            {
+                DWORD elapsed = GetTickCount() - m_queueTime;
+
+                if (fStop || (m_sendFlags & SENDF_FLUSH) ||
+                    (m_queueLen >= m_coalesceBytes) ||
+                    (elapsed >= m_coalesceTime))
+                {
+                    //
+                    // Take the queued data, so new keys can be queued while
+                    // it is being sent.
+                    //
+                    CopyMemory(m_sendBuff, m_queueBuff, m_queueLen);
+                    dwcbSend = m_queueLen;
+                    m_queueLen = 0;
+                    m_sendFlags &= ~SENDF_FLUSH;
+                    SetEvent(m_hSpaceEvent);
+                }
+                else
+                {
+                    dwTimeout = m_coalesceTime - elapsed;
+                }
+            }
+            LeaveCriticalSection(&m_sendCritSect);
+
+            if (dwcbSend > 0)
+            {
+                DWORD dwcb;
+
+                hr = m_client->SyncWrite(m_sendBuff,
+                                         dwcbSend,
+                                         &dwcb,
+                                         INFINITE);
+                if (FAILED(hr))
+                {
+                    TWarn(("Failed to send %d queued bytes (hr=%x).",
+                           dwcbSend, hr));
+                    EnterCriticalSection(&m_sendCritSect);
+                    m_hrSend = hr;
+                    LeaveCriticalSection(&m_sendCritSect);
+                }
+            }
+            else if (!fStop)
+            {
+                WaitForSingleObject(m_hSendEvent, dwTimeout);
+            }
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //SendThread
+
+    /**
+     *  This function starts the send thread.
+     *
+     *  @param configParams Specifies the config parameters.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    StartSendThread(
+        __in PCONFIG_PARAMS configParams
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(FUNC);
+        TEnterMsg(("coalesceTime=%d,coalesceBytes=%d",
+                   configParams->coalesceTime, configParams->coalesceBytes));
+
+        m_coalesceTime = configParams->coalesceTime;
+        m_coalesceBytes = configParams->coalesceBytes;
+        if ((m_coalesceBytes == 0) || (m_coalesceBytes > SEND_BUFF_SIZE))
+        {
+            m_coalesceBytes = SEND_BUFF_SIZE;
+        }
+
+        if (((m_hSendEvent = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL) ||
+            ((m_hSpaceEvent = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL))
+        {
+            hr = GETLASTHRESULT();
+            TErr(("Failed to create send events (hr=%x).", hr));
+        }
+        else if ((m_hSendThread = CreateThread(NULL,
+                                               0,
+                                               SendThreadProc,
+                                               this,
+                                               0,
+                                               NULL)) == NULL)
+        {
+            hr = GETLASTHRESULT();
+            TErr(("Failed to create send thread (hr=%x).", hr));
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //StartSendThread
+
+    /**
+     *  This function stops the send thread after it has sent whatever is
+     *  still queued. If the thread does not die in time, its events are
+     *  left open since it may still be using them.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    StopSendThread(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(FUNC);
+        TEnter();
+
+        if (m_hSendThread != NULL)
+        {
+            DWORD rcWait;
+
+            EnterCriticalSection(&m_sendCritSect);
+            m_sendFlags |= SENDF_STOP;
+            LeaveCriticalSection(&m_sendCritSect);
+            SetEvent(m_hSendEvent);
+            rcWait = WaitForSingleObject(m_hSendThread, SEND_STOP_TIMEOUT);
+            if (rcWait == WAIT_OBJECT_0)
+            {
+                CloseHandle(m_hSendThread);
+                m_hSendThread = NULL;
+            }
+            else
+            {
+                hr = (rcWait == WAIT_FAILED)?
+                        GETLASTHRESULT(): HRESULT_FROM_WIN32(WAIT_TIMEOUT);
+                TErr(("Failed waiting for the send thread to die (hr=%x).",
+                      hr));
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            if (m_hSpaceEvent != NULL)
+            {
+                CloseHandle(m_hSpaceEvent);
+                m_hSpaceEvent = NULL;
+            }
+
+            if (m_hSendEvent != NULL)
+            {
+                CloseHandle(m_hSendEvent);
+                m_hSendEvent = NULL;
+            }
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //StopSendThread
 
 public:
     /**
@@ -33,14 +278,35 @@ public:
         VOID
         ): m_server(NULL)
          , m_client(NULL)
+         , m_hSendThread(NULL)
+         , m_hSendEvent(NULL)
+         , m_hSpaceEvent(NULL)
+         , m_sendFlags(0)
+         , m_coalesceTime(0)
+         , m_coalesceBytes(SEND_BUFF_SIZE)
+         , m_queueTime(0)
+         , m_queueLen(0)
+         , m_hrSend(S_OK)
     {
         TLevel(INIT);
         TEnter();
+
+        __try
+        {
+            InitializeCriticalSection(&m_sendCritSect);
+        }
+        __except(EXCEPTION_EXECUTE_HANDLER)
+        {
+            TErr(("Failed to initialize critical section (err=%d).",
+                  GetExceptionCode()));
+        }
+
         TExit();
     }   //NetConn
 
     /**
-     *  Destructor for the NetConn clas.
+     *  Destructor for the NetConn clas. The owner must call Uninitialize
+     *  first and must not delete the object if it fails.
      */
     ~NetConn(
         VOID
@@ -49,8 +315,8 @@ public:
         TLevel(INIT);
         TEnter();
 
-        SAFE_DELETE(m_client);
-        SAFE_DELETE(m_server);
+        Uninitialize();
+        DeleteCriticalSection(&m_sendCritSect);
 
         TExit();
     }   //~NetConn
@@ -72,10 +338,18 @@ public:
         )
     {
         HRESULT hr = S_OK;
+        WsaServer::LISTEN_PARAMS listenParams = {0};
 
         TLevel(API);
         TEnterMsg(("configParams=%p,callback=%p", configParams, callback));
 
+        //
+        // Keep several receives posted so bursts of console output are
+        // absorbed while the previous ones are being printed. The console
+        // output itself is done on the dispatch thread.
+        //
+        listenParams.recvDepth = RECV_DEPTH;
+
         if ((m_server = new WsaServer()) == NULL)
         {
             hr = E_OUTOFMEMORY;
@@ -100,7 +374,9 @@ public:
         else if ((hr = m_server->StartListener(callback,
                                                NULL,
                                                RECV_BUFF_SIZE,
-                                               LISTENF_ASYNC)) != S_OK)
+                                               LISTENF_ASYNC |
+                                               LISTENF_DISPATCH,
+                                               &listenParams)) != S_OK)
         {
             MsgPrintf(g_progName, MSGTYPE_ERR, hr,
                       L"Failed to start server listener.");
@@ -115,11 +391,64 @@ public:
             MsgPrintf(g_progName, MSGTYPE_ERR, hr,
                       L"Failed to initialize client.");
         }
+        else if ((m_client != NULL) &&
+                 ((hr = StartSendThread(configParams)) != S_OK))
+        {
+            MsgPrintf(g_progName, MSGTYPE_ERR, hr,
+                      L"Failed to start send queue.");
+        }
 
         TExitMsg(("=%x", hr));
         return hr;
     }   //Initialize
 
+    /**
+     *  This function shuts down the network. The server is always stopped,
+     *  so no more data is delivered to the callback. If the send thread
+     *  does not die in time, it is still using the client and the send
+     *  queue, so the caller must leave the object to it instead of
+     *  deleting it.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    Uninitialize(
+        VOID
+        )
+    {
+        HRESULT hr;
+
+        TLevel(API);
+        TEnter();
+
+        hr = StopSendThread();
+        if ((m_server != NULL) && FAILED(m_server->StopListener()))
+        {
+            //
+            // A server thread is stuck and still using the server, leave
+            // the server to it.
+            //
+            m_server = NULL;
+        }
+        SAFE_DELETE(m_server);
+        if (SUCCEEDED(hr) && (m_client != NULL))
+        {
+            if (FAILED(m_client->Uninitialize()))
+            {
+                //
+                // The reconnect thread is stuck and still using the
+                // client, leave the client to it.
+                //
+                m_client = NULL;
+            }
+            SAFE_DELETE(m_client);
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //Uninitialize
+
     /**
      *  This function calls the client interface to send the data.
      *
@@ -160,5 +489,169 @@ public:
         return hr;
     }   //SendData
 
+    /**
+     *  This function queues a datagram for the client to send with the next
+     *  batch. The batch goes out with one send when it is full or when
+     *  FlushDatagrams is called.
+     *
+     *  @param pbBuff Points to the buffer.
+     *  @param dwcbLen Specifies the buffer size in bytes.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    QueueDatagram(
+        __in_bcount(dwcbLen) LPBYTE pbBuff,
+        __in                 DWORD  dwcbLen
+        )
+    {
+        HRESULT hr;
+
+        TLevel(API);
+        TEnterMsg(("pbBuff=%p,dwcbLen=%d", pbBuff, dwcbLen));
+
+        if (m_client != NULL)
+        {
+            hr = m_client->QueueDatagram(pbBuff, dwcbLen);
+        }
+        else
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_TARGET_HANDLE);
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //QueueDatagram
+
+    /**
+     *  This function sends the datagrams queued by QueueDatagram.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    FlushDatagrams(
+        VOID
+        )
+    {
+        HRESULT hr;
+
+        TLevel(API);
+        TEnter();
+
+        if (m_client != NULL)
+        {
+            hr = m_client->FlushDatagrams();
+        }
+        else
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_TARGET_HANDLE);
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //FlushDatagrams
+
+    /**
+     *  This function queues data to be sent by the send thread. Data is
+     *  coalesced with other queued data until the coalescing window expires
+     *  or the byte threshold is reached, control keys are sent right away.
+     *  If the queue is full, the caller waits for the send thread to make
+     *  room.
+     *
+     *  @param pbBuff Points to the buffer.
+     *  @param dwcbLen Specifies the buffer size in bytes.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code, which may be the failure of
+     *          an earlier queued send.
+     */
+    HRESULT
+    QueueData(
+        __in_bcount(dwcbLen) LPBYTE pbBuff,
+        __in                 DWORD  dwcbLen
+        )
+    {
+        HRESULT hr = S_OK;
+        BOOL fFlush;
+
+        TLevel(API);
+        TEnterMsg(("pbBuff=%p,dwcbLen=%d", pbBuff, dwcbLen));
+
+        fFlush = IsFlushData(pbBuff, dwcbLen);
+        if (m_hSendThread == NULL)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_TARGET_HANDLE);
+        }
+        else if ((dwcbLen == 0) || (dwcbLen > SEND_BUFF_SIZE))
+        {
+            hr = E_INVALIDARG;
+        }
+        else
+        {
+            EnterCriticalSection(&m_sendCritSect);
+            while (m_queueLen + dwcbLen > SEND_BUFF_SIZE)
+            {
+                //
+                // Let the send thread take what is queued and wait for it.
+                //
+                m_sendFlags |= SENDF_FLUSH;
+                LeaveCriticalSection(&m_sendCritSect);
+                SetEvent(m_hSendEvent);
+                WaitForSingleObject(m_hSpaceEvent, INFINITE);
+                EnterCriticalSection(&m_sendCritSect);
+            }
+
+            if (m_queueLen == 0)
+            {
+                m_queueTime = GetTickCount();
+            }
+            CopyMemory(m_queueBuff + m_queueLen, pbBuff, dwcbLen);
+            m_queueLen += dwcbLen;
+            if (fFlush)
+            {
+                m_sendFlags |= SENDF_FLUSH;
+            }
+            hr = m_hrSend;
+            m_hrSend = S_OK;
+            LeaveCriticalSection(&m_sendCritSect);
+            //
+            // Wake the send thread to start the window or flush.
+            //
+            SetEvent(m_hSendEvent);
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //QueueData
+
 };  //class NetConn
 
+#ifdef _MAIN_FILE
+/**
+ *  This function implements the send thread.
+ *
+ *  @param lpParam Points to thread data passed to the function.
+ *
+ *  @return Success: Returns ERROR_SUCCESS.
+ *  @return Failure: Returns Win32 error code.
+ */
+DWORD WINAPI
+SendThreadProc(
+    __in LPVOID lpParam
+    )
+{
+    DWORD rc;
+    NetConn *netConn = (NetConn *)lpParam;
+
+    TLevel(CALLBK);
+    TEnterMsg(("param=%p", lpParam));
+
+    rc = (DWORD)netConn->SendThread();
+
+    TExitMsg(("=%x", rc));
+    return rc;
+}   //SendThreadProc
+
+#endif
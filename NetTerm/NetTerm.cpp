@@ -28,17 +28,20 @@
 //
 LPCWSTR         g_progName = NULL;
 DWORD           g_progFlags = 0;
-FILE           *g_hLogFile = NULL;
+LogWriter      *g_logWriter = NULL;
 
 //
 // Local data.
 //
 LPWSTR          g_pszLogFile = NULL;
+LogWriter::LOG_PARAMS g_logParams = {DEF_LOG_FLUSH_TIME, 0, 0, 0};
 DWORD           g_teamNumber = 0;
 LPWSTR          g_pszLocal = NULL;
 LPWSTR          g_pszRemote = NULL;
 CONFIG_PARAMS   g_configParams = {L"10.0.0.2", L"6668", L"6666",
-                                  SOCK_DGRAM, IPPROTO_UDP};
+                                  SOCK_DGRAM, IPPROTO_UDP,
+                                  DEF_COALESCE_TIME, DEF_COALESCE_BYTES,
+                                  DEF_FRAME_RATE};
 ARG_ENTRY       g_cmdArgs[] =
                 {
                     {
@@ -87,7 +90,31 @@ ARG_ENTRY       g_cmdArgs[] =
                         L"log", ARGTYPE_STRING,
                         &g_pszLogFile, 0,
                         L"=<LogFile>",
-                        L"Write all received data to log file"
+                        L"Log received data (dropped if disk falls behind)"
+                    },
+                    {
+                        L"logflush", ARGTYPE_NUMERIC,
+                        &g_logParams.flushTime, 10,
+                        L"=<msec>",
+                        L"Specifies maximum log write delay (default: 1000)"
+                    },
+                    {
+                        L"logsync", ARGTYPE_SWITCH,
+                        &g_logParams.flags, LOGF_SYNC,
+                        NULL,
+                        L"Flush every log write to disk"
+                    },
+                    {
+                        L"logsize", ARGTYPE_NUMERIC,
+                        &g_logParams.maxFileSize, 10,
+                        L"=<KBytes>",
+                        L"Start a new log file at this size (default: none)"
+                    },
+                    {
+                        L"logtime", ARGTYPE_NUMERIC,
+                        &g_logParams.maxFileAge, 10,
+                        L"=<Minutes>",
+                        L"Start a new log file at this age (default: none)"
                     },
                     {
                         L"team", ARGTYPE_NUMERIC,
@@ -107,6 +134,24 @@ ARG_ENTRY       g_cmdArgs[] =
                         L"=<Addr>:<Port>",
                         L"Specifies remote IP and port (default: 10.0.0.2:6668)"
                     },
+                    {
+                        L"coalesce", ARGTYPE_NUMERIC,
+                        &g_configParams.coalesceTime, 10,
+                        L"=<msec>",
+                        L"Specifies keystroke coalescing window (default: 10)"
+                    },
+                    {
+                        L"coalescebytes", ARGTYPE_NUMERIC,
+                        &g_configParams.coalesceBytes, 10,
+                        L"=<Bytes>",
+                        L"Specifies keystroke coalescing size (default: 256)"
+                    },
+                    {
+                        L"fps", ARGTYPE_NUMERIC,
+                        &g_configParams.frameRate, 10,
+                        L"=<FramesPerSec>",
+                        L"Specifies console refresh rate limit (default: 60)"
+                    },
                     {
                         NULL, ARGTYPE_NONE,
                         NULL, 0,
@@ -195,9 +240,15 @@ wmain(
 
         if (g_pszLogFile != NULL)
         {
-            if (_wfopen_s(&g_hLogFile, g_pszLogFile, L"wb") != 0)
+            if ((g_logWriter = new LogWriter()) == NULL)
+            {
+                hr = E_OUTOFMEMORY;
+                MsgPrintf(g_progName, MSGTYPE_ERR, hr,
+                          L"Failed to create log writer.");
+            }
+            else if (FAILED(hr = g_logWriter->Initialize(g_pszLogFile,
+                                                         &g_logParams)))
             {
-                hr = HRESULT_FROM_WIN32(ERROR_OPEN_FAILED);
                 MsgPrintf(g_progName, MSGTYPE_ERR, hr,
                           L"Failed to create log file <%s>.",
                           g_pszLogFile);
@@ -260,7 +311,8 @@ wmain(
 
     if (SUCCEEDED(hr))
     {
-        if (((console = new Console(ConsoleCtrlHandler)) != NULL) &&
+        if (((console = new Console(ConsoleCtrlHandler,
+                                    g_configParams.frameRate)) != NULL) &&
             ((netConn = new NetConn()) != NULL))
         {
             PrintTitle();
@@ -290,6 +342,14 @@ wmain(
         else
         {
             DWORD dwcb;
+            //
+            // A UDP script read from a file is sent in batches of lines,
+            // one send per batch instead of one per line.
+            //
+            BOOL fBatchLines =
+                (g_configParams.sockType == SOCK_DGRAM) &&
+                (GetFileType(GetStdHandle(STD_INPUT_HANDLE)) ==
+                 FILE_TYPE_DISK);
 
             while (!(g_progFlags & NETTERMF_SHUTDOWN))
             {
@@ -299,10 +359,26 @@ wmain(
 
                     if (fgets(szLineBuff, ARRAYSIZE(szLineBuff), stdin))
                     {
-                        hr = netConn->SendData((LPBYTE)szLineBuff,
-                                                (DWORD)strlen(szLineBuff),
-                                                &dwcb,
-                                                INFINITE);
+                        if (fBatchLines)
+                        {
+                            hr = netConn->QueueDatagram(
+                                            (LPBYTE)szLineBuff,
+                                            (DWORD)strlen(szLineBuff));
+                        }
+                        else
+                        {
+                            hr = netConn->SendData((LPBYTE)szLineBuff,
+                                                    (DWORD)strlen(szLineBuff),
+                                                    &dwcb,
+                                                    INFINITE);
+                        }
+                    }
+                    else if (fBatchLines)
+                    {
+                        //
+                        // End of the script, send the rest of the batch.
+                        //
+                        hr = netConn->FlushDatagrams();
                     }
                 }
                 else
@@ -317,10 +393,7 @@ wmain(
                     }
                     else if (idx == 0)
                     {
-                        hr = netConn->SendData(ch,
-                                               1,
-                                               &dwcb,
-                                               INFINITE);
+                        hr = netConn->QueueData(ch, 1);
                     }
                     else if (ch[idx] == KEYCODE_CTRL_F12)
                     {
@@ -329,10 +402,7 @@ wmain(
                     }
                     else
                     {
-                        hr = netConn->SendData(ch,
-                                               2,
-                                               &dwcb,
-                                               INFINITE);
+                        hr = netConn->QueueData(ch, 2);
                         idx = 0;
                     }
                 }
@@ -346,12 +416,46 @@ wmain(
         }
     }
 
+    if ((netConn != NULL) && FAILED(netConn->Uninitialize()))
+    {
+        //
+        // The send thread is stuck and still using the object, leave it
+        // to the thread.
+        //
+        netConn = NULL;
+    }
     SAFE_DELETE(netConn);
+    if ((console != NULL) && FAILED(console->Uninitialize()))
+    {
+        //
+        // The render thread is stuck and still using the object, leave it
+        // to the thread.
+        //
+        console = NULL;
+    }
     SAFE_DELETE(console);
-    if (g_hLogFile != NULL)
+    if (g_logWriter != NULL)
     {
-        fclose(g_hLogFile);
+        DWORD droppedBytes;
+
+        if (FAILED(g_logWriter->Uninitialize()))
+        {
+            //
+            // The writer thread is stuck and still using the object, leave
+            // it to the thread.
+            //
+            MsgPrintf(g_progName, MSGTYPE_WARN, 0,
+                      L"Log file <%s> may be incomplete.", g_pszLogFile);
+            g_logWriter = NULL;
+        }
+        else if ((droppedBytes = g_logWriter->GetDroppedBytes()) > 0)
+        {
+            MsgPrintf(g_progName, MSGTYPE_WARN, 0,
+                      L"%d bytes of received data were not logged to <%s>.",
+                      droppedBytes, g_pszLogFile);
+        }
     }
+    SAFE_DELETE(g_logWriter);
 
     TExitMsg(("=%x", hr));
     return hr;
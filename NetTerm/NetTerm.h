@@ -40,6 +40,14 @@
 #define REGSTR_VALUE_LOCALPORT  L"LocalPort"
 
 #define RECV_BUFF_SIZE          1024
+#define RECV_DEPTH              16
+#define SEND_BUFF_SIZE          512
+#define SEND_STOP_TIMEOUT       1000
+#define DEF_COALESCE_TIME       10
+#define DEF_COALESCE_BYTES      256
+#define DEF_FRAME_RATE          60
+#define RENDER_STOP_TIMEOUT     1000
+#define DEF_LOG_FLUSH_TIME      1000
 
 #define KEYCODE_EXTENDED        0xe0
 #define KEYCODE_F12             0x86
@@ -55,13 +63,16 @@ typedef struct _ConfigParams
     WCHAR szLocalPort[8];
     int   sockType;
     int   protocol;
+    DWORD coalesceTime;
+    DWORD coalesceBytes;
+    DWORD frameRate;
 } CONFIG_PARAMS, *PCONFIG_PARAMS;
 
 //
 // Global data.
 //
 extern DWORD   g_progFlags;
-extern FILE   *g_hLogFile;
+extern LogWriter *g_logWriter;
 extern CmdArg  g_cmdArg;
 
 //
@@ -25,6 +25,11 @@
 #include <strsafe.h>
 #include <stdlib.h>
 #include <conio.h>
+#include <intrin.h>
+#include <emmintrin.h>
+#ifdef __AVX2__
+  #include <immintrin.h>
+#endif
 
 //#define _ENABLE_FUNCTRACE
 //#define _ENABLE_MSGTRACE
@@ -40,7 +45,13 @@
 #define MOD_CMDARG              TGenModId(5)
 #define MOD_CLIENT              TGenModId(6)
 #define MOD_SERVER              TGenModId(7)
-#define MOD_DLIST               TGenModId(8)
+#define MOD_TLIST               TGenModId(8)
+#define MOD_BUFFPOOL            TGenModId(9)
+#define MOD_LFQUEUE             TGenModId(10)
+#define MOD_LFREG               TGenModId(11)
+#define MOD_ANSISCAN            TGenModId(12)
+#define MOD_VTSCREEN            TGenModId(13)
+#define MOD_LOGWRITER           TGenModId(14)
 
 #define TRACE_MODULES           (MOD_MAIN)
 #define TRACE_LEVEL             FUNC
@@ -67,7 +78,13 @@ extern LPCWSTR g_progName;
 #include "Util.h"
 #include "CmdArg.h"
 #include "Ansi.h"
-#include "DList.h"
+#include "AnsiScan.h"
+#include "VtScreen.h"
+#include "TList.h"
+#include "BuffPool.h"
+#include "LfQueue.h"
+#include "LfRegistry.h"
+#include "LogWriter.h"
 #include "WsaServer.h"
 #include "WsaClient.h"
 #include "NetTerm.h"
@@ -53,7 +53,23 @@ public:
         TLevel(INIT);
         TEnter();
 
+        if ((m_client != NULL) && FAILED(m_client->Uninitialize()))
+        {
+            //
+            // The reconnect thread is stuck and still using the client,
+            // leave the client to it.
+            //
+            m_client = NULL;
+        }
         SAFE_DELETE(m_client);
+        if ((m_server != NULL) && FAILED(m_server->StopListener()))
+        {
+            //
+            // A server thread is stuck and still using the server, leave
+            // the server to it.
+            //
+            m_server = NULL;
+        }
         SAFE_DELETE(m_server);
 
         TExit();
@@ -165,6 +181,48 @@ public:
         return;
     }   //DataReceived
 
+    /**
+     *  This is a callback from the server with a leased receive buffer. The
+     *  buffer is kept and handed to the main window thread without copying
+     *  it; the window procedure releases the lease once the text is shown.
+     *
+     *  @param connHandle Specifies the handle of the connection receiving
+     *         the data.
+     *  @param context Specifies the callback context.
+     *  @param hLease Specifies the lease handle of the buffer.
+     *  @param recvBuff Points to the buffer containing the received data.
+     *  @param recvLen Specifies the length of the received data.
+     */
+    VOID
+    DataLeased(
+        __in                        HANDLE connHandle,
+        __in_opt                    LPVOID context,
+        __in                        HANDLE hLease,
+        __inout_bcount(recvLen + 1) LPBYTE recvBuff,
+        __in                        DWORD recvLen
+        )
+    {
+        TLevel(CALLBK);
+        TEnterMsg(("hConn=%p,ctxt=%p,hLease=%p,buff=%p,len=%d",
+                   connHandle, context, hLease, recvBuff, recvLen));
+
+        UNREFERENCED_PARAMETER(connHandle);
+
+        recvBuff[recvLen] = '\0';
+        WsaServer::AddRefLease(hLease);
+        if (!PostMessage(GetParent((HWND)context),
+                         WM_NETDATA,
+                         (WPARAM)hLease,
+                         (LPARAM)recvBuff))
+        {
+            TErr(("Failed to post received data (err=%d).", GetLastError()));
+            WsaServer::ReleaseLease(hLease);
+        }
+
+        TExit();
+        return;
+    }   //DataLeased
+
     /**
      *  This function calls the client interface to send the data.
      *
@@ -198,5 +256,39 @@ public:
         return hr;
     }   //SendData
 
+    /**
+     *  This function calls the client interface to send several buffers as
+     *  one message.
+     *
+     *  @param buffs Points to the array of buffers.
+     *  @param numBuffs Specifies the number of buffers.
+     *  @param lpdwcb Points to a variable to hold the number of characters
+     *         written.
+     *  @param dwTimeout Specifies the timeout value in milli-seconds, can be
+     *         INFINITE.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    SendDataV(
+        __in_ecount(numBuffs) LPWSABUF buffs,
+        __in                  DWORD    numBuffs,
+        __out                 LPDWORD  lpdwcb,
+        __in                  DWORD    dwTimeout
+        )
+    {
+        HRESULT hr;
+
+        TLevel(API);
+        TEnterMsg(("buffs=%p,numBuffs=%d,lpdwcb=%p,Timeout=%d",
+                   buffs, numBuffs, lpdwcb, dwTimeout));
+
+        hr = m_client->SyncWriteV(buffs, numBuffs, lpdwcb, dwTimeout);
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //SendDataV
+
 };  //class NetConn
 
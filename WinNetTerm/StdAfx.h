@@ -39,7 +39,10 @@
 #define MOD_UTIL                TGenModId(3)
 #define MOD_CLIENT              TGenModId(4)
 #define MOD_SERVER              TGenModId(5)
-#define MOD_DLIST               TGenModId(6)
+#define MOD_TLIST               TGenModId(6)
+#define MOD_BUFFPOOL            TGenModId(7)
+#define MOD_LFQUEUE             TGenModId(8)
+#define MOD_LFREG               TGenModId(9)
 
 #define TRACE_MODULES           (MOD_MAIN | MOD_TERMINAL | MOD_CONFIG)
 #define TRACE_LEVEL             FUNC
@@ -61,7 +64,10 @@
 
 #include "DbgTrace.h"
 #include "Ansi.h"
-#include "DList.h"
+#include "TList.h"
+#include "BuffPool.h"
+#include "LfQueue.h"
+#include "LfRegistry.h"
 #include "WsaServer.h"
 #include "WsaClient.h"
 #include "Resource.h"
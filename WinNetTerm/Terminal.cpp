@@ -288,6 +288,11 @@ TerminalWndProc(
         PostQuitMessage(0);
         break;
 
+    case WM_NETDATA:
+        SendMessageA(g_hwndTerm, EM_REPLACESEL, FALSE, lParam);
+        WsaServer::ReleaseLease((HANDLE)wParam);
+        break;
+
     case WM_CTLCOLORSTATIC:
         if ((HWND)lParam == g_hwndTerm)
         {
@@ -347,7 +352,9 @@ TerminalWndProc(
 
         case IDC_BUTTON_SEND:
         {
+            static char szNewLine[] = "\n";
             DWORD dwcb;
+            WSABUF buffs[2];
 
             GetDlgItemTextW(hwnd,
                             IDC_INPUT_TEXT,
@@ -361,11 +368,15 @@ TerminalWndProc(
                                        sizeof(g_sendBuff),
                                        NULL,
                                        NULL);
-            StringCbCatA((LPSTR)g_sendBuff, sizeof(g_sendBuff), "\n");
-            g_netConn->SendData((LPBYTE)g_sendBuff,
-                                strlen((LPSTR)g_sendBuff),
-                                &dwcb,
-                                INFINITE);
+            //
+            // Send the line and its terminator as one message without
+            // appending one to the other.
+            //
+            buffs[0].len = (dwcb > 0)? dwcb - 1: 0;
+            buffs[0].buf = g_sendBuff;
+            buffs[1].len = sizeof(szNewLine) - 1;
+            buffs[1].buf = szNewLine;
+            g_netConn->SendDataV(buffs, ARRAYSIZE(buffs), &dwcb, INFINITE);
 #if 0
             MsgPrintf(g_progName, MSGTYPE_INFO, 0,
                       L"len=%d, String=<%S>",
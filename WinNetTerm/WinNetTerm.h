@@ -42,6 +42,12 @@
 #define MSGTYPE_WARN            1
 #define MSGTYPE_ERR             2
 
+//
+// Posted to the main window with a leased receive buffer.
+// wParam is the lease handle, lParam points to the NUL terminated data.
+//
+#define WM_NETDATA              (WM_APP + 1)
+
 //
 // Type definitions.
 //
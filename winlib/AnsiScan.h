@@ -0,0 +1,382 @@
+#if 0
+/// Copyright (c) Titan Robotics Club. All rights reserved.
+///
+/// <module name="AnsiScan.h" />
+///
+/// <summary>
+///     This module contains the definition and implementation of the
+///     AnsiScan class.
+/// </summary>
+///
+/// <remarks>
+///     Environment: Windows application.
+/// </remarks>
+#endif
+
+#pragma once
+
+#ifdef MOD_ID
+    #undef MOD_ID
+#endif
+#define MOD_ID                  MOD_ANSISCAN
+
+//
+// SSE2 is part of every x64 processor, on x86 it is used when the compiler
+// targets it (/arch:SSE2, which the NetTerm project sets).
+//
+#if defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+    #define ANSISCAN_SSE2
+#endif
+
+/**
+ *  This class implements a streaming scanner for text with embedded ANSI
+ *  escape sequences. ESC bytes are searched 16 (SSE2) or 32 (AVX2) bytes at
+ *  a time, so plain text is skipped at close to memchr speed, and each
+ *  control sequence is parsed into its numeric parameters in the same pass.
+ *  The text is fed in buffers of any length and is not modified. A sequence
+ *  split across two buffers is completed by the next one, so the scanner
+ *  must be kept for the whole stream.
+ */
+class AnsiScan
+{
+public:
+    //
+    // Public constants.
+    //
+    #define ANSI_ESC                    0x1b
+    #define ANSI_CSI                    '['
+    #define ANSI_MAX_PARAMS             16
+    #define ANSI_MAX_PARAM_VALUE        0xffff
+
+    //
+    // A run of plain text, optionally followed by a control sequence. If
+    // final is 0, no sequence follows the text. The prefix is the private
+    // parameter marker ('<', '=', '>' or '?') or 0 if there is none.
+    //
+    typedef struct _AnsiSpan
+    {
+        LPCSTR      text;
+        DWORD       textLen;
+        char        final;
+        char        prefix;
+        DWORD       numParams;
+        int         params[ANSI_MAX_PARAMS];
+    } ANSISPAN, *PANSISPAN;
+
+private:
+    #define ANSISTATE_GROUND            0
+    #define ANSISTATE_ESC               1
+    #define ANSISTATE_CSI               2
+
+    //
+    // Private data.
+    //
+    LPCSTR      m_next;
+    LPCSTR      m_end;
+    int         m_state;
+    char        m_prefix;
+    int         m_value;
+    DWORD       m_numParams;
+    int         m_params[ANSI_MAX_PARAMS];
+
+    /**
+     *  This function finds the next ESC byte.
+     *
+     *  @param psz Points to the text to search.
+     *  @param end Points past the end of the text.
+     *
+     *  @return Success: Returns a pointer to the ESC byte.
+     *  @return Failure: Returns end if there is none.
+     */
+    static
+    LPCSTR
+    FindEsc(
+        __in LPCSTR psz,
+        __in LPCSTR end
+        )
+    {
+        LPCSTR found = NULL;
+
+        TLevel(HIFREQ);
+        TEnterMsg(("psz=%p,len=%d", psz, end - psz));
+
+#if defined(__AVX2__)
+        {
+            __m256i esc32 = _mm256_set1_epi8(ANSI_ESC);
+            unsigned long idx;
+
+            while ((found == NULL) && (end - psz >= 32))
+            {
+                int mask = _mm256_movemask_epi8(
+                                _mm256_cmpeq_epi8(
+                                    _mm256_loadu_si256((const __m256i *)psz),
+                                    esc32));
+
+                if (mask != 0)
+                {
+                    _BitScanForward(&idx, (unsigned long)mask);
+                    found = psz + idx;
+                }
+                else
+                {
+                    psz += 32;
+                }
+            }
+        }
+#endif
+#if defined(ANSISCAN_SSE2)
+        {
+            __m128i esc16 = _mm_set1_epi8(ANSI_ESC);
+            unsigned long idx;
+
+            while ((found == NULL) && (end - psz >= 16))
+            {
+                int mask = _mm_movemask_epi8(
+                                _mm_cmpeq_epi8(
+                                    _mm_loadu_si128((const __m128i *)psz),
+                                    esc16));
+
+                if (mask != 0)
+                {
+                    _BitScanForward(&idx, (unsigned long)mask);
+                    found = psz + idx;
+                }
+                else
+                {
+                    psz += 16;
+                }
+            }
+        }
+#endif
+
+        if (found == NULL)
+        {
+            //
+            // Scalar fallback, also covers the tail shorter than a vector.
+            //
+            found = (LPCSTR)memchr(psz, ANSI_ESC, end - psz);
+            if (found == NULL)
+            {
+                found = end;
+            }
+        }
+
+        TExitMsg(("=%p", found));
+        return found;
+    }   //FindEsc
+
+    /**
+     *  This function adds the parameter being parsed to the sequence.
+     */
+    VOID
+    EndParam(
+        VOID
+        )
+    {
+        TLevel(HIFREQ);
+        TEnterMsg(("value=%d,n=%d", m_value, m_numParams));
+
+        if (m_numParams < ANSI_MAX_PARAMS)
+        {
+            m_params[m_numParams++] = (m_value < 0)? 0: m_value;
+        }
+        m_value = -1;
+
+        TExit();
+        return;
+    }   //EndParam
+
+    /**
+     *  This function feeds one byte of an escape sequence to the state
+     *  machine.
+     *
+     *  @param ch Specifies the byte.
+     *  @param span Points to the span to fill in when the sequence ends.
+     *
+     *  @return Success: Returns TRUE if the byte is consumed.
+     *  @return Failure: Returns FALSE if the byte aborts the sequence and
+     *          must be handled as text.
+     */
+    BOOL
+    ParseSeqByte(
+        __in    char ch,
+        __inout PANSISPAN span
+        )
+    {
+        BOOL rc = TRUE;
+
+        TLevel(HIFREQ);
+        TEnterMsg(("ch=%x,state=%d", (BYTE)ch, m_state));
+
+        if (ch == ANSI_ESC)
+        {
+            //
+            // ESC always starts over.
+            //
+            m_state = ANSISTATE_ESC;
+        }
+        else if (m_state == ANSISTATE_ESC)
+        {
+            if (ch == ANSI_CSI)
+            {
+                m_state = ANSISTATE_CSI;
+                m_prefix = 0;
+                m_value = -1;
+                m_numParams = 0;
+            }
+            else if ((ch < 0x20) || (ch > 0x2f))
+            {
+                //
+                // Not a control sequence, drop the escape. Intermediate
+                // bytes (0x20-0x2f) such as in "ESC(B" are skipped.
+                //
+                m_state = ANSISTATE_GROUND;
+            }
+        }
+        else if ((ch >= '0') && (ch <= '9'))
+        {
+            m_value = (m_value < 0)? 0: m_value;
+            if (m_value <= ANSI_MAX_PARAM_VALUE)
+            {
+                m_value = m_value*10 + (ch - '0');
+            }
+        }
+        else if ((ch == ';') || (ch == ':'))
+        {
+            EndParam();
+        }
+        else if ((ch >= '<') && (ch <= '?'))
+        {
+            if ((m_numParams == 0) && (m_value < 0) && (m_prefix == 0))
+            {
+                m_prefix = ch;
+            }
+        }
+        else if ((ch >= 0x40) && (ch <= 0x7e))
+        {
+            if ((m_value >= 0) || (m_numParams > 0))
+            {
+                EndParam();
+            }
+            span->final = ch;
+            span->prefix = m_prefix;
+            span->numParams = m_numParams;
+            CopyMemory(span->params, m_params, m_numParams*sizeof(int));
+            m_state = ANSISTATE_GROUND;
+        }
+        else if ((ch < 0x20) || (ch > 0x2f))
+        {
+            //
+            // Not allowed inside a control sequence. Intermediate bytes
+            // (0x20-0x2f) are skipped.
+            //
+            m_state = ANSISTATE_GROUND;
+            rc = FALSE;
+        }
+
+        TExitMsg(("=%d (state=%d)", rc, m_state));
+        return rc;
+    }   //ParseSeqByte
+
+public:
+    /**
+     *  Constructor of the class object.
+     */
+    AnsiScan(
+        VOID
+        ): m_next(NULL)
+         , m_end(NULL)
+         , m_state(ANSISTATE_GROUND)
+         , m_prefix(0)
+         , m_value(-1)
+         , m_numParams(0)
+    {
+        TLevel(INIT);
+        TEnter();
+        TExit();
+        return;
+    }   //AnsiScan
+
+    /**
+     *  This function starts scanning the next buffer of the stream. Any
+     *  sequence left unfinished by the previous buffer is continued.
+     *
+     *  @param text Points to the text to scan. It must stay valid until
+     *         NextSpan returns FALSE.
+     *  @param len Specifies the length of the text.
+     */
+    VOID
+    SetText(
+        __in_ecount(len) LPCSTR text,
+        __in             DWORD len
+        )
+    {
+        TLevel(API);
+        TEnterMsg(("text=%p,len=%d,state=%d", text, len, m_state));
+
+        m_next = text;
+        m_end = text + len;
+
+        TExit();
+        return;
+    }   //SetText
+
+    /**
+     *  This function returns the next span of text and the control sequence
+     *  following it. Empty parameters read as 0, so "ESC[;1m" yields 0 and
+     *  1, and "ESC[m" yields no parameters. A byte not allowed inside a
+     *  sequence cancels it and is returned as text. Other escapes are
+     *  dropped.
+     *
+     *  @param span Points to the span to fill in.
+     *
+     *  @return Success: Returns TRUE.
+     *  @return Failure: Returns FALSE if the whole buffer has been scanned.
+     */
+    BOOL
+    NextSpan(
+        __out PANSISPAN span
+        )
+    {
+        BOOL rc = FALSE;
+
+        TLevel(HIFREQ);
+        TEnterMsg(("span=%p", span));
+
+        if (m_next < m_end)
+        {
+            span->text = m_next;
+            span->textLen = 0;
+            span->final = 0;
+            span->prefix = 0;
+            span->numParams = 0;
+            rc = TRUE;
+
+            if (m_state == ANSISTATE_GROUND)
+            {
+                LPCSTR esc = FindEsc(m_next, m_end);
+
+                span->textLen = (DWORD)(esc - m_next);
+                m_next = esc;
+                if (esc < m_end)
+                {
+                    m_state = ANSISTATE_ESC;
+                    m_next++;
+                }
+            }
+
+            while ((m_state != ANSISTATE_GROUND) && (m_next < m_end))
+            {
+                if (ParseSeqByte(*m_next, span))
+                {
+                    m_next++;
+                }
+            }
+        }
+
+        TExitMsg(("=%d (len=%d,final=%x,params=%d,state=%d)",
+                  rc, rc? span->textLen: 0, rc? span->final: 0,
+                  rc? span->numParams: 0, m_state));
+        return rc;
+    }   //NextSpan
+};  //class AnsiScan
@@ -0,0 +1,483 @@
+#if 0
+/// Copyright (c) Titan Robotics Club. All rights reserved.
+///
+/// <module name="BuffPool.h" />
+///
+/// <summary>
+///     This module contains the definition and implementation of the
+///     BuffPool class.
+/// </summary>
+///
+/// <remarks>
+///     Environment: Windows application.
+/// </remarks>
+#endif
+
+#pragma once
+
+#ifdef MOD_ID
+    #undef MOD_ID
+#endif
+#define MOD_ID                  MOD_BUFFPOOL
+
+/**
+ *  This class implements a pool of fixed-size memory blocks. Blocks are
+ *  carved out of cache line aligned slabs and each block starts on a cache
+ *  line boundary, so two blocks never share a line. Free blocks are kept on
+ *  a lock-free list; the pool only takes a lock when it has to grow by
+ *  another slab. Slabs are not returned to the heap until the pool is
+ *  uninitialized.
+ *
+ *  A thread that allocates or frees a lot may keep its own BUFFCACHE. Freed
+ *  blocks are collected in the cache and handed back to the pool as a whole
+ *  magazine of BUFFPOOL_MAGAZINE_SIZE blocks, which another thread's cache
+ *  can pick up again in one operation.
+ */
+class BuffPool
+{
+public:
+    //
+    // Public constants.
+    //
+    #define BUFFPOOL_MAGAZINE_SIZE      16
+
+    struct _freeBlock;
+
+    //
+    // Per-thread block cache. It must be zero initialized and only be used
+    // by one thread at a time.
+    //
+    typedef struct _BuffCache
+    {
+        struct _freeBlock *head;
+        DWORD       numBlocks;
+    } BUFFCACHE, *PBUFFCACHE;
+
+private:
+    #define CACHE_LINE_SIZE             64
+
+    typedef struct _freeBlock
+    {
+        SLIST_ENTRY entry;
+        struct _freeBlock *next;
+        DWORD       numBlocks;
+    } FREEBLOCK, *PFREEBLOCK;
+
+    typedef struct _slab
+    {
+        struct _slab *next;
+    } SLAB, *PSLAB;
+
+    //
+    // Private data.
+    //
+    SLIST_HEADER     m_freeList;
+    SLIST_HEADER     m_magazineList;
+    CRITICAL_SECTION m_CritSect;
+    PSLAB            m_slabs;
+    DWORD            m_blockSize;
+    DWORD            m_blocksPerSlab;
+    DWORD            m_numBlocks;
+
+    /**
+     *  This function adds another slab of blocks to the pool.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    Grow(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(FUNC);
+        TEnter();
+
+        EnterCriticalSection(&m_CritSect);
+        if ((QueryDepthSList(&m_freeList) == 0) &&
+            (QueryDepthSList(&m_magazineList) == 0))
+        {
+            SIZE_T slabSize = CACHE_LINE_SIZE +
+                              (SIZE_T)m_blocksPerSlab*m_blockSize;
+            PSLAB slab = (PSLAB)_aligned_malloc(slabSize, CACHE_LINE_SIZE);
+
+            if (slab == NULL)
+            {
+                hr = E_OUTOFMEMORY;
+                TErr(("Failed to allocate slab (len=%d).", slabSize));
+            }
+            else
+            {
+                //
+                // The slab header takes the first cache line, the blocks
+                // follow it.
+                //
+                LPBYTE pbBlocks = (LPBYTE)slab + CACHE_LINE_SIZE;
+
+                slab->next = m_slabs;
+                m_slabs = slab;
+                for (DWORD i = 0; i < m_blocksPerSlab; i++)
+                {
+                    InterlockedPushEntrySList(
+                        &m_freeList,
+                        &((PFREEBLOCK)(pbBlocks + i*m_blockSize))->entry);
+                }
+                m_numBlocks += m_blocksPerSlab;
+            }
+        }
+        LeaveCriticalSection(&m_CritSect);
+
+        TExitMsg(("=%x (blocks=%d)", hr, m_numBlocks));
+        return hr;
+    }   //Grow
+
+    /**
+     *  This function takes a block from the shared free lists, growing the
+     *  pool if they are empty.
+     *
+     *  @return Success: Returns the block.
+     *  @return Failure: Returns NULL.
+     */
+    PFREEBLOCK
+    AllocShared(
+        VOID
+        )
+    {
+        PFREEBLOCK block = NULL;
+
+        TLevel(HIFREQ);
+        TEnter();
+
+        for (;;)
+        {
+            PSLIST_ENTRY entry;
+
+            if ((entry = InterlockedPopEntrySList(&m_freeList)) != NULL)
+            {
+                block = CONTAINING_RECORD(entry, FREEBLOCK, entry);
+                break;
+            }
+            else if ((entry = InterlockedPopEntrySList(&m_magazineList)) !=
+                     NULL)
+            {
+                //
+                // Break up a magazine, keep its first block and put the
+                // rest on the free list.
+                //
+                block = CONTAINING_RECORD(entry, FREEBLOCK, entry);
+                for (PFREEBLOCK rest = block->next; rest != NULL;)
+                {
+                    PFREEBLOCK next = rest->next;
+
+                    InterlockedPushEntrySList(&m_freeList, &rest->entry);
+                    rest = next;
+                }
+                break;
+            }
+            else if (FAILED(Grow()))
+            {
+                break;
+            }
+        }
+
+        TExitMsg(("=%p", block));
+        return block;
+    }   //AllocShared
+
+public:
+    /**
+     *  Constructor of the class object.
+     */
+    BuffPool(
+        VOID
+        ): m_slabs(NULL)
+         , m_blockSize(0)
+         , m_blocksPerSlab(0)
+         , m_numBlocks(0)
+    {
+        TLevel(INIT);
+        TEnter();
+
+        InitializeSListHead(&m_freeList);
+        InitializeSListHead(&m_magazineList);
+        __try
+        {
+            InitializeCriticalSection(&m_CritSect);
+        }
+        __except(EXCEPTION_EXECUTE_HANDLER)
+        {
+            TErr(("Failed to initialize critical section (err=%d).",
+                  GetExceptionCode()));
+        }
+
+        TExit();
+        return;
+    }   //BuffPool
+
+    /**
+     *  Desctructor of the class object. If blocks are still in use, the
+     *  slabs are leaked rather than freed under their users.
+     */
+    ~BuffPool(
+        VOID
+        )
+    {
+        TLevel(INIT);
+        TEnter();
+
+        Uninitialize();
+        DeleteCriticalSection(&m_CritSect);
+
+        TExit();
+        return;
+    }   //~BuffPool
+
+    /**
+     *  This function initializes the pool.
+     *
+     *  @param blockSize Specifies the size of a block in bytes. It is
+     *         rounded up to a multiple of the cache line size.
+     *  @param blocksPerSlab Specifies the number of blocks the pool grows
+     *         by at a time.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    Initialize(
+        __in DWORD blockSize,
+        __in DWORD blocksPerSlab
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(INIT);
+        TEnterMsg(("blockSize=%d,blocksPerSlab=%d", blockSize, blocksPerSlab));
+
+        if ((blockSize == 0) || (blocksPerSlab == 0))
+        {
+            TWarn(("Invalid parameter."));
+            hr = E_INVALIDARG;
+        }
+        else if (m_blockSize != 0)
+        {
+            TErr(("BuffPool has already been initialized."));
+            hr = HRESULT_FROM_WIN32(ERROR_ALREADY_INITIALIZED);
+        }
+        else
+        {
+            if (blockSize < sizeof(FREEBLOCK))
+            {
+                blockSize = sizeof(FREEBLOCK);
+            }
+            m_blockSize = (blockSize + CACHE_LINE_SIZE - 1) &
+                          ~(CACHE_LINE_SIZE - 1);
+            m_blocksPerSlab = blocksPerSlab;
+        }
+
+        TExitMsg(("=%x (blockSize=%d)", hr, m_blockSize));
+        return hr;
+    }   //Initialize
+
+    /**
+     *  This function frees all slabs of the pool. All caches must have been
+     *  flushed before this is called. Blocks may still be freed from other
+     *  threads meanwhile; if any block is still in use, the pool is left
+     *  as is.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    Uninitialize(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(INIT);
+        TEnter();
+
+        EnterCriticalSection(&m_CritSect);
+        if (m_slabs != NULL)
+        {
+            DWORD numFree = QueryDepthSList(&m_freeList);
+            PSLIST_ENTRY entry = InterlockedFlushSList(&m_magazineList);
+
+            //
+            // Count the magazines and put them back, nobody else takes
+            // them off the list once the caches are gone.
+            //
+            while (entry != NULL)
+            {
+                PSLIST_ENTRY next = entry->Next;
+
+                numFree += CONTAINING_RECORD(entry, FREEBLOCK, entry)->numBlocks;
+                InterlockedPushEntrySList(&m_magazineList, entry);
+                entry = next;
+            }
+
+            if (numFree != m_numBlocks)
+            {
+                hr = HRESULT_FROM_WIN32(ERROR_BUSY);
+                TErr(("BuffPool still has blocks in use (Blocks=%d,Free=%d).",
+                      m_numBlocks, numFree));
+            }
+            else
+            {
+                InterlockedFlushSList(&m_freeList);
+                InterlockedFlushSList(&m_magazineList);
+                while (m_slabs != NULL)
+                {
+                    PSLAB slab = m_slabs;
+
+                    m_slabs = slab->next;
+                    _aligned_free(slab);
+                }
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            m_blockSize = 0;
+            m_blocksPerSlab = 0;
+            m_numBlocks = 0;
+        }
+        LeaveCriticalSection(&m_CritSect);
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //Uninitialize
+
+    /**
+     *  This function returns the block size of the pool.
+     *
+     *  @return Returns the block size in bytes.
+     */
+    DWORD
+    GetBlockSize(
+        VOID
+        )
+    {
+        TLevel(API);
+        TEnter();
+        TExitMsg(("=%d", m_blockSize));
+        return m_blockSize;
+    }   //GetBlockSize
+
+    /**
+     *  This function allocates a block from the pool. The block content is
+     *  not initialized.
+     *
+     *  @param cache Points to the cache of the calling thread, can be NULL.
+     *
+     *  @return Success: Returns the cache line aligned block.
+     *  @return Failure: Returns NULL.
+     */
+    LPVOID
+    Alloc(
+        __inout_opt PBUFFCACHE cache = NULL
+        )
+    {
+        PFREEBLOCK block = NULL;
+
+        TLevel(HIFREQ);
+        TEnterMsg(("cache=%p", cache));
+
+        if ((cache != NULL) && (cache->head == NULL))
+        {
+            PSLIST_ENTRY entry = InterlockedPopEntrySList(&m_magazineList);
+
+            if (entry != NULL)
+            {
+                //
+                // Refill the cache with a whole magazine.
+                //
+                cache->head = CONTAINING_RECORD(entry, FREEBLOCK, entry);
+                cache->numBlocks = cache->head->numBlocks;
+            }
+        }
+
+        if ((cache != NULL) && (cache->head != NULL))
+        {
+            block = cache->head;
+            cache->head = block->next;
+            cache->numBlocks--;
+        }
+        else
+        {
+            block = AllocShared();
+        }
+
+        TExitMsg(("=%p", block));
+        return block;
+    }   //Alloc
+
+    /**
+     *  This function returns a block to the pool.
+     *
+     *  @param pv Points to the block.
+     *  @param cache Points to the cache of the calling thread, can be NULL.
+     */
+    VOID
+    Free(
+        __in        LPVOID pv,
+        __inout_opt PBUFFCACHE cache = NULL
+        )
+    {
+        PFREEBLOCK block = (PFREEBLOCK)pv;
+
+        TLevel(HIFREQ);
+        TEnterMsg(("block=%p,cache=%p", pv, cache));
+
+        if (block == NULL)
+        {
+            TWarn(("Invalid parameter."));
+        }
+        else if (cache != NULL)
+        {
+            if (cache->numBlocks >= BUFFPOOL_MAGAZINE_SIZE)
+            {
+                FlushCache(cache);
+            }
+            block->next = cache->head;
+            cache->head = block;
+            cache->numBlocks++;
+        }
+        else
+        {
+            InterlockedPushEntrySList(&m_freeList, &block->entry);
+        }
+
+        TExit();
+        return;
+    }   //Free
+
+    /**
+     *  This function hands all blocks held by a cache back to the pool as
+     *  one magazine.
+     *
+     *  @param cache Points to the cache.
+     */
+    VOID
+    FlushCache(
+        __inout PBUFFCACHE cache
+        )
+    {
+        TLevel(FUNC);
+        TEnterMsg(("cache=%p,blocks=%d", cache, cache->numBlocks));
+
+        if (cache->head != NULL)
+        {
+            cache->head->numBlocks = cache->numBlocks;
+            InterlockedPushEntrySList(&m_magazineList, &cache->head->entry);
+            cache->head = NULL;
+            cache->numBlocks = 0;
+        }
+
+        TExit();
+        return;
+    }   //FlushCache
+};  //class BuffPool
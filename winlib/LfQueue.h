@@ -0,0 +1,285 @@
+#if 0
+/// Copyright (c) Titan Robotics Club. All rights reserved.
+///
+/// <module name="LfQueue.h" />
+///
+/// <summary>
+///     This module contains the definition and implementation of the
+///     LfQueue class.
+/// </summary>
+///
+/// <remarks>
+///     Environment: Windows application.
+/// </remarks>
+#endif
+
+#pragma once
+
+#ifdef MOD_ID
+    #undef MOD_ID
+#endif
+#define MOD_ID                  MOD_LFQUEUE
+
+/**
+ *  This class implements a bounded lock-free queue. Any number of threads
+ *  may enqueue and dequeue at the same time. Each slot carries a sequence
+ *  number that tells whether it is free for the producer at a position or
+ *  filled for the consumer at that position, so neither side ever takes a
+ *  lock. The producer and consumer positions live on separate cache lines.
+ *  Elements are copied in and out, so T should be a plain structure.
+ */
+template<class T>
+class LfQueue
+{
+private:
+    #define LFQ_PAD_SIZE                64
+
+    typedef struct _cell
+    {
+        LONG volatile sequence;
+        T           data;
+    } CELL, *PCELL;
+
+    //
+    // Private data.
+    //
+    PCELL           m_cells;
+    LONG            m_mask;
+    BYTE            m_pad0[LFQ_PAD_SIZE];
+    LONG volatile   m_enqueuePos;
+    BYTE            m_pad1[LFQ_PAD_SIZE];
+    LONG volatile   m_dequeuePos;
+    BYTE            m_pad2[LFQ_PAD_SIZE];
+
+public:
+    /**
+     *  Constructor of the class object.
+     */
+    LfQueue(
+        VOID
+        ): m_cells(NULL)
+         , m_mask(0)
+         , m_enqueuePos(0)
+         , m_dequeuePos(0)
+    {
+        TLevel(INIT);
+        TEnter();
+        TExit();
+        return;
+    }   //LfQueue
+
+    /**
+     *  Desctructor of the class object.
+     */
+    ~LfQueue(
+        VOID
+        )
+    {
+        TLevel(INIT);
+        TEnter();
+
+        Uninitialize();
+
+        TExit();
+        return;
+    }   //~LfQueue
+
+    /**
+     *  This function allocates the queue slots.
+     *
+     *  @param capacity Specifies the number of slots. It is rounded up to a
+     *         power of two.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    Initialize(
+        __in DWORD capacity
+        )
+    {
+        HRESULT hr = S_OK;
+        DWORD numCells = 2;
+
+        TLevel(INIT);
+        TEnterMsg(("capacity=%d", capacity));
+
+        if ((capacity == 0) || (capacity > 0x10000000))
+        {
+            TWarn(("Invalid parameter."));
+            hr = E_INVALIDARG;
+        }
+        else if (m_cells != NULL)
+        {
+            TErr(("LfQueue has already been initialized."));
+            hr = HRESULT_FROM_WIN32(ERROR_ALREADY_INITIALIZED);
+        }
+        else
+        {
+            while (numCells < capacity)
+            {
+                numCells <<= 1;
+            }
+
+            if ((m_cells = new CELL[numCells]) == NULL)
+            {
+                hr = E_OUTOFMEMORY;
+                TErr(("Failed to allocate %d queue slots.", numCells));
+            }
+            else
+            {
+                for (DWORD i = 0; i < numCells; i++)
+                {
+                    m_cells[i].sequence = (LONG)i;
+                }
+                m_mask = (LONG)numCells - 1;
+                m_enqueuePos = 0;
+                m_dequeuePos = 0;
+            }
+        }
+
+        TExitMsg(("=%x (slots=%d)", hr, m_mask + 1));
+        return hr;
+    }   //Initialize
+
+    /**
+     *  This function frees the queue slots. Elements still in the queue
+     *  are discarded.
+     */
+    VOID
+    Uninitialize(
+        VOID
+        )
+    {
+        TLevel(INIT);
+        TEnter();
+
+        if (m_cells != NULL)
+        {
+            delete [] m_cells;
+            m_cells = NULL;
+            m_mask = 0;
+        }
+
+        TExit();
+        return;
+    }   //Uninitialize
+
+    /**
+     *  This function adds an element to the tail of the queue.
+     *
+     *  @param data Points to the element to copy into the queue.
+     *
+     *  @return Success: Returns TRUE.
+     *  @return Failure: Returns FALSE if the queue is full.
+     */
+    BOOL
+    Enqueue(
+        __in const T *data
+        )
+    {
+        BOOL rc = FALSE;
+        LONG pos = m_enqueuePos;
+
+        TLevel(HIFREQ);
+        TEnterMsg(("data=%p", data));
+
+        while (m_cells != NULL)
+        {
+            PCELL cell = &m_cells[pos & m_mask];
+            LONG diff = (LONG)((ULONG)cell->sequence - (ULONG)pos);
+
+            if (diff == 0)
+            {
+                //
+                // The slot is free, try to claim it.
+                //
+                if (InterlockedCompareExchange(&m_enqueuePos, pos + 1, pos) ==
+                    pos)
+                {
+                    cell->data = *data;
+                    //
+                    // Publish the element to the consumer.
+                    //
+                    InterlockedExchange(&cell->sequence, pos + 1);
+                    rc = TRUE;
+                    break;
+                }
+                pos = m_enqueuePos;
+            }
+            else if (diff < 0)
+            {
+                //
+                // The consumer hasn't freed the slot yet, the queue is full.
+                //
+                break;
+            }
+            else
+            {
+                //
+                // Another producer took the slot, catch up.
+                //
+                pos = m_enqueuePos;
+            }
+        }
+
+        TExitMsg(("=%d (pos=%d)", rc, pos));
+        return rc;
+    }   //Enqueue
+
+    /**
+     *  This function removes an element from the head of the queue.
+     *
+     *  @param data Points to the buffer to receive the element.
+     *
+     *  @return Success: Returns TRUE.
+     *  @return Failure: Returns FALSE if the queue is empty.
+     */
+    BOOL
+    Dequeue(
+        __out T *data
+        )
+    {
+        BOOL rc = FALSE;
+        LONG pos = m_dequeuePos;
+
+        TLevel(HIFREQ);
+        TEnterMsg(("data=%p", data));
+
+        while (m_cells != NULL)
+        {
+            PCELL cell = &m_cells[pos & m_mask];
+            LONG diff = (LONG)((ULONG)cell->sequence - (ULONG)(pos + 1));
+
+            if (diff == 0)
+            {
+                if (InterlockedCompareExchange(&m_dequeuePos, pos + 1, pos) ==
+                    pos)
+                {
+                    *data = cell->data;
+                    //
+                    // Hand the slot back to the producers for the next lap.
+                    //
+                    InterlockedExchange(&cell->sequence, pos + m_mask + 1);
+                    rc = TRUE;
+                    break;
+                }
+                pos = m_dequeuePos;
+            }
+            else if (diff < 0)
+            {
+                //
+                // The slot hasn't been filled yet, the queue is empty.
+                //
+                break;
+            }
+            else
+            {
+                pos = m_dequeuePos;
+            }
+        }
+
+        TExitMsg(("=%d (pos=%d)", rc, pos));
+        return rc;
+    }   //Dequeue
+};  //class LfQueue
@@ -0,0 +1,333 @@
+#if 0
+/// Copyright (c) Titan Robotics Club. All rights reserved.
+///
+/// <module name="LfRegistry.h" />
+///
+/// <summary>
+///     This module contains the definition and implementation of the
+///     LfRegistry class.
+/// </summary>
+///
+/// <remarks>
+///     Environment: Windows application.
+/// </remarks>
+#endif
+
+#pragma once
+
+#ifdef MOD_ID
+    #undef MOD_ID
+#endif
+#define MOD_ID                  MOD_LFREG
+
+/**
+ *  This class implements a lock-free registry of pointers. Each registered
+ *  item occupies a slot and is identified by the slot index, so insert and
+ *  remove are O(1) and never take a lock. Slots are allocated in chunks
+ *  that are only freed when the registry is destroyed, which lets any
+ *  thread walk the slots while others insert and remove. Such a walk sees
+ *  a snapshot that may or may not include concurrent changes. A lock is
+ *  only taken to add another chunk of slots.
+ *
+ *  Removing an item is a claim: of several threads removing the same item,
+ *  exactly one succeeds and owns it from then on.
+ */
+class LfRegistry
+{
+public:
+    //
+    // Public constants.
+    //
+    #define LFREG_INVALID_INDEX         ((DWORD)-1)
+
+private:
+    #define LFREG_CHUNK_SIZE            256
+    #define LFREG_MAX_CHUNKS            256
+
+    typedef struct _slot
+    {
+        SLIST_ENTRY freeEntry;
+        PVOID volatile item;
+        DWORD       index;
+    } SLOT, *PSLOT;
+
+    //
+    // Private data.
+    //
+    SLIST_HEADER     m_freeList;
+    CRITICAL_SECTION m_CritSect;
+    PSLOT volatile   m_chunks[LFREG_MAX_CHUNKS];
+    LONG volatile    m_numChunks;
+    LONG volatile    m_numItems;
+
+    /**
+     *  This function adds another chunk of free slots.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    Grow(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(FUNC);
+        TEnter();
+
+        EnterCriticalSection(&m_CritSect);
+        if (QueryDepthSList(&m_freeList) == 0)
+        {
+            PSLOT chunk = NULL;
+
+            if (m_numChunks >= LFREG_MAX_CHUNKS)
+            {
+                hr = HRESULT_FROM_WIN32(ERROR_NO_MORE_ITEMS);
+                TErr(("Registry is full (chunks=%d).", m_numChunks));
+            }
+            else if ((chunk = (PSLOT)_aligned_malloc(
+                                        LFREG_CHUNK_SIZE*sizeof(SLOT),
+                                        MEMORY_ALLOCATION_ALIGNMENT)) ==
+                     NULL)
+            {
+                hr = E_OUTOFMEMORY;
+                TErr(("Failed to allocate registry chunk."));
+            }
+            else
+            {
+                DWORD baseIdx = (DWORD)m_numChunks*LFREG_CHUNK_SIZE;
+
+                ZeroMemory(chunk, LFREG_CHUNK_SIZE*sizeof(SLOT));
+                for (DWORD i = 0; i < LFREG_CHUNK_SIZE; i++)
+                {
+                    chunk[i].index = baseIdx + i;
+                }
+                //
+                // Publish the chunk before it can be reached through the
+                // chunk count or the free list.
+                //
+                m_chunks[m_numChunks] = chunk;
+                InterlockedIncrement(&m_numChunks);
+                for (DWORD i = LFREG_CHUNK_SIZE; i > 0; i--)
+                {
+                    InterlockedPushEntrySList(&m_freeList,
+                                              &chunk[i - 1].freeEntry);
+                }
+            }
+        }
+        LeaveCriticalSection(&m_CritSect);
+
+        TExitMsg(("=%x (chunks=%d)", hr, m_numChunks));
+        return hr;
+    }   //Grow
+
+    /**
+     *  This function returns the slot of an index.
+     *
+     *  @param index Specifies the slot index.
+     *
+     *  @return Success: Returns the slot.
+     *  @return Failure: Returns NULL if the index is out of range.
+     */
+    PSLOT
+    GetSlot(
+        __in DWORD index
+        )
+    {
+        PSLOT slot = NULL;
+        DWORD chunkIdx = index/LFREG_CHUNK_SIZE;
+
+        TLevel(HIFREQ);
+        TEnterMsg(("index=%d", index));
+
+        if ((index != LFREG_INVALID_INDEX) &&
+            (chunkIdx < (DWORD)m_numChunks))
+        {
+            slot = &m_chunks[chunkIdx][index%LFREG_CHUNK_SIZE];
+        }
+
+        TExitMsg(("=%p", slot));
+        return slot;
+    }   //GetSlot
+
+public:
+    /**
+     *  Constructor of the class object.
+     */
+    LfRegistry(
+        VOID
+        ): m_numChunks(0)
+         , m_numItems(0)
+    {
+        TLevel(INIT);
+        TEnter();
+
+        InitializeSListHead(&m_freeList);
+        ZeroMemory((PVOID)m_chunks, sizeof(m_chunks));
+        __try
+        {
+            InitializeCriticalSection(&m_CritSect);
+        }
+        __except(EXCEPTION_EXECUTE_HANDLER)
+        {
+            TErr(("Failed to initialize critical section (err=%d).",
+                  GetExceptionCode()));
+        }
+
+        TExit();
+        return;
+    }   //LfRegistry
+
+    /**
+     *  Desctructor of the class object.
+     */
+    ~LfRegistry(
+        VOID
+        )
+    {
+        TLevel(INIT);
+        TEnter();
+
+        if (m_numItems != 0)
+        {
+            //
+            // The registry only owns the slots, not the items.
+            //
+            TWarn(("LfRegistry is not empty (Items=%d).", m_numItems));
+        }
+
+        for (LONG i = 0; i < m_numChunks; i++)
+        {
+            _aligned_free(m_chunks[i]);
+            m_chunks[i] = NULL;
+        }
+        m_numChunks = 0;
+        DeleteCriticalSection(&m_CritSect);
+
+        TExit();
+        return;
+    }   //~LfRegistry
+
+    /**
+     *  This function returns the number of registered items.
+     *
+     *  @return Returns the number of items.
+     */
+    DWORD
+    GetCount(
+        VOID
+        )
+    {
+        TLevel(API);
+        TEnter();
+        TExitMsg(("=%d", m_numItems));
+        return (DWORD)m_numItems;
+    }   //GetCount
+
+    /**
+     *  This function registers an item.
+     *
+     *  @param item Points to the item, must not be NULL.
+     *
+     *  @return Success: Returns the slot index of the item.
+     *  @return Failure: Returns LFREG_INVALID_INDEX.
+     */
+    DWORD
+    Insert(
+        __in PVOID item
+        )
+    {
+        DWORD index = LFREG_INVALID_INDEX;
+        PSLIST_ENTRY entry;
+
+        TLevel(API);
+        TEnterMsg(("item=%p", item));
+
+        while (((entry = InterlockedPopEntrySList(&m_freeList)) == NULL) &&
+               SUCCEEDED(Grow()))
+        {
+            //
+            // Another inserter may have taken the new slots, try again.
+            //
+        }
+
+        if (entry != NULL)
+        {
+            PSLOT slot = CONTAINING_RECORD(entry, SLOT, freeEntry);
+
+            InterlockedExchangePointer(&slot->item, item);
+            InterlockedIncrement(&m_numItems);
+            index = slot->index;
+        }
+
+        TExitMsg(("=%d (Items=%d)", index, m_numItems));
+        return index;
+    }   //Insert
+
+    /**
+     *  This function unregisters an item if it is still in its slot.
+     *
+     *  @param index Specifies the slot index returned by Insert.
+     *  @param item Points to the item expected in the slot.
+     *
+     *  @return Success: Returns TRUE, the caller now owns the item.
+     *  @return Failure: Returns FALSE if the item was already removed.
+     */
+    BOOL
+    Remove(
+        __in DWORD index,
+        __in PVOID item
+        )
+    {
+        BOOL rc = FALSE;
+        PSLOT slot;
+
+        TLevel(API);
+        TEnterMsg(("index=%d,item=%p", index, item));
+
+        if (((slot = GetSlot(index)) != NULL) &&
+            (InterlockedCompareExchangePointer(&slot->item, NULL, item) ==
+             item))
+        {
+            InterlockedDecrement(&m_numItems);
+            InterlockedPushEntrySList(&m_freeList, &slot->freeEntry);
+            rc = TRUE;
+        }
+
+        TExitMsg(("=%d (Items=%d)", rc, m_numItems));
+        return rc;
+    }   //Remove
+
+    /**
+     *  This function walks the registered items without locking. Start
+     *  with *index set to 0 and call it until it returns NULL.
+     *
+     *  @param index Points to the walk position. It is advanced past the
+     *         returned item.
+     *
+     *  @return Success: Returns the next registered item.
+     *  @return Failure: Returns NULL at the end of the registry.
+     */
+    PVOID
+    GetNext(
+        __inout LPDWORD index
+        )
+    {
+        PVOID item = NULL;
+        DWORD numSlots = (DWORD)m_numChunks*LFREG_CHUNK_SIZE;
+
+        TLevel(HIFREQ);
+        TEnterMsg(("index=%d", *index));
+
+        while ((item == NULL) && (*index < numSlots))
+        {
+            item = m_chunks[*index/LFREG_CHUNK_SIZE]
+                           [*index%LFREG_CHUNK_SIZE].item;
+            (*index)++;
+        }
+
+        TExitMsg(("=%p (index=%d)", item, *index));
+        return item;
+    }   //GetNext
+};  //class LfRegistry
@@ -0,0 +1,629 @@
+#if 0
+/// Copyright (c) Titan Robotics Club. All rights reserved.
+///
+/// <module name="LogWriter.h" />
+///
+/// <summary>
+///     This module contains the definition and implementation of the
+///     LogWriter class.
+/// </summary>
+///
+/// <remarks>
+///     Environment: Windows application.
+/// </remarks>
+#endif
+
+#pragma once
+
+#ifdef MOD_ID
+    #undef MOD_ID
+#endif
+#define MOD_ID                  MOD_LOGWRITER
+
+/**
+ *  This class implements a log file written by a background thread. The
+ *  caller only copies its data into the fill buffer. The writer thread
+ *  swaps it with the spare buffer and writes everything gathered since the
+ *  last write with one call, so a slow disk never blocks the caller. If the
+ *  disk falls so far behind that the fill buffer is full, new data is
+ *  dropped and counted instead, as is data that could not be written to
+ *  the file. The log is lossy by design, the caller can report the count
+ *  with GetDroppedBytes.
+ *
+ *  The data is written when the fill buffer is half full or when its oldest
+ *  byte has waited for the flush time. With LOGF_SYNC, each write is also
+ *  flushed to the disk, so one flush covers all the data in the write. The
+ *  log file is rotated when it reaches the maximum size or age: the file is
+ *  renamed to <name>.1, older files move up to <name>.LOG_NUM_BACKUPS and
+ *  a new file is started. If the file can't be renamed, it is kept and
+ *  the rotation is retried on the next write; if it can't be created, the
+ *  creation is retried on the next write.
+ */
+class LogWriter
+{
+public:
+    //
+    // Public constants.
+    //
+    #define LOGF_SYNC                   0x00000001
+
+    //
+    // Log parameters. A maxFileSize (KB) or maxFileAge (minutes) of 0 means
+    // no limit.
+    //
+    typedef struct _LogParams
+    {
+        DWORD       flushTime;
+        DWORD       maxFileSize;
+        DWORD       maxFileAge;
+        DWORD       flags;
+    } LOG_PARAMS, *PLOG_PARAMS;
+
+private:
+    #define LOG_BUFF_SIZE               (64*1024)
+    #define LOG_HIGH_WATER              (LOG_BUFF_SIZE/2)
+    #define LOG_NUM_BACKUPS             9
+    #define LOG_STOP_TIMEOUT            5000
+
+    #define LOGWF_STOP                  0x00000001
+
+    //
+    // Private data.
+    //
+    CRITICAL_SECTION m_critSect;
+    HANDLE           m_hThread;
+    HANDLE           m_hEvent;
+    HANDLE           m_hFile;
+    WCHAR            m_szFileName[MAX_PATH];
+    LOG_PARAMS       m_params;
+    DWORD            m_writerFlags;
+    LPBYTE           m_fillBuff;
+    LPBYTE           m_spareBuff;
+    DWORD            m_fillLen;
+    DWORD            m_fillTime;
+    DWORD            m_droppedBytes;
+    ULONGLONG        m_fileSize;
+    DWORD            m_fileTime;
+
+    friend
+    DWORD WINAPI
+    LogWriterThreadProc(
+        __in LPVOID lpParam
+        );
+
+    /**
+     *  This function creates a new log file, replacing any file of the same
+     *  name. The file may be renamed while it is open, so it can be rotated
+     *  without closing it first.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    OpenFile(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(FUNC);
+        TEnterMsg(("file=%ws", m_szFileName));
+
+        m_hFile = CreateFileW(m_szFileName,
+                              GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_DELETE,
+                              NULL,
+                              CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL,
+                              NULL);
+        if (m_hFile == INVALID_HANDLE_VALUE)
+        {
+            hr = GETLASTHRESULT();
+            m_hFile = NULL;
+            TErr(("Failed to create log file %ws (hr=%x).", m_szFileName, hr));
+        }
+        else
+        {
+            m_fileSize = 0;
+            m_fileTime = GetTickCount();
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //OpenFile
+
+    /**
+     *  This function shifts the older log files up by one, renames the log
+     *  file to <name>.1 and starts a new file. If the log file can't be
+     *  renamed, it stays open so nothing written to it is lost.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    RotateFile(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+        WCHAR szOldName[MAX_PATH + 8];
+        WCHAR szNewName[MAX_PATH + 8];
+
+        TLevel(FUNC);
+        TEnterMsg(("size=%I64d", m_fileSize));
+
+        //
+        // A previous attempt may have shifted the backups already and then
+        // failed to rename the log file, don't shift them again.
+        //
+        StringCchPrintfW(szNewName, ARRAYSIZE(szNewName),
+                         L"%s.1", m_szFileName);
+        if (GetFileAttributesW(szNewName) != INVALID_FILE_ATTRIBUTES)
+        {
+            for (int i = LOG_NUM_BACKUPS; i > 1; i--)
+            {
+                StringCchPrintfW(szOldName, ARRAYSIZE(szOldName),
+                                 L"%s.%d", m_szFileName, i - 1);
+                StringCchPrintfW(szNewName, ARRAYSIZE(szNewName),
+                                 L"%s.%d", m_szFileName, i);
+                if (!MoveFileExW(szOldName,
+                                 szNewName,
+                                 MOVEFILE_REPLACE_EXISTING) &&
+                    (GetLastError() != ERROR_FILE_NOT_FOUND))
+                {
+                    TWarn(("Failed to rename %ws (err=%d).",
+                           szOldName, GetLastError()));
+                }
+            }
+            StringCchPrintfW(szNewName, ARRAYSIZE(szNewName),
+                             L"%s.1", m_szFileName);
+        }
+
+        if (!MoveFileExW(m_szFileName, szNewName, MOVEFILE_REPLACE_EXISTING))
+        {
+            hr = GETLASTHRESULT();
+            TWarn(("Failed to rename %ws, keep writing to it (hr=%x).",
+                   m_szFileName, hr));
+        }
+        else
+        {
+            CloseHandle(m_hFile);
+            m_hFile = NULL;
+            hr = OpenFile();
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //RotateFile
+
+    /**
+     *  This function writes a buffer to the log file, rotating the file
+     *  first if it is due. If there is no log file because it could not be
+     *  created, the creation is retried first.
+     *
+     *  @param buff Points to the data.
+     *  @param len Specifies the length of the data.
+     */
+    VOID
+    WriteBuffer(
+        __in_bcount(len) LPBYTE buff,
+        __in             DWORD len
+        )
+    {
+        DWORD dwcb;
+
+        TLevel(FUNC);
+        TEnterMsg(("buff=%p,len=%d", buff, len));
+
+        if (m_hFile == NULL)
+        {
+            OpenFile();
+        }
+        else if ((m_fileSize > 0) &&
+            (((m_params.maxFileSize > 0) &&
+              (m_fileSize + len > (ULONGLONG)m_params.maxFileSize*1024)) ||
+             ((m_params.maxFileAge > 0) &&
+              (GetTickCount() - m_fileTime >= m_params.maxFileAge*60000))))
+        {
+            RotateFile();
+        }
+
+        if ((m_hFile == NULL) || !WriteFile(m_hFile, buff, len, &dwcb, NULL))
+        {
+            TErr(("Failed to write log file (err=%d).", GetLastError()));
+            EnterCriticalSection(&m_critSect);
+            m_droppedBytes += len;
+            LeaveCriticalSection(&m_critSect);
+        }
+        else
+        {
+            m_fileSize += dwcb;
+            if ((m_params.flags & LOGF_SYNC) && !FlushFileBuffers(m_hFile))
+            {
+                TErr(("Failed to flush log file (err=%d).", GetLastError()));
+            }
+        }
+
+        TExit();
+        return;
+    }   //WriteBuffer
+
+    /**
+     *  This function implements the writer thread. It waits until the fill
+     *  buffer is due, swaps it with the spare buffer and writes it out.
+     *
+     *  @return Success: Returns S_OK.
+     */
+    HRESULT
+    WriterThread(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+        BOOL fStop = FALSE;
+
+        TLevel(FUNC);
+        TEnter();
+
+        while (!fStop)
+        {
+            DWORD dwTimeout = INFINITE;
+            LPBYTE buff = NULL;
+            DWORD len = 0;
+
+            EnterCriticalSection(&m_critSect);
+            fStop = (m_writerFlags & LOGWF_STOP) != 0;
+            if (m_fillLen > 0)
+            {
+                DWORD elapsed = GetTickCount() - m_fillTime;
+
+                if (fStop || (m_fillLen >= LOG_HIGH_WATER) ||
+                    (elapsed >= m_params.flushTime))
+                {
+                    buff = m_fillBuff;
+                    len = m_fillLen;
+                    m_fillBuff = m_spareBuff;
+                    m_spareBuff = NULL;
+                    m_fillLen = 0;
+                }
+                else
+                {
+                    dwTimeout = m_params.flushTime - elapsed;
+                }
+            }
+            LeaveCriticalSection(&m_critSect);
+
+            if (buff != NULL)
+            {
+                //
+                // Everything gathered since the last write goes out in one
+                // write while the caller keeps filling the other buffer.
+                //
+                WriteBuffer(buff, len);
+                EnterCriticalSection(&m_critSect);
+                m_spareBuff = buff;
+                LeaveCriticalSection(&m_critSect);
+            }
+            else if (!fStop)
+            {
+                WaitForSingleObject(m_hEvent, dwTimeout);
+            }
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //WriterThread
+
+public:
+    /**
+     *  Constructor of the class object.
+     */
+    LogWriter(
+        VOID
+        ): m_hThread(NULL)
+         , m_hEvent(NULL)
+         , m_hFile(NULL)
+         , m_writerFlags(0)
+         , m_fillBuff(NULL)
+         , m_spareBuff(NULL)
+         , m_fillLen(0)
+         , m_fillTime(0)
+         , m_droppedBytes(0)
+         , m_fileSize(0)
+         , m_fileTime(0)
+    {
+        TLevel(INIT);
+        TEnter();
+
+        m_szFileName[0] = L'\0';
+        ZeroMemory(&m_params, sizeof(m_params));
+        __try
+        {
+            InitializeCriticalSection(&m_critSect);
+        }
+        __except(EXCEPTION_EXECUTE_HANDLER)
+        {
+            TErr(("Failed to initialize critical section (err=%d).",
+                  GetExceptionCode()));
+        }
+
+        TExit();
+        return;
+    }   //LogWriter
+
+    /**
+     *  Destructor of the class object. The owner must call Uninitialize
+     *  first and must not delete the object if it fails.
+     */
+    ~LogWriter(
+        VOID
+        )
+    {
+        TLevel(INIT);
+        TEnter();
+
+        Uninitialize();
+        DeleteCriticalSection(&m_critSect);
+
+        TExit();
+        return;
+    }   //~LogWriter
+
+    /**
+     *  This function creates the log file and starts the writer thread.
+     *
+     *  @param pszFileName Points to the log file name.
+     *  @param logParams Points to the log parameters.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    Initialize(
+        __in LPCWSTR pszFileName,
+        __in PLOG_PARAMS logParams
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(INIT);
+        TEnterMsg(("file=%ws,flushTime=%d,maxSize=%d,maxAge=%d,flags=%x",
+                   pszFileName, logParams->flushTime, logParams->maxFileSize,
+                   logParams->maxFileAge, logParams->flags));
+
+        if (m_hThread != NULL)
+        {
+            TErr(("LogWriter has already been initialized."));
+            hr = HRESULT_FROM_WIN32(ERROR_ALREADY_INITIALIZED);
+        }
+        else
+        {
+            m_params = *logParams;
+            m_droppedBytes = 0;
+            if (FAILED(hr = StringCchCopyW(m_szFileName,
+                                           ARRAYSIZE(m_szFileName),
+                                           pszFileName)))
+            {
+                TErr(("Log file name is too long (hr=%x).", hr));
+            }
+            else if (((m_fillBuff = new BYTE[LOG_BUFF_SIZE]) == NULL) ||
+                     ((m_spareBuff = new BYTE[LOG_BUFF_SIZE]) == NULL))
+            {
+                hr = E_OUTOFMEMORY;
+                TErr(("Failed to allocate log buffers."));
+            }
+            else if (FAILED(hr = OpenFile()))
+            {
+                //
+                // OpenFile already traced the error.
+                //
+            }
+            else if ((m_hEvent = CreateEvent(NULL, FALSE, FALSE, NULL)) ==
+                     NULL)
+            {
+                hr = GETLASTHRESULT();
+                TErr(("Failed to create writer event (hr=%x).", hr));
+            }
+            else if ((m_hThread = CreateThread(NULL,
+                                               0,
+                                               LogWriterThreadProc,
+                                               this,
+                                               0,
+                                               NULL)) == NULL)
+            {
+                hr = GETLASTHRESULT();
+                TErr(("Failed to create writer thread (hr=%x).", hr));
+            }
+
+            if (FAILED(hr))
+            {
+                Uninitialize();
+            }
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //Initialize
+
+    /**
+     *  This function stops the writer thread after it has written whatever
+     *  is still buffered, and closes the log file. If the thread does not
+     *  die in time, it is still using the object, so the caller must leave
+     *  the object to it instead of deleting it.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    Uninitialize(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(INIT);
+        TEnter();
+
+        if (m_hThread != NULL)
+        {
+            DWORD rcWait;
+
+            EnterCriticalSection(&m_critSect);
+            m_writerFlags |= LOGWF_STOP;
+            LeaveCriticalSection(&m_critSect);
+            SetEvent(m_hEvent);
+            rcWait = WaitForSingleObject(m_hThread, LOG_STOP_TIMEOUT);
+            if (rcWait == WAIT_OBJECT_0)
+            {
+                CloseHandle(m_hThread);
+                m_hThread = NULL;
+            }
+            else
+            {
+                hr = (rcWait == WAIT_FAILED)?
+                        GETLASTHRESULT(): HRESULT_FROM_WIN32(WAIT_TIMEOUT);
+                TErr(("Failed waiting for the writer thread to die (hr=%x).",
+                      hr));
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            if (m_hEvent != NULL)
+            {
+                CloseHandle(m_hEvent);
+                m_hEvent = NULL;
+            }
+
+            if (m_hFile != NULL)
+            {
+                CloseHandle(m_hFile);
+                m_hFile = NULL;
+            }
+
+            if (m_droppedBytes > 0)
+            {
+                TWarn(("%d bytes were not logged.", m_droppedBytes));
+            }
+
+            SAFE_DELETE_ARRAY(m_spareBuff);
+            SAFE_DELETE_ARRAY(m_fillBuff);
+            m_fillLen = 0;
+            m_writerFlags = 0;
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //Uninitialize
+
+    /**
+     *  This function adds data to the log. It only copies the data, the
+     *  writer thread writes it to the file later.
+     *
+     *  @param data Points to the data.
+     *  @param len Specifies the length of the data.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code if the data did not fit in the
+     *          buffer and some of it was dropped.
+     */
+    HRESULT
+    Write(
+        __in_bcount(len) const BYTE *data,
+        __in             DWORD len
+        )
+    {
+        HRESULT hr = S_OK;
+        BOOL fSignal;
+        DWORD copyLen;
+
+        TLevel(HIFREQ);
+        TEnterMsg(("data=%p,len=%d", data, len));
+
+        EnterCriticalSection(&m_critSect);
+        copyLen = min(len, LOG_BUFF_SIZE - m_fillLen);
+        if (copyLen < len)
+        {
+            m_droppedBytes += len - copyLen;
+            hr = HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        }
+
+        //
+        // Wake the writer when the buffer starts filling, so it can time
+        // the flush, and when it reaches the high water mark.
+        //
+        fSignal = (copyLen > 0) &&
+                  ((m_fillLen == 0) ||
+                   ((m_fillLen < LOG_HIGH_WATER) &&
+                    (m_fillLen + copyLen >= LOG_HIGH_WATER)));
+        if (m_fillLen == 0)
+        {
+            m_fillTime = GetTickCount();
+        }
+        CopyMemory(&m_fillBuff[m_fillLen], data, copyLen);
+        m_fillLen += copyLen;
+        LeaveCriticalSection(&m_critSect);
+
+        if (fSignal)
+        {
+            SetEvent(m_hEvent);
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //Write
+
+    /**
+     *  This function returns the number of bytes dropped from the log,
+     *  either because the buffer was full or because they could not be
+     *  written to the file. The count is kept after Uninitialize, so it
+     *  can be reported at shutdown.
+     *
+     *  @return Returns the number of bytes dropped.
+     */
+    DWORD
+    GetDroppedBytes(
+        VOID
+        )
+    {
+        DWORD droppedBytes;
+
+        TLevel(API);
+        TEnter();
+
+        EnterCriticalSection(&m_critSect);
+        droppedBytes = m_droppedBytes;
+        LeaveCriticalSection(&m_critSect);
+
+        TExitMsg(("=%d", droppedBytes));
+        return droppedBytes;
+    }   //GetDroppedBytes
+};  //class LogWriter
+
+#ifdef _MAIN_FILE
+/**
+ *  This function implements the log writer thread.
+ *
+ *  @param lpParam Points to thread data passed to the function.
+ *
+ *  @return Success: Returns ERROR_SUCCESS.
+ *  @return Failure: Returns Win32 error code.
+ */
+DWORD WINAPI
+LogWriterThreadProc(
+    __in LPVOID lpParam
+    )
+{
+    DWORD rc;
+    LogWriter *logWriter = (LogWriter *)lpParam;
+
+    TLevel(CALLBK);
+    TEnterMsg(("param=%p", lpParam));
+
+    rc = (DWORD)logWriter->WriterThread();
+
+    TExitMsg(("=%x", rc));
+    return rc;
+}   //LogWriterThreadProc
+
+#endif
@@ -0,0 +1,605 @@
+#if 0
+/// Copyright (c) Titan Robotics Club. All rights reserved.
+///
+/// <module name="TList.h" />
+///
+/// <summary>
+///     This module contains the definition and implementation of the
+///     TList template class and its locking and tracing policies.
+/// </summary>
+///
+/// <remarks>
+///     Environment: Windows application.
+/// </remarks>
+#endif
+
+#pragma once
+
+#ifdef MOD_ID
+    #undef MOD_ID
+#endif
+#define MOD_ID                  MOD_TLIST
+
+//
+// Locking policies. A policy provides Acquire and Release and is embedded in
+// the list, so a list only pays for the synchronization it asks for.
+//
+
+/**
+ *  This class implements the locking policy for a list that is only used
+ *  by one thread at a time.
+ */
+class TListNoLock
+{
+public:
+    VOID Acquire(VOID) {}
+    VOID Release(VOID) {}
+};  //class TListNoLock
+
+/**
+ *  This class implements a spin lock policy for lists that are held very
+ *  briefly by a few threads.
+ */
+class TListSpinLock
+{
+private:
+    LONG volatile m_lock;
+
+public:
+    TListSpinLock(
+        VOID
+        ): m_lock(0)
+    {
+    }   //TListSpinLock
+
+    VOID
+    Acquire(
+        VOID
+        )
+    {
+        while (InterlockedCompareExchange(&m_lock, 1, 0) != 0)
+        {
+            //
+            // Spin on a plain read so the cache line is not bounced until
+            // the lock looks free.
+            //
+            while (m_lock != 0)
+            {
+                YieldProcessor();
+            }
+        }
+    }   //Acquire
+
+    VOID
+    Release(
+        VOID
+        )
+    {
+        InterlockedExchange(&m_lock, 0);
+    }   //Release
+};  //class TListSpinLock
+
+/**
+ *  This class implements a slim reader/writer lock policy. Uncontended it
+ *  is a single interlocked operation; contended, waiters sleep in the
+ *  kernel on the lock address instead of spinning.
+ */
+class TListSrwLock
+{
+private:
+    SRWLOCK m_lock;
+
+public:
+    TListSrwLock(
+        VOID
+        )
+    {
+        InitializeSRWLock(&m_lock);
+    }   //TListSrwLock
+
+    VOID
+    Acquire(
+        VOID
+        )
+    {
+        AcquireSRWLockExclusive(&m_lock);
+    }   //Acquire
+
+    VOID
+    Release(
+        VOID
+        )
+    {
+        ReleaseSRWLockExclusive(&m_lock);
+    }   //Release
+};  //class TListSrwLock
+
+//
+// Tracing policies. They are resolved at compile time, a list built with
+// TListNoTrace carries no tracing code at all.
+//
+
+/**
+ *  This class implements the tracing policy that does not trace.
+ */
+class TListNoTrace
+{
+public:
+    static VOID Enter(LPCSTR) {}
+    static VOID Exit(LPCSTR) {}
+};  //class TListNoTrace
+
+#ifdef _ENABLE_FUNCTRACE
+/**
+ *  This class implements the tracing policy that traces function entry and
+ *  exit of the list under MOD_TLIST at the API trace level.
+ */
+class TListFuncTrace
+{
+public:
+    static
+    VOID
+    Enter(
+        __in LPCSTR pszFunc
+        )
+    {
+        if (g_Trace.m_fTraceEnabled &&
+            ((g_Trace.m_traceModules & MOD_TLIST) != 0) &&
+            (API <= g_Trace.m_traceLevel))
+        {
+            g_Trace.FuncPrefix(pszFunc, true, true);
+        }
+    }   //Enter
+
+    static
+    VOID
+    Exit(
+        __in LPCSTR pszFunc
+        )
+    {
+        if (g_Trace.m_fTraceEnabled &&
+            ((g_Trace.m_traceModules & MOD_TLIST) != 0) &&
+            (API <= g_Trace.m_traceLevel))
+        {
+            g_Trace.FuncPrefix(pszFunc, false, true);
+        }
+    }   //Exit
+};  //class TListFuncTrace
+#else
+typedef TListNoTrace TListFuncTrace;
+#endif
+
+/**
+ *  This class implements a type-safe intrusive doubly linked list. The
+ *  element type T embeds a LIST_ENTRY named by Link, the list links
+ *  through it and hands back T pointers, so callers never cast entries.
+ *  LockPolicy decides how the list is synchronized and TracePolicy whether
+ *  its calls are traced.
+ *
+ *  @param T Specifies the element type.
+ *  @param Link Specifies the LIST_ENTRY member of T used for linking.
+ *  @param LockPolicy Specifies TListNoLock, TListSpinLock or TListSrwLock.
+ *  @param TracePolicy Specifies TListNoTrace or TListFuncTrace.
+ */
+template<class T,
+         LIST_ENTRY T::*Link,
+         class LockPolicy = TListSrwLock,
+         class TracePolicy = TListNoTrace>
+class TList
+{
+public:
+    //
+    // Public constants, returned by the ForEach function.
+    //
+    #define TLIST_REMOVE                0x00000001
+    #define TLIST_STOP                  0x00000002
+
+private:
+    //
+    // Private data.
+    //
+    DWORD       m_dwcEntries;
+    LIST_ENTRY  m_listHead;
+    LockPolicy  m_lock;
+
+    static
+    PLIST_ENTRY
+    ToEntry(
+        __in T *item
+        )
+    {
+        return &(item->*Link);
+    }   //ToEntry
+
+    static
+    T *
+    ToItem(
+        __in PLIST_ENTRY entry
+        )
+    {
+        return (T *)((LPBYTE)entry - (SIZE_T)&(((T *)0)->*Link));
+    }   //ToItem
+
+    VOID
+    Unlink(
+        __in PLIST_ENTRY entry
+        )
+    {
+        entry->Flink->Blink = entry->Blink;
+        entry->Blink->Flink = entry->Flink;
+        entry->Flink = entry->Blink = NULL;
+        m_dwcEntries--;
+    }   //Unlink
+
+public:
+    /**
+     *  Constructor of the class object.
+     */
+    TList(
+        VOID
+        ): m_dwcEntries(0)
+    {
+        m_listHead.Flink = m_listHead.Blink = &m_listHead;
+    }   //TList
+
+    /**
+     *  Desctructor of the class object. The list only owns its head, any
+     *  remaining elements are detached but not freed.
+     */
+    ~TList(
+        VOID
+        )
+    {
+        TracePolicy::Enter(__FUNCTION__);
+
+        m_lock.Acquire();
+        if (m_listHead.Flink != &m_listHead)
+        {
+            m_listHead.Flink->Blink = m_listHead.Blink;
+            m_listHead.Blink->Flink = m_listHead.Flink;
+            m_listHead.Flink = m_listHead.Blink = &m_listHead;
+        }
+        m_dwcEntries = 0;
+        m_lock.Release();
+
+        TracePolicy::Exit(__FUNCTION__);
+    }   //~TList
+
+    /**
+     *  This function checks if the list is empty.
+     *
+     *  @return Success: Returns TRUE.
+     *  @return Failure: Returns FALSE.
+     */
+    BOOL
+    IsEmpty(
+        VOID
+        )
+    {
+        BOOL rc;
+
+        TracePolicy::Enter(__FUNCTION__);
+
+        m_lock.Acquire();
+        rc = (m_listHead.Flink == &m_listHead);
+        m_lock.Release();
+
+        TracePolicy::Exit(__FUNCTION__);
+        return rc;
+    }   //IsEmpty
+
+    /**
+     *  This function returns the number of elements in the list.
+     *
+     *  @return Returns the number of elements.
+     */
+    DWORD
+    GetCount(
+        VOID
+        )
+    {
+        TracePolicy::Enter(__FUNCTION__);
+        TracePolicy::Exit(__FUNCTION__);
+        return m_dwcEntries;
+    }   //GetCount
+
+    /**
+     *  This function inserts an element at the head of the list.
+     *
+     *  @param item Points to the element to insert.
+     */
+    VOID
+    InsertHead(
+        __in T *item
+        )
+    {
+        PLIST_ENTRY entry = ToEntry(item);
+
+        TracePolicy::Enter(__FUNCTION__);
+
+        m_lock.Acquire();
+        entry->Flink = m_listHead.Flink;
+        entry->Blink = &m_listHead;
+        m_listHead.Flink->Blink = entry;
+        m_listHead.Flink = entry;
+        m_dwcEntries++;
+        m_lock.Release();
+
+        TracePolicy::Exit(__FUNCTION__);
+    }   //InsertHead
+
+    /**
+     *  This function inserts an element at the tail of the list.
+     *
+     *  @param item Points to the element to insert.
+     */
+    VOID
+    InsertTail(
+        __in T *item
+        )
+    {
+        PLIST_ENTRY entry = ToEntry(item);
+
+        TracePolicy::Enter(__FUNCTION__);
+
+        m_lock.Acquire();
+        entry->Flink = &m_listHead;
+        entry->Blink = m_listHead.Blink;
+        m_listHead.Blink->Flink = entry;
+        m_listHead.Blink = entry;
+        m_dwcEntries++;
+        m_lock.Release();
+
+        TracePolicy::Exit(__FUNCTION__);
+    }   //InsertTail
+
+    /**
+     *  This function removes an element from the list. The element is only
+     *  unlinked if it is on this list, so an element that has already been
+     *  removed or moved to another list is left alone. The list is searched
+     *  for the element, so this is linear in the length of the list.
+     *
+     *  @param item Points to the element to remove.
+     *
+     *  @return Success: Returns TRUE if the element was removed.
+     *  @return Failure: Returns FALSE if it is not on this list.
+     */
+    BOOL
+    Remove(
+        __in T *item
+        )
+    {
+        BOOL rc = FALSE;
+        PLIST_ENTRY entry = ToEntry(item);
+
+        TracePolicy::Enter(__FUNCTION__);
+
+        m_lock.Acquire();
+        for (PLIST_ENTRY curr = m_listHead.Flink;
+             curr != &m_listHead;
+             curr = curr->Flink)
+        {
+            if (curr == entry)
+            {
+                Unlink(entry);
+                rc = TRUE;
+                break;
+            }
+        }
+        m_lock.Release();
+
+        TracePolicy::Exit(__FUNCTION__);
+        return rc;
+    }   //Remove
+
+    /**
+     *  This function removes the first element of the list.
+     *
+     *  @return Success: Returns the element removed.
+     *  @return Failure: Returns NULL if the list is empty.
+     */
+    T *
+    RemoveHead(
+        VOID
+        )
+    {
+        T *item = NULL;
+
+        TracePolicy::Enter(__FUNCTION__);
+
+        m_lock.Acquire();
+        if (m_listHead.Flink != &m_listHead)
+        {
+            PLIST_ENTRY entry = m_listHead.Flink;
+
+            Unlink(entry);
+            item = ToItem(entry);
+        }
+        m_lock.Release();
+
+        TracePolicy::Exit(__FUNCTION__);
+        return item;
+    }   //RemoveHead
+
+    /**
+     *  This function removes the last element of the list.
+     *
+     *  @return Success: Returns the element removed.
+     *  @return Failure: Returns NULL if the list is empty.
+     */
+    T *
+    RemoveTail(
+        VOID
+        )
+    {
+        T *item = NULL;
+
+        TracePolicy::Enter(__FUNCTION__);
+
+        m_lock.Acquire();
+        if (m_listHead.Blink != &m_listHead)
+        {
+            PLIST_ENTRY entry = m_listHead.Blink;
+
+            Unlink(entry);
+            item = ToItem(entry);
+        }
+        m_lock.Release();
+
+        TracePolicy::Exit(__FUNCTION__);
+        return item;
+    }   //RemoveTail
+
+    /**
+     *  This function gets the first element of the list. Unless the list
+     *  uses TListNoLock, the element may be removed by another thread as
+     *  soon as this returns; use ForEach to walk a shared list.
+     *
+     *  @return Success: Returns the first element.
+     *  @return Failure: Returns NULL if the list is empty.
+     */
+    T *
+    GetHead(
+        VOID
+        )
+    {
+        T *item = NULL;
+
+        TracePolicy::Enter(__FUNCTION__);
+
+        m_lock.Acquire();
+        if (m_listHead.Flink != &m_listHead)
+        {
+            item = ToItem(m_listHead.Flink);
+        }
+        m_lock.Release();
+
+        TracePolicy::Exit(__FUNCTION__);
+        return item;
+    }   //GetHead
+
+    /**
+     *  This function gets the element following the given one.
+     *
+     *  @param item Points to an element on the list.
+     *
+     *  @return Success: Returns the next element.
+     *  @return Failure: Returns NULL at the end of the list.
+     */
+    T *
+    GetNext(
+        __in T *item
+        )
+    {
+        T *next = NULL;
+
+        TracePolicy::Enter(__FUNCTION__);
+
+        m_lock.Acquire();
+        if (ToEntry(item)->Flink != &m_listHead)
+        {
+            next = ToItem(ToEntry(item)->Flink);
+        }
+        m_lock.Release();
+
+        TracePolicy::Exit(__FUNCTION__);
+        return next;
+    }   //GetNext
+
+    /**
+     *  This function moves all elements of another list to the tail of this
+     *  list in constant time. The elements are detached from the source
+     *  under its lock and then attached here under this list's lock, so the
+     *  two locks are never held together and two threads splicing in
+     *  opposite directions can't deadlock. In between, the elements are on
+     *  neither list.
+     *
+     *  @param src Specifies the list to take the elements from. It is
+     *         empty afterwards.
+     */
+    VOID
+    SpliceTail(
+        __inout TList &src
+        )
+    {
+        TracePolicy::Enter(__FUNCTION__);
+
+        if (&src != this)
+        {
+            PLIST_ENTRY first = NULL;
+            PLIST_ENTRY last = NULL;
+            DWORD dwcEntries = 0;
+
+            src.m_lock.Acquire();
+            if (src.m_listHead.Flink != &src.m_listHead)
+            {
+                first = src.m_listHead.Flink;
+                last = src.m_listHead.Blink;
+                dwcEntries = src.m_dwcEntries;
+                src.m_listHead.Flink = src.m_listHead.Blink =
+                    &src.m_listHead;
+                src.m_dwcEntries = 0;
+            }
+            src.m_lock.Release();
+
+            if (first != NULL)
+            {
+                m_lock.Acquire();
+                first->Blink = m_listHead.Blink;
+                m_listHead.Blink->Flink = first;
+                last->Flink = &m_listHead;
+                m_listHead.Blink = last;
+                m_dwcEntries += dwcEntries;
+                m_lock.Release();
+            }
+        }
+
+        TracePolicy::Exit(__FUNCTION__);
+    }   //SpliceTail
+
+    /**
+     *  This function calls a function on each element while holding the
+     *  list lock. The function may unlink the element it is called with by
+     *  returning TLIST_REMOVE, but must not call any other method of this
+     *  list.
+     *
+     *  @param fn Specifies the function or functor. It is called as
+     *         fn(T *item) and returns a combination of TLIST_REMOVE and
+     *         TLIST_STOP, or 0 to carry on.
+     *
+     *  @return Returns the number of elements visited.
+     */
+    template<class Fn>
+    DWORD
+    ForEach(
+        __in Fn fn
+        )
+    {
+        DWORD numVisited = 0;
+
+        TracePolicy::Enter(__FUNCTION__);
+
+        m_lock.Acquire();
+        for (PLIST_ENTRY entry = m_listHead.Flink; entry != &m_listHead;)
+        {
+            PLIST_ENTRY next = entry->Flink;
+            DWORD action = fn(ToItem(entry));
+
+            numVisited++;
+            if (action & TLIST_REMOVE)
+            {
+                Unlink(entry);
+            }
+
+            if (action & TLIST_STOP)
+            {
+                break;
+            }
+            entry = next;
+        }
+        m_lock.Release();
+
+        TracePolicy::Exit(__FUNCTION__);
+        return numVisited;
+    }   //ForEach
+};  //class TList
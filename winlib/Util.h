@@ -37,6 +37,11 @@
                                     delete(p);              \
                                     (p) = NULL;             \
                                 }
+#define SAFE_DELETE_ARRAY(p)    if ((p) != NULL)            \
+                                {                           \
+                                    delete [] (p);          \
+                                    (p) = NULL;             \
+                                }
 #define PrintTitle()            printf("\n%ws. %ws [%s, %s]\n%ws\n\n",      \
                                        PROG_TITLE, PROG_VERSION, __DATE__,  \
                                        __TIME__, PROG_COPYRIGHT)
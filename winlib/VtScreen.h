@@ -0,0 +1,1385 @@
+#if 0
+/// Copyright (c) Titan Robotics Club. All rights reserved.
+///
+/// <module name="VtScreen.h" />
+///
+/// <summary>
+///     This module contains the definition and implementation of the
+///     VtScreen class.
+/// </summary>
+///
+/// <remarks>
+///     Environment: Windows application.
+/// </remarks>
+#endif
+
+#pragma once
+
+#ifdef MOD_ID
+    #undef MOD_ID
+#endif
+#define MOD_ID                  MOD_VTSCREEN
+
+/**
+ *  This class implements the screen model of a VT terminal. It is driven by
+ *  the received byte stream and keeps a grid of cells, the cursor, the
+ *  scroll region and the current SGR attributes. It does no output itself:
+ *  the owner draws the rows marked dirty and then clears the damage. Scrolls
+ *  of the whole screen move the dirty flags with the rows and are counted,
+ *  so the owner can scroll its output instead of redrawing every row.
+ *
+ *  Cell attributes use the console text attribute bits, which GDI code can
+ *  map to colors just as well.
+ */
+class VtScreen
+{
+public:
+    //
+    // Public constants.
+    //
+    #define FOREGROUND_MASK     0x000f
+    #define BACKGROUND_MASK     0x00f0
+    #define FOREGROUND_BLACK    0x0000
+    #define FOREGROUND_CYAN     (FOREGROUND_GREEN | FOREGROUND_BLUE)
+    #define FOREGROUND_MAGENTA  (FOREGROUND_RED | FOREGROUND_BLUE)
+    #define FOREGROUND_YELLOW   (FOREGROUND_RED | FOREGROUND_GREEN)
+    #define FOREGROUND_WHITE    (FOREGROUND_RED | \
+                                 FOREGROUND_GREEN | \
+                                 FOREGROUND_BLUE)
+    #define BACKGROUND_BLACK    0x0000
+    #define BACKGROUND_CYAN     (BACKGROUND_GREEN | BACKGROUND_BLUE)
+    #define BACKGROUND_MAGENTA  (BACKGROUND_RED | BACKGROUND_BLUE)
+    #define BACKGROUND_YELLOW   (BACKGROUND_RED | BACKGROUND_GREEN)
+    #define BACKGROUND_WHITE    (BACKGROUND_RED | \
+                                 BACKGROUND_GREEN | \
+                                 BACKGROUND_BLUE)
+
+    //
+    // A character cell.
+    //
+    typedef struct _VtCell
+    {
+        char        ch;
+        WORD        attrib;
+    } VTCELL, *PVTCELL;
+
+private:
+    #define VT_TAB_SIZE         8
+
+    //
+    // SGR decode operations.
+    //
+    #define SGROP_NONE          0
+    #define SGROP_SET           1
+    #define SGROP_RESET         2
+    #define SGROP_DEFAULT       3
+    #define SGROP_REVERSE       4
+    #define SGROP_EXTCOLOR      5
+
+    #define SGR_NONE            {SGROP_NONE, 0, 0}
+    #define SGR_SET(m,b)        {SGROP_SET, (m), (b)}
+    #define SGR_FG(c)           SGR_SET(FOREGROUND_MASK, (c))
+    #define SGR_BG(c)           SGR_SET(BACKGROUND_MASK, (c))
+
+    //
+    // Maps a 0-255 RGB component to its level in the 6x6x6 color cube of
+    // the 256 color palette.
+    //
+    #define RGB_TO_CUBE(v)      (((v) < 48)? 0: ((v) < 115)? 1: ((v) - 35)/40)
+
+    //
+    // How an SGR code changes the text attributes.
+    //
+    typedef struct _SgrEntry
+    {
+        BYTE        op;
+        WORD        mask;
+        WORD        attrib;
+    } SGRENTRY, *PSGRENTRY;
+
+    //
+    // Private data.
+    //
+    AnsiScan    m_ansiScan;
+    int         m_width;
+    int         m_height;
+    PVTCELL     m_cells;
+    PVTCELL    *m_rows;
+    PBYTE       m_dirtyRows;
+    DWORD       m_scrollCount;
+    int         m_row;
+    int         m_col;
+    BOOL        m_fWrapPending;
+    BOOL        m_fCursorVisible;
+    int         m_savedRow;
+    int         m_savedCol;
+    WORD        m_savedAttrib;
+    int         m_scrollTop;
+    int         m_scrollBottom;
+    WORD        m_defAttrib;
+    WORD        m_attrib;
+
+    /**
+     *  This function rotates an array left in place.
+     *
+     *  @param array Points to the first element to rotate.
+     *  @param len Specifies the number of elements to rotate.
+     *  @param shift Specifies how far to rotate, less than len.
+     */
+    template<class T>
+    static
+    VOID
+    RotateLeft(
+        __inout_ecount(len) T *array,
+        __in                int len,
+        __in                int shift
+        )
+    {
+        //
+        // Reversing both parts and then the whole rotates it.
+        //
+        Reverse(array, 0, shift - 1);
+        Reverse(array, shift, len - 1);
+        Reverse(array, 0, len - 1);
+    }   //RotateLeft
+
+    /**
+     *  This function reverses part of an array in place.
+     *
+     *  @param array Points to the array.
+     *  @param first Specifies the first element to reverse.
+     *  @param last Specifies the last element to reverse.
+     */
+    template<class T>
+    static
+    VOID
+    Reverse(
+        __inout T *array,
+        __in    int first,
+        __in    int last
+        )
+    {
+        while (first < last)
+        {
+            T temp = array[first];
+
+            array[first++] = array[last];
+            array[last--] = temp;
+        }
+    }   //Reverse
+
+    /**
+     *  This function marks a range of rows dirty.
+     *
+     *  @param first Specifies the first row.
+     *  @param last Specifies the last row.
+     */
+    VOID
+    SetDirty(
+        __in int first,
+        __in int last
+        )
+    {
+        TLevel(HIFREQ);
+        TEnterMsg(("first=%d,last=%d", first, last));
+
+        if (first <= last)
+        {
+            FillMemory(&m_dirtyRows[first], last - first + 1, TRUE);
+        }
+
+        TExit();
+        return;
+    }   //SetDirty
+
+    /**
+     *  This function erases a range of cells in a row with the current
+     *  colors.
+     *
+     *  @param row Specifies the row.
+     *  @param first Specifies the first column.
+     *  @param last Specifies the last column.
+     */
+    VOID
+    EraseCells(
+        __in int row,
+        __in int first,
+        __in int last
+        )
+    {
+        WORD attrib = m_attrib & (FOREGROUND_MASK | BACKGROUND_MASK);
+        PVTCELL cells = m_rows[row];
+
+        TLevel(HIFREQ);
+        TEnterMsg(("row=%d,first=%d,last=%d", row, first, last));
+
+        for (int i = first; i <= last; i++)
+        {
+            cells[i].ch = ' ';
+            cells[i].attrib = attrib;
+        }
+        m_dirtyRows[row] = TRUE;
+
+        TExit();
+        return;
+    }   //EraseCells
+
+    /**
+     *  This function scrolls rows of the screen up, erasing the rows that
+     *  come in at the bottom.
+     *
+     *  @param top Specifies the first row to scroll.
+     *  @param bottom Specifies the last row to scroll.
+     *  @param numRows Specifies the number of rows to scroll by.
+     */
+    VOID
+    ScrollUp(
+        __in int top,
+        __in int bottom,
+        __in int numRows
+        )
+    {
+        int len = bottom - top + 1;
+
+        TLevel(FUNC);
+        TEnterMsg(("top=%d,bottom=%d,n=%d", top, bottom, numRows));
+
+        numRows = min(numRows, len);
+        if (numRows > 0)
+        {
+            if (numRows < len)
+            {
+                RotateLeft(&m_rows[top], len, numRows);
+            }
+
+            if ((top == 0) && (bottom == m_height - 1))
+            {
+                //
+                // The whole screen scrolls, the rows keep their dirty flags
+                // so the owner can scroll its output to match.
+                //
+                if (numRows < len)
+                {
+                    RotateLeft(m_dirtyRows, len, numRows);
+                }
+                m_scrollCount += numRows;
+            }
+            else
+            {
+                SetDirty(top, bottom);
+            }
+
+            for (int i = bottom - numRows + 1; i <= bottom; i++)
+            {
+                EraseCells(i, 0, m_width - 1);
+            }
+        }
+
+        TExitMsg(("(scrolls=%d)", m_scrollCount));
+        return;
+    }   //ScrollUp
+
+    /**
+     *  This function scrolls rows of the screen down, erasing the rows that
+     *  come in at the top.
+     *
+     *  @param top Specifies the first row to scroll.
+     *  @param bottom Specifies the last row to scroll.
+     *  @param numRows Specifies the number of rows to scroll by.
+     */
+    VOID
+    ScrollDown(
+        __in int top,
+        __in int bottom,
+        __in int numRows
+        )
+    {
+        int len = bottom - top + 1;
+
+        TLevel(FUNC);
+        TEnterMsg(("top=%d,bottom=%d,n=%d", top, bottom, numRows));
+
+        numRows = min(numRows, len);
+        if (numRows > 0)
+        {
+            if (numRows < len)
+            {
+                RotateLeft(&m_rows[top], len, len - numRows);
+            }
+            SetDirty(top, bottom);
+
+            for (int i = top; i < top + numRows; i++)
+            {
+                EraseCells(i, 0, m_width - 1);
+            }
+        }
+
+        TExit();
+        return;
+    }   //ScrollDown
+
+    /**
+     *  This function moves the cursor down a row, scrolling the scroll
+     *  region if the cursor is at its bottom.
+     */
+    VOID
+    LineFeed(
+        VOID
+        )
+    {
+        TLevel(HIFREQ);
+        TEnterMsg(("row=%d", m_row));
+
+        if (m_row == m_scrollBottom)
+        {
+            ScrollUp(m_scrollTop, m_scrollBottom, 1);
+        }
+        else if (m_row < m_height - 1)
+        {
+            m_row++;
+        }
+
+        TExitMsg(("(row=%d)", m_row));
+        return;
+    }   //LineFeed
+
+    /**
+     *  This function moves the cursor, keeping it on the screen.
+     *
+     *  @param row Specifies the new row.
+     *  @param col Specifies the new column.
+     */
+    VOID
+    MoveCursor(
+        __in int row,
+        __in int col
+        )
+    {
+        TLevel(HIFREQ);
+        TEnterMsg(("row=%d,col=%d", row, col));
+
+        m_row = max(min(row, m_height - 1), 0);
+        m_col = max(min(col, m_width - 1), 0);
+        m_fWrapPending = FALSE;
+
+        TExitMsg(("(row=%d,col=%d)", m_row, m_col));
+        return;
+    }   //MoveCursor
+
+    /**
+     *  This function puts plain text on the screen at the cursor, honoring
+     *  CR, LF, BS, TAB and line wrap. Other control characters are ignored.
+     *
+     *  @param text Points to the text.
+     *  @param len Specifies the length of the text.
+     */
+    VOID
+    PutText(
+        __in_ecount(len) LPCSTR text,
+        __in             DWORD len
+        )
+    {
+        TLevel(FUNC);
+        TEnterMsg(("text=%p,len=%d", text, len));
+
+        for (DWORD i = 0; i < len; i++)
+        {
+            switch (text[i])
+            {
+            case '\r':
+                m_col = 0;
+                m_fWrapPending = FALSE;
+                break;
+
+            case '\n':
+            case '\v':
+            case '\f':
+                m_col = 0;
+                m_fWrapPending = FALSE;
+                LineFeed();
+                break;
+
+            case '\b':
+                if (m_col > 0)
+                {
+                    m_col--;
+                }
+                m_fWrapPending = FALSE;
+                break;
+
+            case '\t':
+                m_col = min((m_col/VT_TAB_SIZE + 1)*VT_TAB_SIZE,
+                            m_width - 1);
+                break;
+
+            default:
+                if (((BYTE)text[i] >= 0x20) && (text[i] != 0x7f))
+                {
+                    PVTCELL cell;
+
+                    if (m_fWrapPending)
+                    {
+                        m_col = 0;
+                        m_fWrapPending = FALSE;
+                        LineFeed();
+                    }
+
+                    cell = &m_rows[m_row][m_col];
+                    cell->ch = text[i];
+                    cell->attrib = m_attrib;
+                    m_dirtyRows[m_row] = TRUE;
+
+                    if (m_col < m_width - 1)
+                    {
+                        m_col++;
+                    }
+                    else
+                    {
+                        //
+                        // Wrap when the next character comes, like a VT
+                        // terminal does, so a full line doesn't leave an
+                        // empty one behind.
+                        //
+                        m_fWrapPending = TRUE;
+                    }
+                }
+                break;
+            }
+        }
+
+        TExitMsg(("(row=%d,col=%d)", m_row, m_col));
+        return;
+    }   //PutText
+
+    /**
+     *  This function applies the arguments of an extended color code (38 or
+     *  48) to the current attributes, with the nearest console color. "5;n"
+     *  selects from the 256 color palette, "2;r;g;b" is an RGB color.
+     *
+     *  @param codes Points to the arguments following the 38 or 48.
+     *  @param numCodes Specifies the number of arguments.
+     *  @param mask Specifies FOREGROUND_MASK or BACKGROUND_MASK.
+     *
+     *  @return Returns the number of arguments used.
+     */
+    DWORD
+    ApplyExtColor(
+        __in_ecount(numCodes) const int *codes,
+        __in                  DWORD numCodes,
+        __in                  WORD mask
+        )
+    {
+        //
+        // The 16 system colors, the 6x6x6 color cube and the 24 grays of
+        // the 256 color palette, each mapped to the nearest console color.
+        //
+        static const BYTE Palette256[256] = {
+            0x0, 0x4, 0x2, 0x6, 0x1, 0x5, 0x3, 0x7,
+            0x8, 0xc, 0xa, 0xe, 0x9, 0xd, 0xb, 0xf,
+            0x0, 0x1, 0x1, 0x1, 0x9, 0x9, 0x2, 0x3,
+            0x3, 0x3, 0x3, 0x9, 0x2, 0x3, 0x3, 0x3,
+            0x3, 0xb, 0x2, 0x3, 0x3, 0x3, 0xb, 0xb,
+            0xa, 0x3, 0x3, 0xb, 0xb, 0xb, 0xa, 0xa,
+            0xb, 0xb, 0xb, 0xb, 0x4, 0x5, 0x5, 0x5,
+            0x5, 0x9, 0x6, 0x8, 0x8, 0x8, 0x8, 0x9,
+            0x6, 0x8, 0x8, 0x8, 0x8, 0x7, 0x6, 0x8,
+            0x8, 0x8, 0x7, 0x7, 0x6, 0x8, 0x8, 0x7,
+            0x7, 0xb, 0xa, 0xa, 0x7, 0x7, 0xb, 0xb,
+            0x4, 0x5, 0x5, 0x5, 0x5, 0xd, 0x6, 0x8,
+            0x8, 0x8, 0x8, 0x7, 0x6, 0x8, 0x8, 0x8,
+            0x7, 0x7, 0x6, 0x8, 0x8, 0x7, 0x7, 0x7,
+            0x6, 0x8, 0x7, 0x7, 0x7, 0x7, 0xe, 0x7,
+            0x7, 0x7, 0x7, 0x7, 0x4, 0x5, 0x5, 0x5,
+            0xd, 0xd, 0x6, 0x8, 0x8, 0x8, 0x7, 0x7,
+            0x6, 0x8, 0x8, 0x7, 0x7, 0x7, 0x6, 0x8,
+            0x7, 0x7, 0x7, 0x7, 0xe, 0x7, 0x7, 0x7,
+            0x7, 0x7, 0xe, 0x7, 0x7, 0x7, 0x7, 0xf,
+            0xc, 0x5, 0x5, 0xd, 0xd, 0xd, 0x6, 0x8,
+            0x8, 0x7, 0x7, 0xd, 0x6, 0x8, 0x7, 0x7,
+            0x7, 0x7, 0xe, 0x7, 0x7, 0x7, 0x7, 0x7,
+            0xe, 0x7, 0x7, 0x7, 0x7, 0xf, 0xe, 0xe,
+            0x7, 0x7, 0xf, 0xf, 0xc, 0xc, 0xd, 0xd,
+            0xd, 0xd, 0xc, 0xc, 0x7, 0x7, 0xd, 0xd,
+            0xe, 0x7, 0x7, 0x7, 0x7, 0x7, 0xe, 0x7,
+            0x7, 0x7, 0x7, 0xf, 0xe, 0xe, 0x7, 0x7,
+            0xf, 0xf, 0xe, 0xe, 0x7, 0xf, 0xf, 0xf,
+            0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x8, 0x8,
+            0x8, 0x8, 0x8, 0x8, 0x8, 0x8, 0x8, 0x8,
+            0x7, 0x7, 0x7, 0x7, 0x7, 0x7, 0xf, 0xf
+        };
+        DWORD numUsed = 0;
+        int color = -1;
+
+        TLevel(FUNC);
+        TEnterMsg(("codes=%p,n=%d,mask=%x", codes, numCodes, mask));
+
+        if (numCodes == 0)
+        {
+            TWarn(("Missing extended color type."));
+        }
+        else if (codes[0] == 5)
+        {
+            numUsed = min(numCodes, 2);
+            if (numUsed == 2)
+            {
+                color = Palette256[min(codes[1], 255)];
+            }
+        }
+        else if (codes[0] == 2)
+        {
+            numUsed = min(numCodes, 4);
+            if (numUsed == 4)
+            {
+                color = Palette256[16 +
+                                   RGB_TO_CUBE(min(codes[1], 255))*36 +
+                                   RGB_TO_CUBE(min(codes[2], 255))*6 +
+                                   RGB_TO_CUBE(min(codes[3], 255))];
+            }
+        }
+        else
+        {
+            //
+            // Unknown color type, the rest of the codes can't be trusted.
+            //
+            numUsed = numCodes;
+        }
+
+        if (color >= 0)
+        {
+            m_attrib &= ~mask;
+            m_attrib |= (mask == FOREGROUND_MASK)? (WORD)color:
+                                                   (WORD)(color << 4);
+        }
+
+        TExitMsg(("=%d (attrib=%x)", numUsed, m_attrib));
+        return numUsed;
+    }   //ApplyExtColor
+
+    /**
+     *  This function applies the parameters of an ANSI SGR sequence to the
+     *  current attributes. Each code is decoded with one table lookup.
+     *
+     *  @param codes Points to the SGR codes.
+     *  @param numCodes Specifies the number of codes.
+     */
+    VOID
+    ApplySgr(
+        __in_ecount(numCodes) const int *codes,
+        __in                  DWORD numCodes
+        )
+    {
+        //
+        // Indexed by the SGR code, covering the codes the console can show.
+        //
+        static const SGRENTRY SgrTable[] = {
+            {SGROP_RESET, 0, 0},                                  //0
+            SGR_SET(FOREGROUND_INTENSITY, FOREGROUND_INTENSITY),  //1
+            SGR_SET(FOREGROUND_INTENSITY, 0),                     //2
+            SGR_NONE,                                             //3
+            SGR_SET(COMMON_LVB_UNDERSCORE, COMMON_LVB_UNDERSCORE), //4
+            SGR_NONE,                                             //5
+            SGR_NONE,                                             //6
+            {SGROP_REVERSE, 0, 0},                                //7
+            SGR_NONE,                                             //8
+            SGR_NONE,                                             //9
+            SGR_NONE,                                             //10
+            SGR_NONE,                                             //11
+            SGR_NONE,                                             //12
+            SGR_NONE,                                             //13
+            SGR_NONE,                                             //14
+            SGR_NONE,                                             //15
+            SGR_NONE,                                             //16
+            SGR_NONE,                                             //17
+            SGR_NONE,                                             //18
+            SGR_NONE,                                             //19
+            SGR_NONE,                                             //20
+            SGR_NONE,                                             //21
+            SGR_SET(FOREGROUND_INTENSITY, 0),                     //22
+            SGR_NONE,                                             //23
+            SGR_SET(COMMON_LVB_UNDERSCORE, 0),                    //24
+            SGR_NONE,                                             //25
+            SGR_NONE,                                             //26
+            SGR_NONE,                                             //27
+            SGR_NONE,                                             //28
+            SGR_NONE,                                             //29
+            SGR_FG(FOREGROUND_BLACK),                             //30
+            SGR_FG(FOREGROUND_RED),                               //31
+            SGR_FG(FOREGROUND_GREEN),                             //32
+            SGR_FG(FOREGROUND_YELLOW),                            //33
+            SGR_FG(FOREGROUND_BLUE),                              //34
+            SGR_FG(FOREGROUND_MAGENTA),                           //35
+            SGR_FG(FOREGROUND_CYAN),                              //36
+            SGR_FG(FOREGROUND_WHITE),                             //37
+            {SGROP_EXTCOLOR, FOREGROUND_MASK, 0},                 //38
+            {SGROP_DEFAULT, FOREGROUND_MASK, 0},                  //39
+            SGR_BG(BACKGROUND_BLACK),                             //40
+            SGR_BG(BACKGROUND_RED),                               //41
+            SGR_BG(BACKGROUND_GREEN),                             //42
+            SGR_BG(BACKGROUND_YELLOW),                            //43
+            SGR_BG(BACKGROUND_BLUE),                              //44
+            SGR_BG(BACKGROUND_MAGENTA),                           //45
+            SGR_BG(BACKGROUND_CYAN),                              //46
+            SGR_BG(BACKGROUND_WHITE),                             //47
+            {SGROP_EXTCOLOR, BACKGROUND_MASK, 0},                 //48
+            {SGROP_DEFAULT, BACKGROUND_MASK, 0},                  //49
+            SGR_NONE,                                             //50
+            SGR_NONE,                                             //51
+            SGR_NONE,                                             //52
+            SGR_NONE,                                             //53
+            SGR_NONE,                                             //54
+            SGR_NONE,                                             //55
+            SGR_NONE,                                             //56
+            SGR_NONE,                                             //57
+            SGR_NONE,                                             //58
+            SGR_NONE,                                             //59
+            SGR_NONE,                                             //60
+            SGR_NONE,                                             //61
+            SGR_NONE,                                             //62
+            SGR_NONE,                                             //63
+            SGR_NONE,                                             //64
+            SGR_NONE,                                             //65
+            SGR_NONE,                                             //66
+            SGR_NONE,                                             //67
+            SGR_NONE,                                             //68
+            SGR_NONE,                                             //69
+            SGR_NONE,                                             //70
+            SGR_NONE,                                             //71
+            SGR_NONE,                                             //72
+            SGR_NONE,                                             //73
+            SGR_NONE,                                             //74
+            SGR_NONE,                                             //75
+            SGR_NONE,                                             //76
+            SGR_NONE,                                             //77
+            SGR_NONE,                                             //78
+            SGR_NONE,                                             //79
+            SGR_NONE,                                             //80
+            SGR_NONE,                                             //81
+            SGR_NONE,                                             //82
+            SGR_NONE,                                             //83
+            SGR_NONE,                                             //84
+            SGR_NONE,                                             //85
+            SGR_NONE,                                             //86
+            SGR_NONE,                                             //87
+            SGR_NONE,                                             //88
+            SGR_NONE,                                             //89
+            SGR_FG(FOREGROUND_BLACK | FOREGROUND_INTENSITY),      //90
+            SGR_FG(FOREGROUND_RED | FOREGROUND_INTENSITY),        //91
+            SGR_FG(FOREGROUND_GREEN | FOREGROUND_INTENSITY),      //92
+            SGR_FG(FOREGROUND_YELLOW | FOREGROUND_INTENSITY),     //93
+            SGR_FG(FOREGROUND_BLUE | FOREGROUND_INTENSITY),       //94
+            SGR_FG(FOREGROUND_MAGENTA | FOREGROUND_INTENSITY),    //95
+            SGR_FG(FOREGROUND_CYAN | FOREGROUND_INTENSITY),       //96
+            SGR_FG(FOREGROUND_WHITE | FOREGROUND_INTENSITY),      //97
+            SGR_NONE,                                             //98
+            SGR_NONE,                                             //99
+            SGR_BG(BACKGROUND_BLACK | BACKGROUND_INTENSITY),      //100
+            SGR_BG(BACKGROUND_RED | BACKGROUND_INTENSITY),        //101
+            SGR_BG(BACKGROUND_GREEN | BACKGROUND_INTENSITY),      //102
+            SGR_BG(BACKGROUND_YELLOW | BACKGROUND_INTENSITY),     //103
+            SGR_BG(BACKGROUND_BLUE | BACKGROUND_INTENSITY),       //104
+            SGR_BG(BACKGROUND_MAGENTA | BACKGROUND_INTENSITY),    //105
+            SGR_BG(BACKGROUND_CYAN | BACKGROUND_INTENSITY),       //106
+            SGR_BG(BACKGROUND_WHITE | BACKGROUND_INTENSITY)       //107
+        };
+
+        TLevel(FUNC);
+        TEnterMsg(("codes=%p,n=%d,attrib=%x", codes, numCodes, m_attrib));
+
+        if (numCodes == 0)
+        {
+            m_attrib = m_defAttrib;
+        }
+
+        for (DWORD i = 0; i < numCodes; i++)
+        {
+            if ((codes[i] >= 0) && (codes[i] < (int)ARRAYSIZE(SgrTable)))
+            {
+                const SGRENTRY *entry = &SgrTable[codes[i]];
+
+                switch (entry->op)
+                {
+                case SGROP_SET:
+                    m_attrib &= ~entry->mask;
+                    m_attrib |= entry->attrib;
+                    break;
+
+                case SGROP_RESET:
+                    m_attrib = m_defAttrib;
+                    break;
+
+                case SGROP_DEFAULT:
+                    m_attrib &= ~entry->mask;
+                    m_attrib |= m_defAttrib & entry->mask;
+                    break;
+
+                case SGROP_REVERSE:
+                    m_attrib = (m_attrib & ~(FOREGROUND_MASK |
+                                             BACKGROUND_MASK)) |
+                               ((m_attrib & FOREGROUND_MASK) << 4) |
+                               ((m_attrib & BACKGROUND_MASK) >> 4);
+                    break;
+
+                case SGROP_EXTCOLOR:
+                    i += ApplyExtColor(&codes[i + 1],
+                                       numCodes - i - 1,
+                                       entry->mask);
+                    break;
+                }
+            }
+        }
+
+        TExitMsg(("(attrib=%x)", m_attrib));
+        return;
+    }   //ApplySgr
+
+    /**
+     *  This function returns a numeric parameter of a control sequence.
+     *
+     *  @param span Points to the control sequence.
+     *  @param index Specifies the parameter index.
+     *  @param defValue Specifies the value if the parameter is missing or 0.
+     *
+     *  @return Returns the parameter value.
+     */
+    static
+    int
+    GetParam(
+        __in const AnsiScan::ANSISPAN *span,
+        __in DWORD index,
+        __in int defValue
+        )
+    {
+        int value = ((index < span->numParams) && (span->params[index] != 0))?
+                        span->params[index]: defValue;
+
+        TLevel(HIFREQ);
+        TEnterMsg(("span=%p,index=%d,def=%d", span, index, defValue));
+        TExitMsg(("=%d", value));
+        return value;
+    }   //GetParam
+
+    /**
+     *  This function executes a control sequence.
+     *
+     *  @param span Points to the control sequence.
+     */
+    VOID
+    ExecuteCsi(
+        __in const AnsiScan::ANSISPAN *span
+        )
+    {
+        int n = GetParam(span, 0, 1);
+
+        TLevel(FUNC);
+        TEnterMsg(("final=%c,prefix=%x,params=%d",
+                   span->final, span->prefix, span->numParams));
+
+        if (span->prefix == '?')
+        {
+            //
+            // Of the private modes, only cursor visibility matters here.
+            //
+            for (DWORD i = 0; i < span->numParams; i++)
+            {
+                if ((span->params[i] == 25) &&
+                    ((span->final == 'h') || (span->final == 'l')))
+                {
+                    m_fCursorVisible = (span->final == 'h');
+                }
+            }
+        }
+        else if (span->prefix == 0)
+        {
+            switch (span->final)
+            {
+            case 'A':   //CUU
+                MoveCursor(m_row - n, m_col);
+                break;
+
+            case 'B':   //CUD
+            case 'e':   //VPR
+                MoveCursor(m_row + n, m_col);
+                break;
+
+            case 'C':   //CUF
+            case 'a':   //HPR
+                MoveCursor(m_row, m_col + n);
+                break;
+
+            case 'D':   //CUB
+                MoveCursor(m_row, m_col - n);
+                break;
+
+            case 'E':   //CNL
+                MoveCursor(m_row + n, 0);
+                break;
+
+            case 'F':   //CPL
+                MoveCursor(m_row - n, 0);
+                break;
+
+            case 'G':   //CHA
+            case '`':   //HPA
+                MoveCursor(m_row, n - 1);
+                break;
+
+            case 'd':   //VPA
+                MoveCursor(n - 1, m_col);
+                break;
+
+            case 'H':   //CUP
+            case 'f':   //HVP
+                MoveCursor(n - 1, GetParam(span, 1, 1) - 1);
+                break;
+
+            case 'J':   //ED
+                switch (GetParam(span, 0, 0))
+                {
+                case 0:
+                    EraseCells(m_row, m_col, m_width - 1);
+                    for (int i = m_row + 1; i < m_height; i++)
+                    {
+                        EraseCells(i, 0, m_width - 1);
+                    }
+                    break;
+
+                case 1:
+                    for (int i = 0; i < m_row; i++)
+                    {
+                        EraseCells(i, 0, m_width - 1);
+                    }
+                    EraseCells(m_row, 0, m_col);
+                    break;
+
+                case 2:
+                case 3:
+                    for (int i = 0; i < m_height; i++)
+                    {
+                        EraseCells(i, 0, m_width - 1);
+                    }
+                    break;
+                }
+                break;
+
+            case 'K':   //EL
+                switch (GetParam(span, 0, 0))
+                {
+                case 0:
+                    EraseCells(m_row, m_col, m_width - 1);
+                    break;
+
+                case 1:
+                    EraseCells(m_row, 0, m_col);
+                    break;
+
+                case 2:
+                    EraseCells(m_row, 0, m_width - 1);
+                    break;
+                }
+                break;
+
+            case '@':   //ICH
+                n = min(n, m_width - m_col);
+                MoveMemory(&m_rows[m_row][m_col + n],
+                           &m_rows[m_row][m_col],
+                           (m_width - m_col - n)*sizeof(VTCELL));
+                EraseCells(m_row, m_col, m_col + n - 1);
+                break;
+
+            case 'P':   //DCH
+                n = min(n, m_width - m_col);
+                MoveMemory(&m_rows[m_row][m_col],
+                           &m_rows[m_row][m_col + n],
+                           (m_width - m_col - n)*sizeof(VTCELL));
+                EraseCells(m_row, m_width - n, m_width - 1);
+                break;
+
+            case 'X':   //ECH
+                EraseCells(m_row, m_col, min(m_col + n, m_width) - 1);
+                break;
+
+            case 'L':   //IL
+                if ((m_row >= m_scrollTop) && (m_row <= m_scrollBottom))
+                {
+                    ScrollDown(m_row, m_scrollBottom, n);
+                    m_col = 0;
+                }
+                break;
+
+            case 'M':   //DL
+                if ((m_row >= m_scrollTop) && (m_row <= m_scrollBottom))
+                {
+                    ScrollUp(m_row, m_scrollBottom, n);
+                    m_col = 0;
+                }
+                break;
+
+            case 'S':   //SU
+                ScrollUp(m_scrollTop, m_scrollBottom, n);
+                break;
+
+            case 'T':   //SD
+                ScrollDown(m_scrollTop, m_scrollBottom, n);
+                break;
+
+            case 'r':   //DECSTBM
+            {
+                int top = GetParam(span, 0, 1) - 1;
+                int bottom = min(GetParam(span, 1, m_height), m_height) - 1;
+
+                if (top < bottom)
+                {
+                    m_scrollTop = top;
+                    m_scrollBottom = bottom;
+                    MoveCursor(0, 0);
+                }
+                break;
+            }
+
+            case 's':   //SCOSC
+                m_savedRow = m_row;
+                m_savedCol = m_col;
+                m_savedAttrib = m_attrib;
+                break;
+
+            case 'u':   //SCORC
+                MoveCursor(m_savedRow, m_savedCol);
+                m_attrib = m_savedAttrib;
+                break;
+
+            case 'm':   //SGR
+                ApplySgr(span->params, span->numParams);
+                break;
+            }
+        }
+
+        TExitMsg(("(row=%d,col=%d)", m_row, m_col));
+        return;
+    }   //ExecuteCsi
+
+public:
+    /**
+     *  Constructor of the class object.
+     */
+    VtScreen(
+        VOID
+        ): m_width(0)
+         , m_height(0)
+         , m_cells(NULL)
+         , m_rows(NULL)
+         , m_dirtyRows(NULL)
+         , m_scrollCount(0)
+         , m_row(0)
+         , m_col(0)
+         , m_fWrapPending(FALSE)
+         , m_fCursorVisible(TRUE)
+         , m_savedRow(0)
+         , m_savedCol(0)
+         , m_savedAttrib(0)
+         , m_scrollTop(0)
+         , m_scrollBottom(0)
+         , m_defAttrib(0)
+         , m_attrib(0)
+    {
+        TLevel(INIT);
+        TEnter();
+        TExit();
+        return;
+    }   //VtScreen
+
+    /**
+     *  Destructor of the class object.
+     */
+    ~VtScreen(
+        VOID
+        )
+    {
+        TLevel(INIT);
+        TEnter();
+
+        SAFE_DELETE_ARRAY(m_dirtyRows);
+        SAFE_DELETE_ARRAY(m_rows);
+        SAFE_DELETE_ARRAY(m_cells);
+
+        TExit();
+        return;
+    }   //~VtScreen
+
+    /**
+     *  This function allocates the screen and clears it. All rows start
+     *  dirty.
+     *
+     *  @param width Specifies the number of columns.
+     *  @param height Specifies the number of rows.
+     *  @param defAttrib Specifies the default text attributes.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    Initialize(
+        __in SHORT width,
+        __in SHORT height,
+        __in WORD defAttrib
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(API);
+        TEnterMsg(("width=%d,height=%d,attrib=%x", width, height, defAttrib));
+
+        if ((width <= 0) || (height <= 0))
+        {
+            hr = E_INVALIDARG;
+            TErr(("Invalid screen size (width=%d,height=%d).",
+                  width, height));
+        }
+        else if (m_cells != NULL)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_ALREADY_INITIALIZED);
+            TErr(("Screen is already initialized."));
+        }
+        else if ((m_cells = new VTCELL[width*height]) == NULL)
+        {
+            hr = E_OUTOFMEMORY;
+            TErr(("Failed to allocate screen cells (cells=%d).",
+                  width*height));
+        }
+        else if ((m_rows = new PVTCELL[height]) == NULL)
+        {
+            hr = E_OUTOFMEMORY;
+            TErr(("Failed to allocate screen rows (rows=%d).", height));
+        }
+        else if ((m_dirtyRows = new BYTE[height]) == NULL)
+        {
+            hr = E_OUTOFMEMORY;
+            TErr(("Failed to allocate dirty rows (rows=%d).", height));
+        }
+        else
+        {
+            m_width = width;
+            m_height = height;
+            m_scrollTop = 0;
+            m_scrollBottom = height - 1;
+            m_defAttrib = defAttrib;
+            m_attrib = defAttrib;
+            m_savedAttrib = defAttrib;
+            for (int i = 0; i < m_height; i++)
+            {
+                m_rows[i] = &m_cells[i*m_width];
+                EraseCells(i, 0, m_width - 1);
+            }
+        }
+
+        if (FAILED(hr))
+        {
+            SAFE_DELETE_ARRAY(m_dirtyRows);
+            SAFE_DELETE_ARRAY(m_rows);
+            SAFE_DELETE_ARRAY(m_cells);
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //Initialize
+
+    /**
+     *  This function changes the size of the screen. The text is kept
+     *  aligned to the top left, except that rows above the cursor are
+     *  dropped if it would fall off the bottom. The scroll region is reset
+     *  and all rows are dirty.
+     *
+     *  @param width Specifies the new number of columns.
+     *  @param height Specifies the new number of rows.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code, the screen is unchanged.
+     */
+    HRESULT
+    Resize(
+        __in SHORT width,
+        __in SHORT height
+        )
+    {
+        HRESULT hr = S_OK;
+        PVTCELL cells = NULL;
+        PVTCELL *rows = NULL;
+        PBYTE dirtyRows = NULL;
+
+        TLevel(API);
+        TEnterMsg(("width=%d,height=%d", width, height));
+
+        if ((width <= 0) || (height <= 0))
+        {
+            hr = E_INVALIDARG;
+            TErr(("Invalid screen size (width=%d,height=%d).",
+                  width, height));
+        }
+        else if (m_cells == NULL)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_STATE);
+            TErr(("Screen is not initialized."));
+        }
+        else if ((cells = new VTCELL[width*height]) == NULL)
+        {
+            hr = E_OUTOFMEMORY;
+            TErr(("Failed to allocate screen cells (cells=%d).",
+                  width*height));
+        }
+        else if ((rows = new PVTCELL[height]) == NULL)
+        {
+            hr = E_OUTOFMEMORY;
+            TErr(("Failed to allocate screen rows (rows=%d).", height));
+        }
+        else if ((dirtyRows = new BYTE[height]) == NULL)
+        {
+            hr = E_OUTOFMEMORY;
+            TErr(("Failed to allocate dirty rows (rows=%d).", height));
+        }
+        else
+        {
+            int shift = max(m_row - (height - 1), 0);
+            int copyWidth = min(m_width, (int)width);
+            PVTCELL *oldRows = m_rows;
+
+            for (int i = 0; i < height; i++)
+            {
+                rows[i] = &cells[i*width];
+            }
+            //
+            // Swap the new arrays in, so the old rows can be copied over
+            // and the new cells erased with the usual helpers.
+            //
+            SAFE_DELETE_ARRAY(m_dirtyRows);
+            m_dirtyRows = dirtyRows;
+            m_rows = rows;
+            for (int i = 0; i < height; i++)
+            {
+                EraseCells(i, 0, width - 1);
+                if (i + shift < m_height)
+                {
+                    CopyMemory(rows[i],
+                               oldRows[i + shift],
+                               copyWidth*sizeof(VTCELL));
+                }
+            }
+            delete [] oldRows;
+            delete [] m_cells;
+            m_cells = cells;
+            m_width = width;
+            m_height = height;
+            m_row = min(m_row - shift, m_height - 1);
+            m_col = min(m_col, m_width - 1);
+            m_savedRow = min(m_savedRow, m_height - 1);
+            m_savedCol = min(m_savedCol, m_width - 1);
+            m_fWrapPending = FALSE;
+            m_scrollTop = 0;
+            m_scrollBottom = height - 1;
+            m_scrollCount = 0;
+        }
+
+        if (FAILED(hr))
+        {
+            SAFE_DELETE_ARRAY(dirtyRows);
+            SAFE_DELETE_ARRAY(rows);
+            SAFE_DELETE_ARRAY(cells);
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //Resize
+
+    /**
+     *  This function feeds received data to the screen. The data may be of
+     *  any length and escape sequences may be split across calls.
+     *
+     *  @param text Points to the data.
+     *  @param len Specifies the length of the data.
+     */
+    VOID
+    Write(
+        __in_ecount(len) LPCSTR text,
+        __in             DWORD len
+        )
+    {
+        AnsiScan::ANSISPAN span;
+
+        TLevel(API);
+        TEnterMsg(("text=%p,len=%d", text, len));
+
+        if (m_cells != NULL)
+        {
+            m_ansiScan.SetText(text, len);
+            while (m_ansiScan.NextSpan(&span))
+            {
+                PutText(span.text, span.textLen);
+                if (span.final != 0)
+                {
+                    ExecuteCsi(&span);
+                }
+            }
+        }
+
+        TExit();
+        return;
+    }   //Write
+
+    /**
+     *  This function returns the number of columns.
+     *
+     *  @return Returns the screen width.
+     */
+    SHORT
+    GetWidth(
+        VOID
+        )
+    {
+        TLevel(API);
+        TEnter();
+        TExitMsg(("=%d", m_width));
+        return (SHORT)m_width;
+    }   //GetWidth
+
+    /**
+     *  This function returns the number of rows.
+     *
+     *  @return Returns the screen height.
+     */
+    SHORT
+    GetHeight(
+        VOID
+        )
+    {
+        TLevel(API);
+        TEnter();
+        TExitMsg(("=%d", m_height));
+        return (SHORT)m_height;
+    }   //GetHeight
+
+    /**
+     *  This function returns the cells of a row.
+     *
+     *  @param row Specifies the row.
+     *
+     *  @return Returns the width cells of the row.
+     */
+    const VTCELL *
+    GetRow(
+        __in SHORT row
+        )
+    {
+        TLevel(HIFREQ);
+        TEnterMsg(("row=%d", row));
+        TAssert((row >= 0) && (row < m_height));
+        TExitMsg(("=%p", m_rows[row]));
+        return m_rows[row];
+    }   //GetRow
+
+    /**
+     *  This function returns the cursor position.
+     *
+     *  @return Returns the cursor column and row.
+     */
+    COORD
+    GetCursor(
+        VOID
+        )
+    {
+        COORD pos = {(SHORT)m_col, (SHORT)m_row};
+
+        TLevel(API);
+        TEnter();
+        TExitMsg(("=(%d,%d)", pos.X, pos.Y));
+        return pos;
+    }   //GetCursor
+
+    /**
+     *  This function checks if the cursor is shown.
+     *
+     *  @return Returns TRUE if the cursor is visible.
+     */
+    BOOL
+    IsCursorVisible(
+        VOID
+        )
+    {
+        TLevel(API);
+        TEnter();
+        TExitMsg(("=%d", m_fCursorVisible));
+        return m_fCursorVisible;
+    }   //IsCursorVisible
+
+    /**
+     *  This function returns the current text attributes.
+     *
+     *  @return Returns the text attributes.
+     */
+    WORD
+    GetAttrib(
+        VOID
+        )
+    {
+        TLevel(API);
+        TEnter();
+        TExitMsg(("=%x", m_attrib));
+        return m_attrib;
+    }   //GetAttrib
+
+    /**
+     *  This function checks if a row changed since the damage was cleared.
+     *
+     *  @param row Specifies the row.
+     *
+     *  @return Returns TRUE if the row must be redrawn.
+     */
+    BOOL
+    IsRowDirty(
+        __in SHORT row
+        )
+    {
+        TLevel(HIFREQ);
+        TEnterMsg(("row=%d", row));
+        TAssert((row >= 0) && (row < m_height));
+        TExitMsg(("=%d", m_dirtyRows[row]));
+        return m_dirtyRows[row];
+    }   //IsRowDirty
+
+    /**
+     *  This function returns how many rows the whole screen scrolled up
+     *  since the damage was cleared. The owner should scroll its output by
+     *  as much before drawing the dirty rows.
+     *
+     *  @return Returns the number of rows scrolled.
+     */
+    DWORD
+    GetScrollCount(
+        VOID
+        )
+    {
+        TLevel(API);
+        TEnter();
+        TExitMsg(("=%d", m_scrollCount));
+        return m_scrollCount;
+    }   //GetScrollCount
+
+    /**
+     *  This function clears the dirty rows and the scroll count after the
+     *  owner has drawn the screen.
+     */
+    VOID
+    ClearDamage(
+        VOID
+        )
+    {
+        TLevel(API);
+        TEnter();
+
+        if (m_dirtyRows != NULL)
+        {
+            ZeroMemory(m_dirtyRows, m_height);
+        }
+        m_scrollCount = 0;
+
+        TExit();
+        return;
+    }   //ClearDamage
+};  //class VtScreen
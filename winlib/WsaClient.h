@@ -24,6 +24,33 @@
 class WsaClient
 {
 private:
+    #define BATCH_BUFF_SIZE             16384
+    #define MAX_BATCH_MSGS              64
+    #define REPLAY_BUFF_SIZE            4096
+    #define CONNECT_TIMEOUT             5000
+    #define RECONNECT_MIN_DELAY         250
+    #define RECONNECT_MAX_DELAY         8000
+    #define CLIENT_STOP_TIMEOUT         5000
+
+    //
+    // Connection states. Writes are queued for replay until the reconnect
+    // thread has replayed them and moved the state to connected.
+    //
+    #define CONNSTATE_DISCONNECTED      0
+    #define CONNSTATE_REPLAY            1
+    #define CONNSTATE_CONNECTED         2
+
+    //
+    // A connected socket. Every call using the socket holds a reference,
+    // so the socket is only closed once nobody uses it any more and its
+    // handle can't be reused under them.
+    //
+    typedef struct _sockRef
+    {
+        SOCKET      socket;
+        LONG        refCount;
+    } SOCKREF, *PSOCKREF;
+
     //
     // Private data.
     //
@@ -31,130 +58,1115 @@ private:
     int         m_family;
     int         m_sockType;
     int         m_protocol;
-    SOCKET      m_socket;
+    PSOCKREF    m_sockRef;
     WSADATA     m_wsaData;
     WCHAR       m_szHost[NI_MAXHOST];
     WCHAR       m_szPort[NI_MAXSERV];
     WCHAR       m_szAddrName[NI_MAXHOST];
     WCHAR       m_szPortName[NI_MAXSERV];
+    BYTE        m_batchBuff[BATCH_BUFF_SIZE];
+    WSABUF      m_batchMsgs[MAX_BATCH_MSGS];
+    DWORD       m_numBatchMsgs;
+    DWORD       m_batchLen;
+    BOOL        m_fNoSegmentation;
+    //
+    // Overlapped contexts reused by SyncRead and SyncWrite, their events
+    // live as long as the client.
+    //
+    WSAOVERLAPPED m_readCtxt;
+    WSAOVERLAPPED m_writeCtxt;
+    //
+    // Reconnect state. The replay buffer holds the writes made while the
+    // connection was down, each prefixed with its length.
+    //
+    CRITICAL_SECTION m_connCritSect;
+    HANDLE      m_hReconnectThread;
+    HANDLE      m_hStopEvent;
+    HANDLE      m_hReconnectEvent;
+    WSAEVENT    m_hConnectEvent;
+    DWORD       m_connState;
+    DWORD       m_jitterSeed;
+    DWORD       m_replayLen;
+    BYTE        m_replayBuff[REPLAY_BUFF_SIZE];
+    BYTE        m_replaySendBuff[REPLAY_BUFF_SIZE];
+
+    friend
+    DWORD WINAPI
+    ReconnectThreadProc(
+        __in LPVOID lpParam
+        );
 
     /**
-     *  This function initializes a Winsock client connection.
+     *  This function makes one connection attempt. The connect is issued
+     *  non-blocking and waited for with a timeout, so the attempt can be
+     *  aborted by the stop event. The returned socket is back in blocking
+     *  mode.
+     *
+     *  @param psock Points to a variable to hold the connected socket.
      *
      *  @return Success: Returns S_OK.
      *  @return Failure: Returns HRESULT code.
      */
     HRESULT
-    InitConnection(
-        VOID
+    TryConnect(
+        __out SOCKET *psock
         )
     {
         HRESULT hr = S_OK;
+        DWORD dwErr;
+        ADDRINFOW hints;
+        ADDRINFOW *ai;
+        SOCKET sock = INVALID_SOCKET;
 
         TLevel(FUNC);
-        TEnter();
+        TEnterMsg(("psock=%p", psock));
 
-        if (m_socket == INVALID_SOCKET)
+        ZeroMemory(&hints, sizeof(hints));
+        hints.ai_family = m_family;
+        hints.ai_socktype = m_sockType;
+        hints.ai_protocol = m_protocol;
+        dwErr = GetAddrInfoW(m_szHost, m_szPort, &hints, &ai);
+        if (dwErr != NO_ERROR)
+        {
+            TWarn(("Failed to get address info (err=%d).", dwErr));
+        }
+        else
         {
-            DWORD dwErr;
-            ADDRINFOW hints;
-            ADDRINFOW *ai;
+            SOCKADDR_STORAGE addr;
+            int len = sizeof(addr);
 
-            ZeroMemory(&hints, sizeof(hints));
-            hints.ai_family = m_family;
-            hints.ai_socktype = m_sockType;
-            hints.ai_protocol = m_protocol;
-            dwErr = GetAddrInfoW(m_szHost, m_szPort, &hints, &ai);
-            if (dwErr != NO_ERROR)
+            TInfo(("Flags=%x,Family=%x,SockType=%x,Protocol=%x,"
+                   "CanonName=%ws,AddrFamily=%x",
+                   ai->ai_flags, ai->ai_family, ai->ai_socktype,
+                   ai->ai_protocol,
+                   ai->ai_canonname? ai->ai_canonname: L"<null>",
+                   ai->ai_addr->sa_family));
+            TAssert((ai->ai_family == AF_INET) ||
+                    (ai->ai_family == AF_INET6));
+
+            sock = WSASocket(ai->ai_family,
+                             ai->ai_socktype,
+                             ai->ai_protocol,
+                             NULL, 0, WSA_FLAG_OVERLAPPED);
+            if (sock == INVALID_SOCKET)
             {
-                TWarn(("Failed to get address info (err=%d).", dwErr));
+                dwErr = WSAGetLastError();
+                TErr(("Failed to create socket (err=%d).", dwErr));
             }
             else
             {
-                SOCKADDR_STORAGE addr;
-                int len = sizeof(addr);
-
-                TInfo(("Flags=%x,Family=%x,SockType=%x,Protocol=%x,"
-                       "CanonName=%ws,AddrFamily=%x",
-                       ai->ai_flags, ai->ai_family, ai->ai_socktype,
-                       ai->ai_protocol,
-                       ai->ai_canonname? ai->ai_canonname: L"<null>",
-                       ai->ai_addr->sa_family));
-                TAssert((ai->ai_family == AF_INET) ||
-                        (ai->ai_family == AF_INET6));
-
-                m_socket = WSASocket(ai->ai_family,
-                                     ai->ai_socktype,
-                                     ai->ai_protocol,
-                                     NULL, 0, WSA_FLAG_OVERLAPPED);
-                if (m_socket == INVALID_SOCKET)
+                //
+                // Selecting FD_CONNECT also puts the socket in non-blocking
+                // mode.
+                //
+                WSAResetEvent(m_hConnectEvent);
+                if (WSAEventSelect(sock, m_hConnectEvent, FD_CONNECT) ==
+                    SOCKET_ERROR)
                 {
                     dwErr = WSAGetLastError();
-                    TErr(("Failed to create socket (err=%d).", dwErr));
+                    TErr(("Failed to select connect event (err=%d).", dwErr));
                 }
-                else
+                else if ((connect(sock, ai->ai_addr, (int)ai->ai_addrlen) ==
+                          SOCKET_ERROR) &&
+                         ((dwErr = WSAGetLastError()) == WSAEWOULDBLOCK))
                 {
-                    while (connect(m_socket, ai->ai_addr, (int)ai->ai_addrlen)
-                           == SOCKET_ERROR)
+                    HANDLE ahWait[2] = {m_hStopEvent, m_hConnectEvent};
+                    WSANETWORKEVENTS netEvents;
+
+                    dwErr = WaitForMultipleObjects(ARRAYSIZE(ahWait),
+                                                   ahWait,
+                                                   FALSE,
+                                                   CONNECT_TIMEOUT);
+                    if (dwErr == WAIT_OBJECT_0)
+                    {
+                        dwErr = ERROR_OPERATION_ABORTED;
+                    }
+                    else if (dwErr == WAIT_TIMEOUT)
+                    {
+                        dwErr = WSAETIMEDOUT;
+                    }
+                    else if (dwErr != WAIT_OBJECT_0 + 1)
+                    {
+                        dwErr = GetLastError();
+                        TErr(("Failed to wait for connect (err=%d).", dwErr));
+                    }
+                    else if (WSAEnumNetworkEvents(sock,
+                                                  m_hConnectEvent,
+                                                  &netEvents) == SOCKET_ERROR)
                     {
                         dwErr = WSAGetLastError();
-                        if (dwErr == WSAECONNREFUSED)
-                        {
-                            dwErr = NO_ERROR;
-                            Sleep(1000);
-                        }
-                        else
-                        {
-                            TErr(("Failed to connect socket (err=%d).",
-                                  dwErr));
-                            break;
-                        }
+                        TErr(("Failed to get connect result (err=%d).",
+                              dwErr));
+                    }
+                    else
+                    {
+                        dwErr = netEvents.iErrorCode[FD_CONNECT_BIT];
                     }
                 }
 
-                if (SUCCEEDED(hr))
+                if (dwErr == NO_ERROR)
                 {
-                    if (getpeername(m_socket, (SOCKADDR *)&addr, &len) ==
-                        SOCKET_ERROR)
-                    {
-                        TWarn(("Failed to get peer name of socket (err=%d).",
-                               WSAGetLastError()));
-                    }
-                    else if (GetNameInfoW((SOCKADDR *)&addr,
-                                          len,
-                                          m_szAddrName,
-                                          ARRAYSIZE(m_szAddrName),
-                                          m_szPortName,
-                                          ARRAYSIZE(m_szPortName),
-                                          NI_NUMERICHOST) != NO_ERROR)
+                    u_long nonBlocking = 0;
+
+                    if ((WSAEventSelect(sock, NULL, 0) == SOCKET_ERROR) ||
+                        (ioctlsocket(sock, FIONBIO, &nonBlocking) ==
+                         SOCKET_ERROR))
                     {
-                        TWarn(("Failed to get socket name info (err=%d).",
-                               WSAGetLastError()));
+                        dwErr = WSAGetLastError();
+                        TErr(("Failed to restore blocking mode (err=%d).",
+                              dwErr));
                     }
-                    else
+                }
+                else
+                {
+                    TWarn(("Failed to connect socket (err=%d).", dwErr));
+                }
+            }
+
+            if (dwErr == NO_ERROR)
+            {
+                if (getpeername(sock, (SOCKADDR *)&addr, &len) ==
+                    SOCKET_ERROR)
+                {
+                    TWarn(("Failed to get peer name of socket (err=%d).",
+                           WSAGetLastError()));
+                }
+                else if (GetNameInfoW((SOCKADDR *)&addr,
+                                      len,
+                                      m_szAddrName,
+                                      ARRAYSIZE(m_szAddrName),
+                                      m_szPortName,
+                                      ARRAYSIZE(m_szPortName),
+                                      NI_NUMERICHOST) != NO_ERROR)
+                {
+                    TWarn(("Failed to get socket name info (err=%d).",
+                           WSAGetLastError()));
+                }
+                else
+                {
+                    TInfo(("Connected to %ws:%ws",
+                           m_szAddrName, m_szPortName));
+                }
+            }
+            else if (sock != INVALID_SOCKET)
+            {
+                closesocket(sock);
+                sock = INVALID_SOCKET;
+            }
+            FreeAddrInfoW(ai);
+        }
+
+        if (dwErr != NO_ERROR)
+        {
+            hr = HRESULT_FROM_WIN32(dwErr);
+        }
+        *psock = sock;
+
+        TExitMsg(("=%x (sock=%p)", hr, sock));
+        return hr;
+    }   //TryConnect
+
+    /**
+     *  This function takes a reference on the current socket if the
+     *  connection is in the given state.
+     *
+     *  @param connState Specifies the connection state required.
+     *
+     *  @return Success: Returns the socket reference.
+     *  @return Failure: Returns NULL.
+     */
+    PSOCKREF
+    AcquireSocket(
+        __in DWORD connState
+        )
+    {
+        PSOCKREF ref = NULL;
+
+        TLevel(FUNC);
+        TEnterMsg(("connState=%d", connState));
+
+        EnterCriticalSection(&m_connCritSect);
+        if ((m_connState == connState) && (m_sockRef != NULL))
+        {
+            ref = m_sockRef;
+            ref->refCount++;
+        }
+        LeaveCriticalSection(&m_connCritSect);
+
+        TExitMsg(("=%p", ref));
+        return ref;
+    }   //AcquireSocket
+
+    /**
+     *  This function drops a reference on a socket and closes the socket
+     *  when the last one is gone.
+     *
+     *  @param ref Points to the socket reference.
+     */
+    VOID
+    ReleaseSocket(
+        __in PSOCKREF ref
+        )
+    {
+        BOOL fClose;
+
+        TLevel(FUNC);
+        TEnterMsg(("ref=%p", ref));
+
+        EnterCriticalSection(&m_connCritSect);
+        fClose = (--ref->refCount == 0);
+        LeaveCriticalSection(&m_connCritSect);
+
+        if (fClose)
+        {
+            TInfo(("Closing socket %p.", ref->socket));
+            closesocket(ref->socket);
+            delete ref;
+        }
+
+        TExit();
+        return;
+    }   //ReleaseSocket
+
+    /**
+     *  This function drops a broken connection and wakes the reconnect
+     *  thread to establish a new one. The I/O still outstanding on the
+     *  socket is cancelled, the socket is closed when the last caller
+     *  using it lets go. A failure on a socket that has already been
+     *  replaced is ignored.
+     *
+     *  @param ref Points to the reference of the socket that failed.
+     */
+    VOID
+    Disconnect(
+        __in PSOCKREF ref
+        )
+    {
+        BOOL fDropped = FALSE;
+
+        TLevel(FUNC);
+        TEnterMsg(("ref=%p", ref));
+
+        EnterCriticalSection(&m_connCritSect);
+        if ((ref != NULL) && (ref == m_sockRef))
+        {
+            m_sockRef = NULL;
+            m_connState = CONNSTATE_DISCONNECTED;
+            CancelIoEx((HANDLE)ref->socket, NULL);
+            fDropped = TRUE;
+        }
+        LeaveCriticalSection(&m_connCritSect);
+
+        if (fDropped)
+        {
+            //
+            // Drop the reference of the connection itself.
+            //
+            ReleaseSocket(ref);
+            if (m_hReconnectEvent != NULL)
+            {
+                SetEvent(m_hReconnectEvent);
+            }
+        }
+
+        TExitMsg(("(dropped=%d)", fDropped));
+        return;
+    }   //Disconnect
+
+    /**
+     *  This function queues a write for replay after reconnect. The buffers
+     *  are gathered into one message. It must be called with the connection
+     *  lock held.
+     *
+     *  @param buffs Points to the array of buffers.
+     *  @param numBuffs Specifies the number of buffers.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    QueueReplay(
+        __in_ecount(numBuffs) LPWSABUF buffs,
+        __in                  DWORD numBuffs
+        )
+    {
+        HRESULT hr = S_OK;
+        DWORD dwcbLen = 0;
+
+        TLevel(FUNC);
+        TEnterMsg(("buffs=%p,n=%d,replayLen=%d",
+                   buffs, numBuffs, m_replayLen));
+
+        for (DWORD i = 0; i < numBuffs; i++)
+        {
+            dwcbLen += buffs[i].len;
+        }
+
+        if ((dwcbLen > REPLAY_BUFF_SIZE) ||
+            (m_replayLen + sizeof(DWORD) + dwcbLen > REPLAY_BUFF_SIZE))
+        {
+            hr = HRESULT_FROM_WIN32(WSAENOBUFS);
+            TWarn(("Replay queue is full, dropping %d bytes.", dwcbLen));
+        }
+        else
+        {
+            CopyMemory(m_replayBuff + m_replayLen, &dwcbLen, sizeof(DWORD));
+            m_replayLen += sizeof(DWORD);
+            for (DWORD i = 0; i < numBuffs; i++)
+            {
+                CopyMemory(m_replayBuff + m_replayLen,
+                           buffs[i].buf,
+                           buffs[i].len);
+                m_replayLen += buffs[i].len;
+            }
+        }
+
+        TExitMsg(("=%x (replayLen=%d)", hr, m_replayLen));
+        return hr;
+    }   //QueueReplay
+
+    /**
+     *  This function sends the writes queued while the connection was down,
+     *  in order and with their message boundaries. Writes made meanwhile
+     *  are queued behind them, so the state only goes to connected once the
+     *  queue is empty.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    ReplayQueued(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+        PSOCKREF ref;
+
+        TLevel(FUNC);
+        TEnter();
+
+        if ((ref = AcquireSocket(CONNSTATE_REPLAY)) == NULL)
+        {
+            hr = HRESULT_FROM_WIN32(WSAENOTCONN);
+        }
+        else
+        {
+            EnterCriticalSection(&m_connCritSect);
+            while (SUCCEEDED(hr) && (m_replayLen > 0))
+            {
+                DWORD dwcbSend = m_replayLen;
+                DWORD dwcbSent = 0;
+
+                //
+                // Send from a copy, so writes can be queued behind it
+                // meanwhile. The queue keeps the data until it has gone
+                // out, so a failed replay is retried after the reconnect.
+                //
+                CopyMemory(m_replaySendBuff, m_replayBuff, dwcbSend);
+                LeaveCriticalSection(&m_connCritSect);
+
+                while (dwcbSent < dwcbSend)
+                {
+                    DWORD dwcbMsg;
+
+                    CopyMemory(&dwcbMsg,
+                               m_replaySendBuff + dwcbSent,
+                               sizeof(DWORD));
+                    if (send(ref->socket,
+                             (LPSTR)(m_replaySendBuff + dwcbSent +
+                                     sizeof(DWORD)),
+                             (int)dwcbMsg,
+                             0) == SOCKET_ERROR)
                     {
-                        TInfo(("Connected to %ws:%ws",
-                               m_szAddrName, m_szPortName));
+                        hr = HRESULT_FROM_WIN32(WSAGetLastError());
+                        TWarn(("Failed to replay queued data (hr=%x).", hr));
+                        break;
                     }
+                    dwcbSent += sizeof(DWORD) + dwcbMsg;
                 }
 
-                if ((dwErr != NO_ERROR) && (m_socket != INVALID_SOCKET))
-                {
-                    closesocket(m_socket);
-                    m_socket = INVALID_SOCKET;
-                }
-                FreeAddrInfoW(ai);
-            }
+                EnterCriticalSection(&m_connCritSect);
+                MoveMemory(m_replayBuff,
+                           m_replayBuff + dwcbSent,
+                           m_replayLen - dwcbSent);
+                m_replayLen -= dwcbSent;
+            }
+
+            if (SUCCEEDED(hr) && (m_sockRef == ref))
+            {
+                m_connState = CONNSTATE_CONNECTED;
+            }
+            LeaveCriticalSection(&m_connCritSect);
+
+            if (FAILED(hr))
+            {
+                Disconnect(ref);
+            }
+            ReleaseSocket(ref);
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //ReplayQueued
+
+    /**
+     *  This function calculates the delay before the next connection
+     *  attempt. The delay doubles with each failed attempt up to a limit,
+     *  and a random jitter of up to half the delay is added so that
+     *  several clients don't retry in lock step.
+     *
+     *  @param numAttempts Specifies the number of failed attempts so far.
+     *
+     *  @return Returns the delay in milli-seconds.
+     */
+    DWORD
+    GetBackoffDelay(
+        __in DWORD numAttempts
+        )
+    {
+        DWORD delay = RECONNECT_MIN_DELAY;
+
+        TLevel(FUNC);
+        TEnterMsg(("attempts=%d", numAttempts));
+
+        while ((numAttempts > 0) && (delay < RECONNECT_MAX_DELAY))
+        {
+            delay <<= 1;
+            numAttempts--;
+        }
+        delay = min(delay, RECONNECT_MAX_DELAY);
+        //
+        // Xorshift is plenty for jitter.
+        //
+        m_jitterSeed ^= m_jitterSeed << 13;
+        m_jitterSeed ^= m_jitterSeed >> 17;
+        m_jitterSeed ^= m_jitterSeed << 5;
+        delay += m_jitterSeed%(delay/2 + 1);
+
+        TExitMsg(("=%d", delay));
+        return delay;
+    }   //GetBackoffDelay
+
+    /**
+     *  This function implements the reconnect thread. It connects whenever
+     *  the connection is down, backing off between failed attempts, and
+     *  replays the queued writes once connected.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    ReconnectThread(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+        DWORD numAttempts = 0;
+
+        TLevel(FUNC);
+        TEnter();
+
+        for (;;)
+        {
+            DWORD connState;
+            DWORD dwTimeout = INFINITE;
+            DWORD rcWait;
+
+            EnterCriticalSection(&m_connCritSect);
+            connState = m_connState;
+            LeaveCriticalSection(&m_connCritSect);
+
+            if (connState == CONNSTATE_DISCONNECTED)
+            {
+                SOCKET sock;
+                PSOCKREF ref = NULL;
+
+                hr = TryConnect(&sock);
+                if (SUCCEEDED(hr) && ((ref = new SOCKREF) == NULL))
+                {
+                    hr = E_OUTOFMEMORY;
+                    TErr(("Failed to allocate socket reference."));
+                    closesocket(sock);
+                }
+
+                if (SUCCEEDED(hr))
+                {
+                    ref->socket = sock;
+                    ref->refCount = 1;
+                    EnterCriticalSection(&m_connCritSect);
+                    m_sockRef = ref;
+                    m_connState = CONNSTATE_REPLAY;
+                    LeaveCriticalSection(&m_connCritSect);
+                    numAttempts = 0;
+                    ReplayQueued();
+                    continue;
+                }
+                else if (hr == HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED))
+                {
+                    hr = S_OK;
+                    break;
+                }
+                dwTimeout = GetBackoffDelay(numAttempts);
+                numAttempts++;
+                TInfo(("Connect attempt %d failed (hr=%x), retry in %d ms.",
+                       numAttempts, hr, dwTimeout));
+                //
+                // Only the stop event ends the backoff early.
+                //
+                rcWait = WaitForSingleObject(m_hStopEvent, dwTimeout);
+            }
+            else
+            {
+                HANDLE ahWait[2] = {m_hStopEvent, m_hReconnectEvent};
+
+                rcWait = WaitForMultipleObjects(ARRAYSIZE(ahWait),
+                                                ahWait,
+                                                FALSE,
+                                                dwTimeout);
+            }
+
+            if (rcWait == WAIT_OBJECT_0)
+            {
+                break;
+            }
+            else if (rcWait == WAIT_FAILED)
+            {
+                hr = GETLASTHRESULT();
+                TErr(("Failed to wait in reconnect thread (hr=%x).", hr));
+                break;
+            }
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //ReconnectThread
+
+    /**
+     *  This function stops the reconnect thread and frees its events. If
+     *  the thread does not die in time, it may still be resolving or
+     *  connecting, so its events are left open.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    StopReconnectThread(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(FUNC);
+        TEnter();
+
+        if (m_hReconnectThread != NULL)
+        {
+            DWORD rcWait;
+
+            SetEvent(m_hStopEvent);
+            rcWait = WaitForSingleObject(m_hReconnectThread,
+                                         CLIENT_STOP_TIMEOUT);
+            if (rcWait == WAIT_OBJECT_0)
+            {
+                CloseHandle(m_hReconnectThread);
+                m_hReconnectThread = NULL;
+            }
+            else
+            {
+                hr = (rcWait == WAIT_FAILED)?
+                        GETLASTHRESULT(): HRESULT_FROM_WIN32(WAIT_TIMEOUT);
+                TErr(("Failed waiting for the reconnect thread to die "
+                      "(hr=%x).", hr));
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            if (m_hConnectEvent != NULL)
+            {
+                WSACloseEvent(m_hConnectEvent);
+                m_hConnectEvent = NULL;
+            }
+
+            if (m_hReconnectEvent != NULL)
+            {
+                CloseHandle(m_hReconnectEvent);
+                m_hReconnectEvent = NULL;
+            }
+
+            if (m_hStopEvent != NULL)
+            {
+                CloseHandle(m_hStopEvent);
+                m_hStopEvent = NULL;
+            }
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //StopReconnectThread
+
+    /**
+     *  This function starts the reconnect thread, which makes the first
+     *  connection attempt right away.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    StartReconnectThread(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(FUNC);
+        TEnter();
+
+        m_jitterSeed = (GetTickCount() ^ GetCurrentProcessId()) | 1;
+        if (((m_hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL) ||
+            ((m_hReconnectEvent = CreateEvent(NULL, FALSE, FALSE, NULL)) ==
+             NULL))
+        {
+            hr = GETLASTHRESULT();
+            TErr(("Failed to create reconnect events (hr=%x).", hr));
+        }
+        else if ((m_hConnectEvent = WSACreateEvent()) == WSA_INVALID_EVENT)
+        {
+            hr = HRESULT_FROM_WIN32(WSAGetLastError());
+            TErr(("Failed to create connect event (hr=%x).", hr));
+        }
+        else if ((m_hReconnectThread = CreateThread(NULL,
+                                                    0,
+                                                    ReconnectThreadProc,
+                                                    this,
+                                                    0,
+                                                    NULL)) == NULL)
+        {
+            hr = GETLASTHRESULT();
+            TErr(("Failed to create reconnect thread (hr=%x).", hr));
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //StartReconnectThread
+
+    /**
+     *  This function sends the queued datagrams with a single segmented
+     *  send. The stack splits the buffer into datagrams of the first
+     *  message size, so it only applies if all messages but the last one
+     *  have the same size and the last one is not bigger.
+     *
+     *  @param sock Specifies the socket to send on.
+     *
+     *  @return Success: Returns S_OK, or S_FALSE if the batch can't be sent
+     *          this way.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    SendBatchSegmented(
+        __in SOCKET sock
+        )
+    {
+        HRESULT hr = S_OK;
+        DWORD segSize = m_batchMsgs[0].len;
+
+        TLevel(FUNC);
+        TEnterMsg(("n=%d,segSize=%d", m_numBatchMsgs, segSize));
+
+        if (m_fNoSegmentation || (m_numBatchMsgs < 2))
+        {
+            hr = S_FALSE;
+        }
+        else
+        {
+            for (DWORD i = 1; i < m_numBatchMsgs; i++)
+            {
+                if ((m_batchMsgs[i].len > segSize) ||
+                    ((m_batchMsgs[i].len < segSize) &&
+                     (i != m_numBatchMsgs - 1)))
+                {
+                    hr = S_FALSE;
+                    break;
+                }
+            }
+        }
+
+#ifdef UDP_SEND_MSG_SIZE
+        if (hr == S_OK)
+        {
+            WSABUF WSABuff[1];
+            WSAMSG msg;
+            BYTE control[WSA_CMSG_SPACE(sizeof(DWORD))];
+            PWSACMSGHDR cmsg = (PWSACMSGHDR)control;
+            DWORD dwcb;
+
+            //
+            // The queued messages are contiguous in the batch buffer.
+            //
+            WSABuff[0].len = m_batchLen;
+            WSABuff[0].buf = (LPSTR)m_batchBuff;
+            ZeroMemory(&msg, sizeof(msg));
+            ZeroMemory(control, sizeof(control));
+            cmsg->cmsg_len = WSA_CMSG_LEN(sizeof(DWORD));
+            cmsg->cmsg_level = IPPROTO_UDP;
+            cmsg->cmsg_type = UDP_SEND_MSG_SIZE;
+            *(PDWORD)WSA_CMSG_DATA(cmsg) = segSize;
+            msg.lpBuffers = WSABuff;
+            msg.dwBufferCount = 1;
+            msg.Control.len = sizeof(control);
+            msg.Control.buf = (LPSTR)control;
+            if (WSASendMsg(sock, &msg, 0, &dwcb, NULL, NULL) ==
+                SOCKET_ERROR)
+            {
+                DWORD dwErr = WSAGetLastError();
+
+                if ((dwErr == WSAEINVAL) || (dwErr == WSAEOPNOTSUPP))
+                {
+                    //
+                    // The stack doesn't do send segmentation, don't try
+                    // again.
+                    //
+                    TInfo(("UDP send segmentation is not supported."));
+                    m_fNoSegmentation = TRUE;
+                    hr = S_FALSE;
+                }
+                else
+                {
+                    hr = HRESULT_FROM_WIN32(dwErr);
+                    TWarn(("Failed to send datagram batch (hr=%x).", hr));
+                }
+            }
+        }
+#else
+        UNREFERENCED_PARAMETER(sock);
+        hr = S_FALSE;
+#endif
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //SendBatchSegmented
+
+    /**
+     *  This function sends the queued datagrams one at a time.
+     *
+     *  @param sock Specifies the socket to send on.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    SendBatchEach(
+        __in SOCKET sock
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(FUNC);
+        TEnterMsg(("n=%d", m_numBatchMsgs));
+
+        for (DWORD i = 0; i < m_numBatchMsgs; i++)
+        {
+            if (send(sock,
+                     m_batchMsgs[i].buf,
+                     (int)m_batchMsgs[i].len,
+                     0) == SOCKET_ERROR)
+            {
+                hr = HRESULT_FROM_WIN32(WSAGetLastError());
+                TWarn(("Failed to send datagram %d (hr=%x).", i, hr));
+                break;
+            }
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //SendBatchEach
+
+    /**
+     *  This function sends the queued messages on a stream socket with a
+     *  single gathering send.
+     *
+     *  @param sock Specifies the socket to send on.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    SendBatchGathered(
+        __in SOCKET sock
+        )
+    {
+        HRESULT hr = S_OK;
+        DWORD dwcb = 0;
+
+        TLevel(FUNC);
+        TEnterMsg(("n=%d,len=%d", m_numBatchMsgs, m_batchLen));
+
+        if (WSASend(sock,
+                    m_batchMsgs,
+                    m_numBatchMsgs,
+                    &dwcb,
+                    0,
+                    NULL,
+                    NULL) == SOCKET_ERROR)
+        {
+            hr = HRESULT_FROM_WIN32(WSAGetLastError());
+            TWarn(("Failed to send message batch (hr=%x).", hr));
+        }
+
+        TExitMsg(("=%x (len=%d)", hr, dwcb));
+        return hr;
+    }   //SendBatchGathered
+
+    /**
+     *  This function waits for an overlapped read or write issued with one
+     *  of the persistent contexts to complete. If the wait times out, the
+     *  I/O is cancelled and its completion is collected, so the context is
+     *  idle when this returns. Its event may still be signaled if the I/O
+     *  completed after the wait gave up, so the caller resets the event
+     *  before issuing the next I/O on the context. If the I/O itself
+     *  failed, the connection is dropped so that it gets reconnected.
+     *
+     *  @param ref Points to the socket reference the I/O was issued on.
+     *  @param overlapped Points to the persistent overlapped context.
+     *  @param lpdwcb Points to a variable to hold the number of bytes
+     *         transferred.
+     *  @param dwTimeout Specifies the timeout value in milli-seconds, can be
+     *         INFINITE.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    WaitOverlapped(
+        __in    PSOCKREF ref,
+        __inout LPWSAOVERLAPPED overlapped,
+        __out   LPDWORD lpdwcb,
+        __in    DWORD dwTimeout
+        )
+    {
+        HRESULT hr = S_OK;
+        DWORD dwErr;
+        DWORD dwFlags = 0;
+        BOOL fIoFailed = FALSE;
+
+        TLevel(FUNC);
+        TEnterMsg(("ref=%p,overlapped=%p,lpdwcb=%p,Timeout=%d",
+                   ref, overlapped, lpdwcb, dwTimeout));
+
+        //
+        // The events are auto-reset, so the wait also consumes the signal
+        // of an I/O that completed right away.
+        //
+        dwErr = WaitForSingleObject(overlapped->hEvent, dwTimeout);
+        if (dwErr == WAIT_OBJECT_0)
+        {
+            dwErr = ERROR_SUCCESS;
+            if (!WSAGetOverlappedResult(ref->socket,
+                                        overlapped,
+                                        lpdwcb,
+                                        FALSE,
+                                        &dwFlags))
+            {
+                dwErr = WSAGetLastError();
+                fIoFailed = TRUE;
+                if (dwErr == WSAECONNRESET)
+                {
+                    TInfo(("The connection is closed at the server side."));
+                }
+                else
+                {
+                    TErr(("Failed to get overlapped result (err=%d).",
+                          dwErr));
+                }
+            }
+        }
+        else
+        {
+            if (dwErr == WAIT_FAILED)
+            {
+                dwErr = GetLastError();
+            }
+            //
+            // The context is reused, so don't leave the I/O outstanding.
+            // The I/O may have completed after the wait gave up, in which
+            // case the data has been transferred and is not lost.
+            //
+            CancelIoEx((HANDLE)ref->socket, (LPOVERLAPPED)overlapped);
+            if (WSAGetOverlappedResult(ref->socket,
+                                       overlapped,
+                                       lpdwcb,
+                                       TRUE,
+                                       &dwFlags))
+            {
+                TInfo(("Overlapped I/O completed before it was cancelled."));
+                dwErr = ERROR_SUCCESS;
+            }
+            else
+            {
+                DWORD dwIoErr = WSAGetLastError();
+
+                if (dwIoErr != WSA_OPERATION_ABORTED)
+                {
+                    dwErr = dwIoErr;
+                    fIoFailed = TRUE;
+                }
+                TErr(("Failed to wait for overlapped I/O (err=%d).", dwErr));
+            }
+        }
+
+        if (dwErr != ERROR_SUCCESS)
+        {
+            hr = HRESULT_FROM_WIN32(dwErr);
+        }
+
+        if (fIoFailed)
+        {
+            Disconnect(ref);
+        }
+
+        TExitMsg(("=%x (len=%d)", hr, *lpdwcb));
+        return hr;
+    }   //WaitOverlapped
+
+    /**
+     *  This function issues an overlapped read on the given socket. If the
+     *  read fails right away, the connection is dropped.
+     *
+     *  @param ref Points to the socket reference to read from.
+     *  @param pbBuff Points to the buffer.
+     *  @param dwcbLen Specifies the buffer size in bytes.
+     *  @param lpdwcb Points to a variable to hold the number of characters
+     *         read.
+     *  @param overlapped Points to the overlapped structure.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    IssueRead(
+        __in                  PSOCKREF ref,
+        __out_bcount(dwcbLen) LPBYTE pbBuff,
+        __in                  DWORD dwcbLen,
+        __out                 LPDWORD lpdwcb,
+        __inout               LPWSAOVERLAPPED overlapped
+        )
+    {
+        HRESULT hr = S_OK;
+        DWORD dwErr;
+        WSABUF WSABuff[1];
+        DWORD dwFlags = 0;
+
+        TLevel(FUNC);
+        TEnterMsg(("ref=%p,buff=%p,len=%d,lpdwcb=%p,overlapped=%p",
+                   ref, pbBuff, dwcbLen, lpdwcb, overlapped));
+
+        WSABuff[0].len = dwcbLen;
+        WSABuff[0].buf = (LPSTR)pbBuff;
+        dwErr = WSARecv(ref->socket,
+                        WSABuff,
+                        1,
+                        lpdwcb,
+                        &dwFlags,
+                        overlapped,
+                        NULL);
+        if (dwErr == ERROR_SUCCESS)
+        {
+            SetEvent(overlapped->hEvent);
+        }
+        else
+        {
+            dwErr = WSAGetLastError();
+            if (dwErr == WSA_IO_PENDING)
+            {
+                //
+                // The read is successfully queued.
+                //
+                dwErr = ERROR_SUCCESS;
+            }
+            else
+            {
+                TWarn(("Failed to receive data from the socket (err=%d).",
+                       dwErr));
+                Disconnect(ref);
+            }
+        }
+
+        if (dwErr != ERROR_SUCCESS)
+        {
+            hr = HRESULT_FROM_WIN32(dwErr);
+        }
+
+        TExitMsg(("=%x (len=%d)", hr, *lpdwcb));
+        return hr;
+    }   //IssueRead
+
+    /**
+     *  This function issues an overlapped gathering write on the given
+     *  socket. If the write fails right away, the connection is dropped.
+     *
+     *  @param ref Points to the socket reference to write to.
+     *  @param buffs Points to the array of buffers.
+     *  @param numBuffs Specifies the number of buffers.
+     *  @param lpdwcb Points to a variable to hold the number of characters
+     *         written.
+     *  @param overlapped Points to the overlapped structure.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    IssueWrite(
+        __in                  PSOCKREF ref,
+        __in_ecount(numBuffs) LPWSABUF buffs,
+        __in                  DWORD numBuffs,
+        __out                 LPDWORD lpdwcb,
+        __inout               LPWSAOVERLAPPED overlapped
+        )
+    {
+        HRESULT hr = S_OK;
+        DWORD dwErr;
+
+        TLevel(FUNC);
+        TEnterMsg(("ref=%p,buffs=%p,n=%d,lpdwcb=%p,overlapped=%p",
+                   ref, buffs, numBuffs, lpdwcb, overlapped));
 
-            if (dwErr != NO_ERROR)
+        dwErr = WSASend(ref->socket,
+                        buffs,
+                        numBuffs,
+                        lpdwcb,
+                        0,
+                        overlapped,
+                        NULL);
+        if (dwErr == ERROR_SUCCESS)
+        {
+            SetEvent(overlapped->hEvent);
+        }
+        else
+        {
+            dwErr = WSAGetLastError();
+            if (dwErr == WSA_IO_PENDING)
             {
-                hr = HRESULT_FROM_WIN32(dwErr);
+                //
+                // The write is successfully queued.
+                //
+                dwErr = ERROR_SUCCESS;
+            }
+            else
+            {
+                TWarn(("Failed to send data to the socket (err=%d).",
+                       dwErr));
+                Disconnect(ref);
             }
         }
 
-        TExitMsg(("=%x", hr));
+        if (dwErr != ERROR_SUCCESS)
+        {
+            hr = HRESULT_FROM_WIN32(dwErr);
+        }
+
+        TExitMsg(("=%x (len=%d)", hr, *lpdwcb));
         return hr;
-    }   //InitConnection
+    }   //IssueWrite
 
 public:
     /**
@@ -166,23 +1178,46 @@ public:
          , m_family(AF_INET)
          , m_sockType(SOCK_STREAM)
          , m_protocol(IPPROTO_TCP)
-         , m_socket(INVALID_SOCKET)
+         , m_sockRef(NULL)
+         , m_numBatchMsgs(0)
+         , m_batchLen(0)
+         , m_fNoSegmentation(FALSE)
+         , m_hReconnectThread(NULL)
+         , m_hStopEvent(NULL)
+         , m_hReconnectEvent(NULL)
+         , m_hConnectEvent(NULL)
+         , m_connState(CONNSTATE_DISCONNECTED)
+         , m_jitterSeed(0)
+         , m_replayLen(0)
     {
         TLevel(INIT);
         TEnter();
 
+        __try
+        {
+            InitializeCriticalSection(&m_connCritSect);
+        }
+        __except(EXCEPTION_EXECUTE_HANDLER)
+        {
+            TErr(("Failed to initialize critical section (err=%d).",
+                  GetExceptionCode()));
+        }
+
         ZeroMemory(&m_wsaData, sizeof(m_wsaData));
         m_szHost[0] = L'\0';
         m_szPort[0] = L'\0';
         m_szAddrName[0] = L'\0';
         m_szPortName[0] = L'\0';
+        ZeroMemory(&m_readCtxt, sizeof(m_readCtxt));
+        ZeroMemory(&m_writeCtxt, sizeof(m_writeCtxt));
 
         TExit();
         return;
     }   //WsaClient
 
     /**
-     *  Desctructor of the class object.
+     *  Desctructor of the class object. The owner must call Uninitialize
+     *  first and must not delete the object if it fails.
      */
     ~WsaClient(
         VOID
@@ -191,25 +1226,76 @@ public:
         TLevel(INIT);
         TEnter();
 
-        if (m_socket != INVALID_SOCKET)
+        Uninitialize();
+        if (m_replayLen > 0)
+        {
+            TWarn(("Dropping %d bytes never sent to <%ws:%ws>.",
+                   m_replayLen, m_szHost, m_szPort));
+        }
+
+        if (m_sockRef != NULL)
         {
             TInfo(("Shutdown socket <%ws:%ws>", m_szHost, m_szPort));
-            shutdown(m_socket, SD_BOTH);
-            closesocket(m_socket);
-            m_socket = INVALID_SOCKET;
+            shutdown(m_sockRef->socket, SD_BOTH);
+            ReleaseSocket(m_sockRef);
+            m_sockRef = NULL;
+        }
+
+        if (m_readCtxt.hEvent != NULL)
+        {
+            CloseHandle(m_readCtxt.hEvent);
+            m_readCtxt.hEvent = NULL;
+        }
+
+        if (m_writeCtxt.hEvent != NULL)
+        {
+            CloseHandle(m_writeCtxt.hEvent);
+            m_writeCtxt.hEvent = NULL;
         }
 
         if (m_fInitialized)
         {
             WSACleanup();
         }
+        DeleteCriticalSection(&m_connCritSect);
 
         TExit();
         return;
     }   //~WsaClient
 
     /**
-     *  This function initializes the WsaClient object.
+     *  This function sends the datagrams still batched and stops the
+     *  reconnect thread. If the thread does not die in time, it is still
+     *  using the object, so the caller must leave the object to it instead
+     *  of deleting it.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    Uninitialize(
+        VOID
+        )
+    {
+        HRESULT hr;
+
+        TLevel(API);
+        TEnter();
+
+        if ((m_connState == CONNSTATE_CONNECTED) && (m_numBatchMsgs > 0))
+        {
+            FlushDatagrams();
+        }
+        hr = StopReconnectThread();
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //Uninitialize
+
+    /**
+     *  This function initializes the WsaClient object. The connection is
+     *  made by a background thread, which also reconnects whenever it
+     *  breaks; data written meanwhile is queued and sent once connected.
      *
      *  @param pszHost Specifies the host name.
      *  @param pszPort Specifies the port number or service name.
@@ -250,6 +1336,14 @@ public:
         {
             TErr(("Failed to copy port string <%ws> (hr=%x).", pszPort, hr));
         }
+        else if (((m_readCtxt.hEvent = CreateEvent(NULL, FALSE, FALSE, NULL))
+                  == NULL) ||
+                 ((m_writeCtxt.hEvent = CreateEvent(NULL, FALSE, FALSE, NULL))
+                  == NULL))
+        {
+            hr = GETLASTHRESULT();
+            TErr(("Failed to create overlapped I/O events (hr=%x).", hr));
+        }
         else if ((hr = HRESULT_FROM_WIN32(WSAStartup(MAKEWORD(2, 2),
                                                      &m_wsaData))) != S_OK)
         {
@@ -268,8 +1362,11 @@ public:
             TInfo(("MaxSockets=%d, MaxUdpDg=%d",
                    m_wsaData.iMaxSockets, m_wsaData.iMaxUdpDg));
             TInfo(("VendorInfo=%p", m_wsaData.lpVendorInfo));
-
-            hr = InitConnection();
+            //
+            // Connect in the background, writes are queued until the
+            // connection is up.
+            //
+            hr = StartReconnectThread();
         }
 
         TExitMsg(("=%x", hr));
@@ -297,64 +1394,78 @@ public:
         )
     {
         HRESULT hr = S_OK;
+        PSOCKREF ref;
 
         TLevel(API);
         TEnterMsg(("buff=%p,len=%d,lpdwcb=%p,overlapped=%p",
                    pbBuff, dwcbLen, lpdwcb, overlapped));
 
         *lpdwcb = 0;
-        if (m_socket == INVALID_SOCKET)
+        if ((ref = AcquireSocket(CONNSTATE_CONNECTED)) == NULL)
         {
-            hr = InitConnection();
+            //
+            // The reconnect thread is on it, don't block the caller.
+            //
+            hr = HRESULT_FROM_WIN32(WSAENOTCONN);
         }
-
-        if (SUCCEEDED(hr))
+        else
         {
-            DWORD dwErr;
-            WSABUF WSABuff[1];
-            DWORD dwFlags = 0;
+            hr = IssueRead(ref, pbBuff, dwcbLen, lpdwcb, overlapped);
+            ReleaseSocket(ref);
+        }
 
-            WSABuff[0].len = dwcbLen;
-            WSABuff[0].buf = (LPSTR)pbBuff;
-            dwErr = WSARecv(m_socket,
-                            WSABuff,
-                            1,
-                            lpdwcb,
-                            &dwFlags,
-                            overlapped,
-                            NULL);
-            if (dwErr == ERROR_SUCCESS)
-            {
-                SetEvent(overlapped->hEvent);
-            }
-            else
-            {
-                dwErr = WSAGetLastError();
-                if (dwErr == WSA_IO_PENDING)
-                {
-                    //
-                    // The read is successfully queued.
-                    //
-                    dwErr = ERROR_SUCCESS;
-                }
-                else
-                {
-                    TWarn(("Failed to receive data from the socket (err=%d).",
-                           dwErr));
-                    closesocket(m_socket);
-                    m_socket = INVALID_SOCKET;
-                }
-            }
+        TExitMsg(("=%x (len=%d)", hr, *lpdwcb));
+        return hr;
+    }   //AsyncRead
 
-            if (dwErr != ERROR_SUCCESS)
-            {
-                hr = HRESULT_FROM_WIN32(dwErr);
-            }
+    /**
+     *  This function does an asynchronous gathering write to the socket.
+     *  The buffers go out as one message, so a header and its payload can
+     *  be sent without copying them together first.
+     *
+     *  @param buffs Points to the array of buffers. The array only needs to
+     *         stay valid until the function returns, the buffers until the
+     *         write completes.
+     *  @param numBuffs Specifies the number of buffers.
+     *  @param lpdwcb Points to a variable to hold the number of characters
+     *         written.
+     *  @param overlapped Points to the overlapped structure.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    AsyncWriteV(
+        __in_ecount(numBuffs) LPWSABUF buffs,
+        __in                  DWORD numBuffs,
+        __out                 LPDWORD lpdwcb,
+        __inout               LPWSAOVERLAPPED overlapped
+        )
+    {
+        HRESULT hr = S_OK;
+        PSOCKREF ref;
+
+        TLevel(API);
+        TEnterMsg(("buffs=%p,n=%d,lpdwcb=%p,overlapped=%p",
+                   buffs, numBuffs, lpdwcb, overlapped));
+
+        *lpdwcb = 0;
+        if ((ref = AcquireSocket(CONNSTATE_CONNECTED)) == NULL)
+        {
+            //
+            // The reconnect thread is on it, don't block the caller.
+            //
+            hr = HRESULT_FROM_WIN32(WSAENOTCONN);
+        }
+        else
+        {
+            hr = IssueWrite(ref, buffs, numBuffs, lpdwcb, overlapped);
+            ReleaseSocket(ref);
         }
 
         TExitMsg(("=%x (len=%d)", hr, *lpdwcb));
         return hr;
-    }   //AsyncRead
+    }   //AsyncWriteV
 
     /**
      *  This function does an asynchronous write to the socket.
@@ -376,67 +1487,25 @@ public:
         __inout              LPWSAOVERLAPPED overlapped
         )
     {
-        HRESULT hr = S_OK;
+        HRESULT hr;
+        WSABUF WSABuff[1];
 
         TLevel(API);
         TEnterMsg(("buff=%p,len=%d,lpdwcb=%p,overlapped=%p",
                    pbBuff, dwcbLen, lpdwcb, overlapped));
 
-        *lpdwcb = 0;
-        if (m_socket == INVALID_SOCKET)
-        {
-            hr = InitConnection();
-        }
-
-        if (SUCCEEDED(hr))
-        {
-            WSABUF WSABuff[1];
-            DWORD dwErr;
-
-            WSABuff[0].len = dwcbLen;
-            WSABuff[0].buf = (LPSTR)pbBuff;
-            dwErr = WSASend(m_socket,
-                            WSABuff,
-                            1,
-                            lpdwcb,
-                            0,
-                            overlapped,
-                            NULL);
-            if (dwErr == ERROR_SUCCESS)
-            {
-                SetEvent(overlapped->hEvent);
-            }
-            else
-            {
-                dwErr = WSAGetLastError();
-                if (dwErr == WSA_IO_PENDING)
-                {
-                    //
-                    // The write is successfully queued.
-                    //
-                    dwErr = ERROR_SUCCESS;
-                }
-                else
-                {
-                    TWarn(("Failed to send data to the socket (err=%d).",
-                           dwErr));
-                    closesocket(m_socket);
-                    m_socket = INVALID_SOCKET;
-                }
-            }
-
-            if (dwErr != ERROR_SUCCESS)
-            {
-                hr = HRESULT_FROM_WIN32(dwErr);
-            }
-        }
+        WSABuff[0].len = dwcbLen;
+        WSABuff[0].buf = (LPSTR)pbBuff;
+        hr = AsyncWriteV(WSABuff, 1, lpdwcb, overlapped);
 
         TExitMsg(("=%x (len=%d)", hr, *lpdwcb));
         return hr;
     }   //AsyncWrite
 
     /**
-     *  This function does an synchronous read from the socket.
+     *  This function does an synchronous read from the socket. It reuses the
+     *  read context of the client, so only one thread may call it at a
+     *  time.
      *
      *  @param pbBuff Points to the buffer.
      *  @param dwcbLen Specifies the buffer size in bytes.
@@ -457,73 +1526,141 @@ public:
         )
     {
         HRESULT hr = S_OK;
-        OVERLAPPED overlapped;
+        HANDLE hEvent = m_readCtxt.hEvent;
+        PSOCKREF ref;
 
         TLevel(API);
         TEnterMsg(("Socket=<%ws:%ws>,pbBuff=%p,dwcbLen=%d,lpdwcb=%p,Timeout=%d",
                    m_szHost, m_szPort, pbBuff, dwcbLen, lpdwcb, dwTimeout));
 
-        ZeroMemory(&overlapped, sizeof(overlapped));
-        overlapped.hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
-        if (overlapped.hEvent == NULL)
+        *lpdwcb = 0;
+        if (hEvent == NULL)
         {
-            hr = GETLASTHRESULT();
-            TErr(("Failed to create overlapped read event (hr=%x).", hr));
+            TErr(("WsaClient is not initialized."));
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_STATE);
+        }
+        else if ((ref = AcquireSocket(CONNSTATE_CONNECTED)) == NULL)
+        {
+            //
+            // The reconnect thread is on it, don't block the caller.
+            //
+            hr = HRESULT_FROM_WIN32(WSAENOTCONN);
         }
         else
         {
-            hr = AsyncRead(pbBuff, dwcbLen, lpdwcb, &overlapped);
+            //
+            // Hold the socket until the read is collected, so a concurrent
+            // disconnect can't close it under the wait.
+            //
+            ZeroMemory(&m_readCtxt, sizeof(m_readCtxt));
+            m_readCtxt.hEvent = hEvent;
+            //
+            // Drop a stale signal left by a read that completed after an
+            // earlier wait timed out.
+            //
+            ResetEvent(hEvent);
+            hr = IssueRead(ref, pbBuff, dwcbLen, lpdwcb, &m_readCtxt);
             if (SUCCEEDED(hr))
             {
-                DWORD dwErr = WaitForSingleObject(overlapped.hEvent,
-                                                  dwTimeout);
+                hr = WaitOverlapped(ref, &m_readCtxt, lpdwcb, dwTimeout);
+            }
+            ReleaseSocket(ref);
+        }
 
-                if (dwErr == WAIT_OBJECT_0)
-                {
-                    DWORD dwFlags = 0;
+        TExitMsg(("=%x (len=%d)", hr, *lpdwcb));
+        return hr;
+    }   //SyncRead
 
-                    dwErr = ERROR_SUCCESS;
-                    if (!WSAGetOverlappedResult(m_socket,
-                                                &overlapped,
-                                                lpdwcb,
-                                                FALSE,
-                                                &dwFlags))
-                    {
-                        dwErr = WSAGetLastError();
-                        if (dwErr == WSAECONNRESET)
-                        {
-                            TInfo(("The connection is closed at the server side."));
-                        }
-                        else
-                        {
-                            TErr(("Failed to get overlapped read result."));
-                        }
-                    }
-                }
-                else
+    /**
+     *  This function does an synchronous gathering write to the socket. The
+     *  buffers go out as one message. It reuses the write context of the
+     *  client, so only one thread may call it at a time. While the client
+     *  is not connected, the data is queued and sent once it reconnects.
+     *
+     *  @param buffs Points to the array of buffers.
+     *  @param numBuffs Specifies the number of buffers.
+     *  @param lpdwcb Points to a variable to hold the number of characters
+     *         written.
+     *  @param dwTimeout Specifies the timeout value in milli-seconds, can be
+     *         INFINITE.
+     *
+     *  @return Success: Returns S_OK if the data is sent, S_FALSE if it is
+     *          queued for the reconnect.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    SyncWriteV(
+        __in_ecount(numBuffs) LPWSABUF buffs,
+        __in                  DWORD    numBuffs,
+        __out                 LPDWORD  lpdwcb,
+        __in                  DWORD    dwTimeout
+        )
+    {
+        HRESULT hr = S_OK;
+        HANDLE hEvent = m_writeCtxt.hEvent;
+
+        TLevel(API);
+        TEnterMsg(("Socket=<%ws:%ws>,buffs=%p,n=%d,lpdwcb=%p,Timeout=%d",
+                   m_szHost, m_szPort, buffs, numBuffs, lpdwcb, dwTimeout));
+
+        *lpdwcb = 0;
+        if (hEvent == NULL)
+        {
+            TErr(("WsaClient is not initialized."));
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_STATE);
+        }
+        else
+        {
+            PSOCKREF ref;
+
+            EnterCriticalSection(&m_connCritSect);
+            if ((ref = AcquireSocket(CONNSTATE_CONNECTED)) == NULL)
+            {
+                //
+                // Hold the data until the connection is back, so the caller
+                // doesn't wait for the reconnect.
+                //
+                if (SUCCEEDED(hr = QueueReplay(buffs, numBuffs)))
                 {
-                    if (dwErr == WAIT_FAILED)
+                    for (DWORD i = 0; i < numBuffs; i++)
                     {
-                        dwErr = GetLastError();
+                        *lpdwcb += buffs[i].len;
                     }
-                    TErr(("Failed to wait for overlapped read (err=%d).",
-                          dwErr));
+                    hr = S_FALSE;
                 }
+            }
+            LeaveCriticalSection(&m_connCritSect);
 
-                if (dwErr != ERROR_SUCCESS)
+            if (ref != NULL)
+            {
+                //
+                // Hold the socket until the write is collected, so a
+                // concurrent disconnect can't close it under the wait.
+                //
+                ZeroMemory(&m_writeCtxt, sizeof(m_writeCtxt));
+                m_writeCtxt.hEvent = hEvent;
+                //
+                // Drop a stale signal left by a write that completed after
+                // an earlier wait timed out.
+                //
+                ResetEvent(hEvent);
+                hr = IssueWrite(ref, buffs, numBuffs, lpdwcb, &m_writeCtxt);
+                if (SUCCEEDED(hr))
                 {
-                    hr = HRESULT_FROM_WIN32(dwErr);
+                    hr = WaitOverlapped(ref, &m_writeCtxt, lpdwcb, dwTimeout);
                 }
+                ReleaseSocket(ref);
             }
-            CloseHandle(overlapped.hEvent);
         }
 
         TExitMsg(("=%x (len=%d)", hr, *lpdwcb));
         return hr;
-    }   //SyncRead
+    }   //SyncWriteV
 
     /**
-     *  This function does an synchronous write to the socket.
+     *  This function does an synchronous write to the socket. It reuses the
+     *  write context of the client, so only one thread may call it at a
+     *  time.
      *
      *  @param pbBuff Points to the buffer.
      *  @param dwcbLen Specifies the buffer size in bytes.
@@ -532,7 +1669,8 @@ public:
      *  @param dwTimeout Specifies the timeout value in milli-seconds, can be
      *         INFINITE.
      *
-     *  @return Success: Returns S_OK.
+     *  @return Success: Returns S_OK if the data is sent, S_FALSE if it is
+     *          queued for the reconnect.
      *  @return Failure: Returns HRESULT code.
      */
     HRESULT
@@ -543,71 +1681,160 @@ public:
         __in                 DWORD   dwTimeout
         )
     {
-        HRESULT hr = S_OK;
-        OVERLAPPED overlapped;
+        HRESULT hr;
+        WSABUF WSABuff[1];
 
         TLevel(API);
         TEnterMsg(("Socket=<%ws:%ws>,pbBuff=%p,dwcbLen=%d,lpdwcb=%p,Timeout=%d",
                    m_szHost, m_szPort, pbBuff, dwcbLen, lpdwcb, dwTimeout));
 
-        ZeroMemory(&overlapped, sizeof(overlapped));
-        overlapped.hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
-        if (overlapped.hEvent == NULL)
+        WSABuff[0].len = dwcbLen;
+        WSABuff[0].buf = (LPSTR)pbBuff;
+        hr = SyncWriteV(WSABuff, 1, lpdwcb, dwTimeout);
+
+        TExitMsg(("=%x (len=%d)", hr, *lpdwcb));
+        return hr;
+    }   //SyncWrite
+
+    /**
+     *  This function queues a datagram to be sent by FlushDatagrams. The
+     *  data is copied, so the caller may reuse the buffer right away. If
+     *  the batch is full, it is flushed first.
+     *
+     *  @param pbBuff Points to the buffer.
+     *  @param dwcbLen Specifies the buffer size in bytes.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    QueueDatagram(
+        __in_bcount(dwcbLen) LPBYTE pbBuff,
+        __in                 DWORD dwcbLen
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(API);
+        TEnterMsg(("buff=%p,len=%d", pbBuff, dwcbLen));
+
+        if ((dwcbLen == 0) || (dwcbLen > BATCH_BUFF_SIZE))
         {
-            hr = GETLASTHRESULT();
-            TErr(("Failed to create overlapped write event (hr=%x).", hr));
+            TWarn(("Invalid datagram length %d.", dwcbLen));
+            hr = E_INVALIDARG;
         }
         else
         {
-            hr = AsyncWrite(pbBuff, dwcbLen, lpdwcb, &overlapped);
+            if ((m_numBatchMsgs == MAX_BATCH_MSGS) ||
+                (m_batchLen + dwcbLen > BATCH_BUFF_SIZE))
+            {
+                hr = FlushDatagrams();
+            }
+
             if (SUCCEEDED(hr))
             {
-                DWORD dwErr = WaitForSingleObject(overlapped.hEvent,
-                                                  dwTimeout);
+                CopyMemory(m_batchBuff + m_batchLen, pbBuff, dwcbLen);
+                m_batchMsgs[m_numBatchMsgs].buf =
+                    (LPSTR)(m_batchBuff + m_batchLen);
+                m_batchMsgs[m_numBatchMsgs].len = dwcbLen;
+                m_batchLen += dwcbLen;
+                m_numBatchMsgs++;
+            }
+        }
+
+        TExitMsg(("=%x (n=%d)", hr, m_numBatchMsgs));
+        return hr;
+    }   //QueueDatagram
+
+    /**
+     *  This function sends all queued datagrams. On a datagram socket,
+     *  equally sized datagrams go out with one segmented send where the
+     *  stack supports it, otherwise they are sent one at a time. On a
+     *  stream socket, the messages go out with one gathering send. The
+     *  batch is emptied even if the send fails.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    FlushDatagrams(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(API);
+        TEnterMsg(("n=%d,len=%d", m_numBatchMsgs, m_batchLen));
+
+        if (m_numBatchMsgs > 0)
+        {
+            PSOCKREF ref;
 
-                if (dwErr == WAIT_OBJECT_0)
+            EnterCriticalSection(&m_connCritSect);
+            if ((ref = AcquireSocket(CONNSTATE_CONNECTED)) == NULL)
+            {
+                for (DWORD i = 0; SUCCEEDED(hr) && (i < m_numBatchMsgs); i++)
                 {
-                    DWORD dwFlags = 0;
+                    hr = QueueReplay(&m_batchMsgs[i], 1);
+                }
+            }
+            LeaveCriticalSection(&m_connCritSect);
 
-                    dwErr = ERROR_SUCCESS;
-                    if (!WSAGetOverlappedResult(m_socket,
-                                                &overlapped,
-                                                lpdwcb,
-                                                FALSE,
-                                                &dwFlags))
-                    {
-                        dwErr = WSAGetLastError();
-                        if (dwErr == WSAECONNRESET)
-                        {
-                            TInfo(("The connection is closed at the server side."));
-                        }
-                        else
-                        {
-                            TErr(("Failed to get overlapped read result."));
-                        }
-                    }
+            if (ref == NULL)
+            {
+                TInfo(("Not connected, batch queued for replay (hr=%x).", hr));
+            }
+            else
+            {
+                if (m_sockType != SOCK_DGRAM)
+                {
+                    hr = SendBatchGathered(ref->socket);
                 }
-                else
+                else if ((hr = SendBatchSegmented(ref->socket)) == S_FALSE)
                 {
-                    if (dwErr == WAIT_FAILED)
-                    {
-                        dwErr = GetLastError();
-                    }
-                    TErr(("Failed to wait for overlapped write (err=%d).",
-                          dwErr));
+                    hr = SendBatchEach(ref->socket);
                 }
 
-                if (dwErr != ERROR_SUCCESS)
+                if (FAILED(hr))
                 {
-                    hr = HRESULT_FROM_WIN32(dwErr);
+                    Disconnect(ref);
                 }
+                ReleaseSocket(ref);
             }
-            CloseHandle(overlapped.hEvent);
+            m_numBatchMsgs = 0;
+            m_batchLen = 0;
         }
 
-        TExitMsg(("=%x (len=%d)", hr, *lpdwcb));
+        TExitMsg(("=%x", hr));
         return hr;
-    }   //SyncWrite
+    }   //FlushDatagrams
 
 };  //class WsaClient
 
+#ifdef _MAIN_FILE
+/**
+ *  This function implements the reconnect thread.
+ *
+ *  @param lpParam Points to thread data passed to the function.
+ *
+ *  @return Success: Returns ERROR_SUCCESS.
+ *  @return Failure: Returns Win32 error code.
+ */
+DWORD WINAPI
+ReconnectThreadProc(
+    __in LPVOID lpParam
+    )
+{
+    DWORD rc;
+    WsaClient *client = (WsaClient *)lpParam;
+
+    TLevel(CALLBK);
+    TEnterMsg(("param=%p", lpParam));
+
+    rc = (DWORD)client->ReconnectThread();
+
+    TExitMsg(("=%x", rc));
+    return rc;
+}   //ReconnectThreadProc
+
+#endif
@@ -30,6 +30,16 @@
 class WsaCallback
 {
 public:
+    typedef struct _WsaPacket
+    {
+        HANDLE      connHandle;
+        HANDLE      hLease;
+        LPBYTE      recvBuff;
+        DWORD       recvLen;
+        PSOCKADDR   fromAddr;
+        int         fromLen;
+    } WSAPACKET, *PWSAPACKET;
+
     virtual
     VOID
     DataReceived(
@@ -39,29 +49,209 @@ public:
         __in                 DWORD  recvLen
         ) = 0;
 
+    /**
+     *  This function is called with a received buffer that is leased to the
+     *  callback. Normally the buffer is only valid until the function
+     *  returns. If the callback takes a reference with
+     *  WsaServer::AddRefLease, it keeps the buffer without copying it and
+     *  the server posts a fresh buffer for the next receive instead. The
+     *  reference must be dropped with WsaServer::ReleaseLease, from any
+     *  thread, before the server is destroyed. The buffer has room for one
+     *  more byte past recvLen so it can be NUL terminated in place. The
+     *  default implementation calls DataReceived.
+     *
+     *  @param connHandle Specifies the handle of the connection receiving
+     *         the data.
+     *  @param context Specifies the callback context.
+     *  @param hLease Specifies the lease handle of the buffer.
+     *  @param recvBuff Points to the buffer containing the received data.
+     *  @param recvLen Specifies the length of the received data.
+     */
+    virtual
+    VOID
+    DataLeased(
+        __in                        HANDLE connHandle,
+        __in_opt                    LPVOID context,
+        __in                        HANDLE hLease,
+        __inout_bcount(recvLen + 1) LPBYTE recvBuff,
+        __in                        DWORD  recvLen
+        )
+    {
+        UNREFERENCED_PARAMETER(hLease);
+        DataReceived(connHandle, context, recvBuff, recvLen);
+    }   //DataLeased
+
+    /**
+     *  This function is called with a batch of received packets. For a
+     *  datagram server, each packet carries the address of its sender. The
+     *  addresses are only valid until the function returns, the buffers
+     *  too unless a lease is taken on them. The default implementation
+     *  hands the packets to DataLeased one at a time.
+     *
+     *  @param context Specifies the callback context.
+     *  @param packets Points to the array of received packets.
+     *  @param numPackets Specifies the number of packets in the array.
+     */
+    virtual
+    VOID
+    DataBatchReceived(
+        __in_opt                  LPVOID     context,
+        __in_ecount(numPackets)   PWSAPACKET packets,
+        __in                      DWORD      numPackets
+        )
+    {
+        for (DWORD i = 0; i < numPackets; i++)
+        {
+            DataLeased(packets[i].connHandle,
+                       context,
+                       packets[i].hLease,
+                       packets[i].recvBuff,
+                       packets[i].recvLen);
+        }
+    }   //DataBatchReceived
+
 };  //class WsaCallback
 
 class WsaServer
 {
+public:
+    //
+    // Public constants.
+    //
+    #define LISTENF_ASYNC               0x00000001
+    #define LISTENF_IOCP                0x00000002
+    #define LISTENF_DISPATCH            0x00000004
+
+    //
+    // Optional listener parameters.
+    // numShards: number of connection threads the connections are spread
+    //     across (0 means 1). With more than one shard, the data callback
+    //     is called from several threads at once.
+    // recvDepth: number of receives kept outstanding on each connection
+    //     (0 means 1). Data is still delivered in order. This is also the
+    //     most packets handed to DataBatchReceived per wakeup of the event
+    //     backend, so a datagram server gets up to recvDepth datagrams with
+    //     their senders per call.
+    // dispatchDepth: number of packets the dispatch queue holds with
+    //     LISTENF_DISPATCH (0 means DEF_DISPATCH_DEPTH). It is rounded up to
+    //     a power of two.
+    //
+    typedef struct _ListenParams
+    {
+        DWORD       numShards;
+        DWORD       recvDepth;
+        DWORD       dispatchDepth;
+    } LISTEN_PARAMS, *PLISTEN_PARAMS;
+
 private:
     #define LISTENF_MASK                0x0000ffff
     #define LISTENF_TERMINATING         0x80000000
+    #define LISTENF_DISPATCHSTOP        0x40000000
     #define SIG_SERVERCONNECTION        'CvrS'
     #define TERMINATE_TIMEOUT           1000
+    #define CONNF_SKIPONSUCCESS         0x00000001
+    #define CONNF_WORK                  0x00000002
+    #define RECV_IDLE                   0
+    #define RECV_POSTED                 1
+    #define RECV_DONE                   2
+    #define MAX_RECV_DEPTH              64
+    #define IOCP_BATCH_SIZE             64
+    #define MAX_SHARDS                  64
+    #define MAX_SHARD_CONNS             (MAXIMUM_WAIT_OBJECTS - 1)
+    #define POOL_SLAB_CONNS             16
+    #define DEF_DISPATCH_DEPTH          1024
+    #define DISPATCH_BATCH_SIZE         64
+    #define DISPATCH_SPACE_TIMEOUT      100
+
+    struct _conn;
+    struct _shard;
+
+    //
+    // Every receive buffer is preceded by a lease header in its pool block.
+    // The server holds one reference while the buffer is in its receive
+    // ring, callbacks may take more.
+    //
+    typedef struct _lease
+    {
+        LONG volatile refCount;
+        BuffPool   *pool;
+    } LEASE, *PLEASE;
+
+    #define BUFF_TO_LEASE(p)            ((PLEASE)((LPBYTE)(p) - sizeof(LEASE)))
+
+    //
+    // A packet waiting in the dispatch queue. The queue holds a lease on
+    // the buffer and its own copy of the sender address.
+    //
+    typedef struct _dispatchItem
+    {
+        WsaCallback::WSAPACKET packet;
+        SOCKADDR_STORAGE fromAddr;
+    } DISPATCHITEM, *PDISPATCHITEM;
+
+    //
+    // Block caches of the connection and receive buffer pools. Each one is
+    // only used by the thread that owns it.
+    //
+    typedef struct _poolCache
+    {
+        BuffPool::BUFFCACHE connCache;
+        BuffPool::BUFFCACHE buffCache;
+    } POOLCACHE, *PPOOLCACHE;
+
+    typedef struct _recvCtxt
+    {
+        OVERLAPPED  overlapped;
+        struct _conn *conn;
+        LPBYTE      dataBuffer;
+        DWORD       dwcb;
+        DWORD       state;
+        SOCKADDR_STORAGE fromAddr;
+        int         fromLen;
+    } RECVCTXT, *PRECVCTXT;
 
     typedef struct _conn
     {
-        LIST_ENTRY  list;
+        LIST_ENTRY  pending;
+        DWORD       regIdx;
+        DWORD       waitIdx;
         DWORD       dwSig;
+        DWORD       dwFlags;
+        struct _shard *shard;
         SOCKET      socket;
-        LPBYTE      dataBuffer;
-        DWORD       dataIndex;
-        OVERLAPPED  overlapped;
+        PRECVCTXT   recvCtxts;
+        DWORD       recvHead;
+        DWORD       postIdx;
+        DWORD       numPosted;
+        HRESULT     hrClosed;
+        HANDLE      hRecvEvent;
         HANDLE      hClosedEvent;
-        SOCKADDR    fromAddr;
+        SOCKADDR_STORAGE fromAddr;
         int         fromLen;
     } CONN, *PCONN;
 
+    //
+    // Connections queued for a shard's connection thread. They are only
+    // held for a moment, so a spin lock guards the list.
+    //
+    typedef TList<CONN, &CONN::pending, TListSpinLock> CONNLIST;
+
+    typedef struct _shard
+    {
+        WsaServer  *server;
+        DWORD       index;
+        HANDLE      hConnectionThread;
+        HANDLE      hChangedEvent;
+        HANDLE      hCompletionPort;
+        LfRegistry  connections;
+        CONNLIST    pendingList;
+        POOLCACHE   poolCache;
+        DWORD       numWaits;
+        HANDLE      ahWaits[MAXIMUM_WAIT_OBJECTS];
+        struct _conn *aConns[MAXIMUM_WAIT_OBJECTS];
+    } SHARD, *PSHARD;
+
+
     //
     // Private data.
     //
@@ -76,12 +266,22 @@ private:
     WsaCallback *m_dataCallback;
     LPVOID      m_callbackContext;
     DWORD       m_dataBufferSize;
+    DWORD       m_recvDepth;
     DWORD       m_dwFlags;
 
     HANDLE      m_hListenerThread;
-    HANDLE      m_hConnectionThread;
-    HANDLE      m_hChangedEvent;
-    DList       m_connectionList;
+    PSHARD      m_shards;
+    DWORD       m_numShards;
+
+    BuffPool    m_connPool;
+    BuffPool    m_buffPool;
+    POOLCACHE   m_listenerCache;
+
+    HANDLE      m_hDispatchThread;
+    HANDLE      m_hDispatchEvent;
+    HANDLE      m_hSpaceEvent;
+    DWORD       m_dispatchDepth;
+    LfQueue<DISPATCHITEM> m_dispatchQueue;
 
     friend
     DWORD WINAPI
@@ -95,6 +295,18 @@ private:
 		__in LPVOID lpParam
 		);
 
+    friend
+    DWORD WINAPI
+    CompletionThreadProc(
+        __in LPVOID lpParam
+        );
+
+    friend
+    DWORD WINAPI
+    DispatchThreadProc(
+        __in LPVOID lpParam
+        );
+
     /**
      *  This function initializes a Winsock client connection.
      *
@@ -257,511 +469,1722 @@ private:
     }   //ListenerThread
 
     /**
-     *  This function starts a connection. This includes creating a connection
-     *  thread to monitor data from the message socket.
+     *  This function starts the connection thread of a shard. Depending on
+     *  the listener flags, the thread either waits on the overlapped events
+     *  of the shard connections or dequeues completion packets from the
+     *  shard I/O completion port.
      *
-     *  @param socket Specifies the socket for the connection to receive
-     *         message from.
+     *  @param shard Points to the SHARD structure.
      *
      *  @return Success: Returns S_OK.
      *  @return Failure: Returns HRESULT code.
      */
     HRESULT
-    StartConnection(
-        __in SOCKET socket
+    StartConnectionThread(
+        __in PSHARD shard
         )
     {
         HRESULT hr = S_OK;
 
         TLevel(FUNC);
-        TEnterMsg(("socket=%x", socket));
+        TEnterMsg(("shard=%d", shard->index));
 
-        if (m_hConnectionThread == NULL)
+        if (m_dwFlags & LISTENF_IOCP)
         {
-            //
-            // If we haven't started the connection thread yet, start it now.
-            //
-            TInfo(("Creating Changed event..."));
-            TAssert(m_hChangedEvent == NULL);
-            m_hChangedEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
-            if (m_hChangedEvent == NULL)
+            TInfo(("Creating completion port..."));
+            TAssert(shard->hCompletionPort == NULL);
+            shard->hCompletionPort = CreateIoCompletionPort(
+                                        INVALID_HANDLE_VALUE,
+                                        NULL,
+                                        0,
+                                        1);
+            if (shard->hCompletionPort == NULL)
             {
                 hr = GETLASTHRESULT();
-                TErr(("Failed to create changed event (hr=%x).", hr));
+                TErr(("Failed to create completion port (hr=%x).", hr));
             }
-            else
+        }
+        else
+        {
+            TInfo(("Creating Changed event..."));
+            TAssert(shard->hChangedEvent == NULL);
+            shard->hChangedEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+            if (shard->hChangedEvent == NULL)
             {
-                TInfo(("Creating Connection thread..."));
-                m_hConnectionThread = CreateThread(NULL,
-                                                   0,
-                                                   ConnectionThreadProc,
-                                                   this,
-                                                   0,
-                                                   NULL);
-                if (m_hConnectionThread == NULL)
-                {
-                    CloseHandle(m_hChangedEvent);
-                    m_hChangedEvent = NULL;
-                    hr = GETLASTHRESULT();
-                    TErr(("Failed to create connection thread (hr=%x).", hr));
-                }
+                hr = GETLASTHRESULT();
+                TErr(("Failed to create changed event (hr=%x).", hr));
             }
         }
 
         if (SUCCEEDED(hr))
         {
-            PCONN conn = new CONN;
-
-            if (conn == NULL)
-            {
-                hr = E_OUTOFMEMORY;
-                TErr(("Failed to allocate connection structure (len=%d).",
-                      sizeof(CONN)));
-            }
-            else
+            TInfo(("Creating Connection thread..."));
+            shard->hConnectionThread = CreateThread(
+                                        NULL,
+                                        0,
+                                        (m_dwFlags & LISTENF_IOCP)?
+                                            CompletionThreadProc:
+                                            ConnectionThreadProc,
+                                        shard,
+                                        0,
+                                        NULL);
+            if (shard->hConnectionThread == NULL)
             {
-                ZeroMemory(conn, sizeof(*conn));
-                conn->dwSig = SIG_SERVERCONNECTION;
-                conn->socket = socket;
-
-                if ((conn->dataBuffer = new BYTE[m_dataBufferSize]) == NULL)
-                {
-                    hr = E_OUTOFMEMORY;
-                    TErr(("Failed to allocate message buffer (len=%d).",
-                          m_dataBufferSize));
-                }
-                else if ((conn->overlapped.hEvent = CreateEvent(NULL,
-                                                                FALSE,
-                                                                FALSE,
-                                                                NULL)) == NULL)
-                {
-                    hr = GETLASTHRESULT();
-                    TErr(("Failed to create overlapped event for the connection."));
-                }
-                else if ((conn->hClosedEvent = CreateEvent(NULL,
-                                                           FALSE,
-                                                           FALSE,
-                                                           NULL)) == NULL)
-                {
-                    hr = GETLASTHRESULT();
-                    TErr(("Failed to create closed event (hr=%x).", hr));
-                }
-                else
+                hr = GETLASTHRESULT();
+                TErr(("Failed to create connection thread (hr=%x).", hr));
+                if (shard->hCompletionPort != NULL)
                 {
-                    DWORD dwcb;
-                    //
-                    // Do an async read for this connection here.
-                    //
-                    hr = AsyncRead(conn,
-                                   conn->dataBuffer,
-                                   m_dataBufferSize,
-                                   &dwcb,
-                                   &conn->overlapped);
-                    if (SUCCEEDED(hr))
-                    {
-                        m_connectionList.InsertTailDList(&conn->list);
-                        SetEvent(m_hChangedEvent);
-                    }
+                    CloseHandle(shard->hCompletionPort);
+                    shard->hCompletionPort = NULL;
                 }
 
-                if (FAILED(hr))
+                if (shard->hChangedEvent != NULL)
                 {
-                    if (conn->hClosedEvent != NULL)
-                    {
-                        CloseHandle(conn->hClosedEvent);
-                        conn->hClosedEvent = NULL;
-                    }
-
-                    if (conn->overlapped.hEvent != NULL)
-                    {
-                        CloseHandle(conn->overlapped.hEvent);
-                        conn->overlapped.hEvent = NULL;
-                    }
-
-                    SAFE_DELETE(conn->dataBuffer);
-                    closesocket(socket);
-                    delete conn;
+                    CloseHandle(shard->hChangedEvent);
+                    shard->hChangedEvent = NULL;
                 }
             }
         }
 
         TExitMsg(("=%x", hr));
         return hr;
-    }   //StartConnection
+    }   //StartConnectionThread
 
     /**
-     *  This function stops the Connection thread and clean up.
+     *  This function associates the connection socket with the completion
+     *  port. If the transport provider allows it, receives that complete
+     *  inline will not queue a completion packet so the connection thread
+     *  can keep draining the socket without going back to the port.
+     *
+     *  @param conn Points to the CONN structure.
      *
      *  @return Success: Returns S_OK.
      *  @return Failure: Returns HRESULT code.
      */
     HRESULT
-    StopConnection(
-        VOID
+    AttachCompletionPort(
+        __in PCONN conn
         )
     {
         HRESULT hr = S_OK;
-        DWORD rcWait;
-        PLIST_ENTRY entry;
-        PCONN conn;
 
         TLevel(FUNC);
-        TEnter();
-        //
-        // Close and free all connections.
-        //
-        while ((entry = m_connectionList.RemoveHeadDList()) != NULL)
-        {
-            conn = CONTAINING_RECORD(entry, CONN, list);
-            CloseConnection(conn);
-            CleanupConnection(conn);
-        }
+        TEnterMsg(("conn=%p", conn));
 
-        if (m_hChangedEvent != NULL)
+        if (CreateIoCompletionPort((HANDLE)conn->socket,
+                                   conn->shard->hCompletionPort,
+                                   (ULONG_PTR)conn,
+                                   0) == NULL)
         {
-            TInfo(("Signaling connection thread to die..."));
-            m_dwFlags |= LISTENF_TERMINATING;
-            SetEvent(m_hChangedEvent);
-            CloseHandle(m_hChangedEvent);
-            m_hChangedEvent = NULL;
+            hr = GETLASTHRESULT();
+            TErr(("Failed to associate socket with completion port (hr=%x).",
+                  hr));
         }
-
-        if (m_hConnectionThread != NULL)
+        else
         {
+            WSAPROTOCOL_INFOW protocolInfo;
+            int len = sizeof(protocolInfo);
+
             //
-            // Terminate the connection thread.
+            // Skipping the completion packet is only safe if there is no
+            // layered provider sitting on top of the base provider.
             //
-            TInfo(("Waiting for the connection thread to die..."));
-            rcWait = WaitForSingleObject(m_hConnectionThread,
-                                         TERMINATE_TIMEOUT);
-            if (rcWait != WAIT_OBJECT_0)
+            if ((getsockopt(conn->socket,
+                            SOL_SOCKET,
+                            SO_PROTOCOL_INFOW,
+                            (char *)&protocolInfo,
+                            &len) != SOCKET_ERROR) &&
+                (protocolInfo.dwServiceFlags1 & XP1_IFS_HANDLES) &&
+                SetFileCompletionNotificationModes(
+                    (HANDLE)conn->socket,
+                    FILE_SKIP_COMPLETION_PORT_ON_SUCCESS))
             {
-                hr = (rcWait == WAIT_FAILED)? GETLASTHRESULT():
-                                              HRESULT_FROM_WIN32(rcWait);
-                TErr(("Failed waiting for the connection thread to die (hr=%x).",
-                      hr));
+                conn->dwFlags |= CONNF_SKIPONSUCCESS;
+            }
+            else
+            {
+                TWarn(("Inline completion not available for socket %x.",
+                       (unsigned int)conn->socket));
             }
-            CloseHandle(m_hConnectionThread);
-            m_hConnectionThread = NULL;
         }
 
-        TExitMsg(("=%x", hr));
+        TExitMsg(("=%x (flags=%x)", hr, conn->dwFlags));
         return hr;
-    }   //StopConnection
+    }   //AttachCompletionPort
 
     /**
-     *  This function closes the connection.
-     *
-     *  @param conn Points to the CONN structure.
+     *  This function picks the shard to place a new connection on. It is the
+     *  one with the fewest connections that still has room.
      *
-     *  @return Success: Returns S_OK.
-     *  @return Failure: Returns HRESULT code.
+     *  @return Success: Returns the shard.
+     *  @return Failure: Returns NULL if all shards are full.
      */
-    HRESULT
-    CloseConnection(
-        __in PCONN conn
+    PSHARD
+    SelectShard(
+        VOID
         )
     {
-        HRESULT hr = S_OK;
+        PSHARD shard = NULL;
+        DWORD minConns = 0;
 
         TLevel(FUNC);
-        TEnterMsg(("conn=%p", conn));
+        TEnter();
 
-        if (conn->socket != INVALID_SOCKET)
+        for (DWORD i = 0; i < m_numShards; i++)
         {
-            TInfo(("Shutting down connection socket %x.",
-                   (unsigned int)conn->socket));
-            shutdown(conn->socket, SD_BOTH);
-            closesocket(conn->socket);
-            conn->socket = INVALID_SOCKET;
-            if (conn->hClosedEvent != NULL)
+            DWORD numConns = m_shards[i].connections.GetCount();
+
+            if (!(m_dwFlags & LISTENF_IOCP) && (numConns >= MAX_SHARD_CONNS))
             {
-                DWORD rcWait = WaitForSingleObject(conn->hClosedEvent,
-                                                   TERMINATE_TIMEOUT);
-                if (rcWait != WAIT_OBJECT_0)
-                {
-                    hr = (rcWait == WAIT_FAILED)? GETLASTHRESULT():
-                                                  HRESULT_FROM_WIN32(rcWait);
-                    TErr(("Failed waiting for connection close (hr=%x).", hr));
-                }
-                CloseHandle(conn->hClosedEvent);
-                conn->hClosedEvent = NULL;
+                //
+                // The event backend can't wait on any more handles.
+                //
+                continue;
+            }
+            else if ((shard == NULL) || (numConns < minConns))
+            {
+                shard = &m_shards[i];
+                minConns = numConns;
             }
         }
 
-        TExitMsg(("=%x", hr));
-        return hr;
-    }   //CloseConnection
+        TExitMsg(("=%p (conns=%d)", shard, minConns));
+        return shard;
+    }   //SelectShard
 
     /**
-     *  This function deallocates the connection.
-     *
-     *  @param conn Points to the CONN structure.
+     *  This function starts the dispatch thread that calls the data callback
+     *  on behalf of the connection threads.
      *
      *  @return Success: Returns S_OK.
      *  @return Failure: Returns HRESULT code.
      */
     HRESULT
-    CleanupConnection(
-        __in PCONN conn
+    StartDispatchThread(
+        VOID
         )
     {
         HRESULT hr = S_OK;
 
         TLevel(FUNC);
-        TEnterMsg(("conn=%p", conn));
-
-        if (conn->socket != INVALID_SOCKET)
-        {
-            //
-            // If we come here, the connection must have been aborted from
-            // the client side, so we close the socket here.
-            //
-            TInfo(("Shutting down connection socket %x.",
-                   (unsigned int)conn->socket));
-            closesocket(conn->socket);
-            conn->socket = INVALID_SOCKET;
-        }
+        TEnterMsg(("depth=%d", m_dispatchDepth));
 
-        if (conn->dataBuffer != NULL)
+        if (FAILED(hr = m_dispatchQueue.Initialize(m_dispatchDepth)))
         {
-            TInfo(("Deallocating receive buffer."));
-            delete [] conn->dataBuffer;
-            conn->dataBuffer = NULL;
+            TErr(("Failed to initialize dispatch queue (hr=%x).", hr));
         }
-
-        if (conn->hClosedEvent != NULL)
+        else if (((m_hDispatchEvent = CreateEvent(NULL, FALSE, FALSE, NULL)) ==
+                  NULL) ||
+                 ((m_hSpaceEvent = CreateEvent(NULL, FALSE, FALSE, NULL)) ==
+                  NULL))
         {
-            TInfo(("Closing closed event handle %p.", conn->hClosedEvent));
-            CloseHandle(conn->hClosedEvent);
-            conn->hClosedEvent = NULL;
+            hr = GETLASTHRESULT();
+            TErr(("Failed to create dispatch events (hr=%x).", hr));
         }
-
-        if (conn->overlapped.hEvent != NULL)
+        else
         {
-            TInfo(("Closing overlappedRead event handle %p.",
-                   conn->overlapped.hEvent));
-            CloseHandle(conn->overlapped.hEvent);
-            conn->overlapped.hEvent = NULL;
+            TInfo(("Creating Dispatch thread..."));
+            m_hDispatchThread = CreateThread(NULL,
+                                             0,
+                                             DispatchThreadProc,
+                                             this,
+                                             0,
+                                             NULL);
+            if (m_hDispatchThread == NULL)
+            {
+                hr = GETLASTHRESULT();
+                TErr(("Failed to create dispatch thread (hr=%x).", hr));
+            }
         }
 
-        delete conn;
-
         TExitMsg(("=%x", hr));
         return hr;
-    }   //CleanupConnection
+    }   //StartDispatchThread
 
     /**
-     *  This function implements the connection thread.
+     *  This function stops the dispatch thread once it has delivered all
+     *  queued packets. It must only be called after the connection threads
+     *  are gone.
      *
      *  @return Success: Returns S_OK.
      *  @return Failure: Returns HRESULT code.
      */
     HRESULT
-    ConnectionThread(
+    StopDispatchThread(
         VOID
         )
     {
         HRESULT hr = S_OK;
-        BOOL fChanged = TRUE;
-        int n = 0;
-        PHANDLE ahWaits = NULL;
-        PCONN *aConns = NULL;
+        DISPATCHITEM item;
 
-        TLevel(CALLBK);
+        TLevel(FUNC);
         TEnter();
 
-        while (hr == S_OK)
+        if (m_hDispatchThread != NULL)
         {
-            if (fChanged == TRUE)
+            DWORD rcWait;
+
+            TInfo(("Waiting for the dispatch thread to die..."));
+            m_dwFlags |= LISTENF_DISPATCHSTOP;
+            SetEvent(m_hDispatchEvent);
+            rcWait = WaitForSingleObject(m_hDispatchThread, TERMINATE_TIMEOUT);
+            if (rcWait == WAIT_OBJECT_0)
             {
-                fChanged = FALSE;
-                n = 0;
-                //
-                // Deallocate old handles and CONN pointers.
-                //
-                if (ahWaits != NULL)
-                {
-                    //
-                    // Deallocating old wait handles array.
-                    //
-                    delete [] ahWaits;
-                    ahWaits = NULL;
-                }
-                if (aConns != NULL)
-                {
-                    //
-                    // Deallocating old Conn pointers array.
-                    //
-                    delete [] aConns;
-                    aConns = NULL;
-                }
-                //
-                // Determine the number of CONN entries to monitor.
-                //
-                m_connectionList.EnterCritSect();
-                n += m_connectionList.QueryEntriesDList();
-                TInfo(("Number of connections = %d.", n));
-                //
-                // Create new wait handles and CONN pointer array.
-                //
-                ahWaits = new HANDLE[n + 1];
-                if (ahWaits == NULL)
-                {
-                    TErr(("Failed to allocate %d wait handles.", n + 1));
-                    hr = E_OUTOFMEMORY;
-                }
-                else
-                {
-                    ahWaits[n] = m_hChangedEvent;
-                    if (n > 0)
-                    {
-                        aConns = new PCONN[n];
-                        if (aConns == NULL)
-                        {
-                            TErr(("Failed to allocate Conn pointer array (n=%d).",
-                                  n));
-                            hr = E_OUTOFMEMORY;
-                        }
+                CloseHandle(m_hDispatchThread);
+                m_hDispatchThread = NULL;
+            }
+            else
+            {
+                hr = (rcWait == WAIT_FAILED)? GETLASTHRESULT():
+                                              HRESULT_FROM_WIN32(rcWait);
+                TErr(("Failed waiting for the dispatch thread to die (hr=%x).",
+                      hr));
+            }
+        }
+
+        //
+        // A dispatch thread that didn't die still uses its events and the
+        // queue, leave them to it.
+        //
+        if (SUCCEEDED(hr))
+        {
+            if (m_hDispatchEvent != NULL)
+            {
+                CloseHandle(m_hDispatchEvent);
+                m_hDispatchEvent = NULL;
+            }
+
+            if (m_hSpaceEvent != NULL)
+            {
+                CloseHandle(m_hSpaceEvent);
+                m_hSpaceEvent = NULL;
+            }
+            //
+            // Drop whatever the thread didn't get to.
+            //
+            while (m_dispatchQueue.Dequeue(&item))
+            {
+                ReleaseLease(item.packet.hLease);
+            }
+            m_dispatchQueue.Uninitialize();
+            m_dwFlags &= ~LISTENF_DISPATCHSTOP;
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //StopDispatchThread
+
+    /**
+     *  This function hands a batch of received packets to the data callback,
+     *  either directly or through the dispatch queue. Queued packets keep a
+     *  lease on their buffer, so the connection threads post fresh buffers
+     *  and go back to receiving right away. They carry no connection
+     *  handle, since the connection may be freed before they are
+     *  delivered. If the queue is full, the calling thread waits for the
+     *  dispatch thread to make room. If the dispatch thread has died, the
+     *  rest of the batch is dropped.
+     *
+     *  @param packets Points to the array of received packets.
+     *  @param numPackets Specifies the number of packets in the array.
+     */
+    VOID
+    DeliverPackets(
+        __in_ecount(numPackets) WsaCallback::PWSAPACKET packets,
+        __in                    DWORD numPackets
+        )
+    {
+        TLevel(FUNC);
+        TEnterMsg(("packets=%p,n=%d", packets, numPackets));
+
+        if (m_dwFlags & LISTENF_DISPATCH)
+        {
+            DISPATCHITEM item;
+            BOOL fWarned = FALSE;
+            BOOL fDropped = FALSE;
+
+            for (DWORD i = 0; (i < numPackets) && !fDropped; i++)
+            {
+                item.packet = packets[i];
+                item.packet.connHandle = NULL;
+                item.packet.fromAddr = NULL;
+                item.packet.fromLen = 0;
+                ZeroMemory(&item.fromAddr, sizeof(item.fromAddr));
+                if ((packets[i].fromAddr != NULL) &&
+                    (packets[i].fromLen > 0))
+                {
+                    item.packet.fromLen = min(packets[i].fromLen,
+                                              (int)sizeof(item.fromAddr));
+                    RtlCopyMemory(&item.fromAddr,
+                                  packets[i].fromAddr,
+                                  item.packet.fromLen);
+                }
+                AddRefLease(item.packet.hLease);
+
+                while (!m_dispatchQueue.Enqueue(&item))
+                {
+                    HANDLE ahWait[2] = {m_hSpaceEvent, m_hDispatchThread};
+
+                    if (!fWarned)
+                    {
+                        TWarn(("Dispatch queue is full, waiting..."));
+                        fWarned = TRUE;
+                    }
+                    //
+                    // The dispatch thread signals the space event each
+                    // time it takes packets off the queue. With several
+                    // shards waiting, one signal only wakes one of them,
+                    // the timeout makes sure the others retry. The
+                    // connection threads are stopped before the dispatch
+                    // thread, so it only exits early on an error and
+                    // nobody would ever make room again.
+                    //
+                    SetEvent(m_hDispatchEvent);
+                    if (WaitForMultipleObjects(ARRAYSIZE(ahWait),
+                                               ahWait,
+                                               FALSE,
+                                               DISPATCH_SPACE_TIMEOUT) ==
+                        WAIT_OBJECT_0 + 1)
+                    {
+                        TErr(("Dispatch thread died, dropping %d packets.",
+                              numPackets - i));
+                        ReleaseLease(item.packet.hLease);
+                        fDropped = TRUE;
+                        break;
+                    }
+                }
+            }
+            SetEvent(m_hDispatchEvent);
+        }
+        else
+        {
+            m_dataCallback->DataBatchReceived(m_callbackContext,
+                                              packets,
+                                              numPackets);
+        }
+
+        TExit();
+        return;
+    }   //DeliverPackets
+
+    /**
+     *  This function implements the dispatch thread. It delivers the queued
+     *  packets to the data callback in batches and releases their buffers.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    DispatchThread(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+        DISPATCHITEM aItems[DISPATCH_BATCH_SIZE];
+        WsaCallback::WSAPACKET aPackets[DISPATCH_BATCH_SIZE];
+
+        TLevel(CALLBK);
+        TEnter();
+
+        while (hr == S_OK)
+        {
+            DWORD nPackets = 0;
+
+            while ((nPackets < ARRAYSIZE(aItems)) &&
+                   m_dispatchQueue.Dequeue(&aItems[nPackets]))
+            {
+                aPackets[nPackets] = aItems[nPackets].packet;
+                aPackets[nPackets].fromAddr =
+                    (PSOCKADDR)&aItems[nPackets].fromAddr;
+                nPackets++;
+            }
+
+            if (nPackets > 0)
+            {
+                SetEvent(m_hSpaceEvent);
+                TInfo(("Dispatching %d data packets.", nPackets));
+                m_dataCallback->DataBatchReceived(m_callbackContext,
+                                                  aPackets,
+                                                  nPackets);
+                for (DWORD i = 0; i < nPackets; i++)
+                {
+                    ReleaseLease(aPackets[i].hLease);
+                }
+            }
+            else if (m_dwFlags & LISTENF_DISPATCHSTOP)
+            {
+                TInfo(("Received a termination event."));
+                break;
+            }
+            else
+            {
+                DWORD rcWait = WaitForSingleObject(m_hDispatchEvent, INFINITE);
+
+                if (rcWait != WAIT_OBJECT_0)
+                {
+                    hr = (rcWait == WAIT_FAILED)? GETLASTHRESULT():
+                                                  HRESULT_FROM_WIN32(rcWait);
+                    TErr(("Failed waiting for dispatch event (hr=%x).", hr));
+                }
+            }
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //DispatchThread
+
+    /**
+     *  This function allocates a receive buffer from the buffer pool and
+     *  takes the server reference on its lease.
+     *
+     *  @param cache Points to the buffer pool cache of the calling thread,
+     *         can be NULL.
+     *
+     *  @return Success: Returns the receive buffer.
+     *  @return Failure: Returns NULL.
+     */
+    LPBYTE
+    AllocRecvBuffer(
+        __inout_opt BuffPool::PBUFFCACHE cache
+        )
+    {
+        LPBYTE buff = NULL;
+        PLEASE lease;
+
+        TLevel(FUNC);
+        TEnterMsg(("cache=%p", cache));
+
+        lease = (PLEASE)m_buffPool.Alloc(cache);
+        if (lease != NULL)
+        {
+            lease->refCount = 1;
+            lease->pool = &m_buffPool;
+            buff = (LPBYTE)(lease + 1);
+        }
+
+        TExitMsg(("=%p", buff));
+        return buff;
+    }   //AllocRecvBuffer
+
+    /**
+     *  This function drops the server reference on a receive buffer. The
+     *  buffer goes back to the pool once no callback holds it either.
+     *
+     *  @param buff Points to the receive buffer.
+     *  @param cache Points to the buffer pool cache of the calling thread,
+     *         can be NULL.
+     */
+    VOID
+    ReleaseRecvBuffer(
+        __in        LPBYTE buff,
+        __inout_opt BuffPool::PBUFFCACHE cache
+        )
+    {
+        PLEASE lease = BUFF_TO_LEASE(buff);
+
+        TLevel(FUNC);
+        TEnterMsg(("buff=%p,cache=%p,refCount=%d",
+                   buff, cache, lease->refCount));
+
+        if (InterlockedDecrement(&lease->refCount) == 0)
+        {
+            lease->pool->Free(lease, cache);
+        }
+
+        TExit();
+        return;
+    }   //ReleaseRecvBuffer
+
+    /**
+     *  This function is called before a receive context is re-posted. If a
+     *  callback kept the buffer of the context, the context gets a fresh
+     *  buffer instead of overwriting it.
+     *
+     *  @param conn Points to the CONN structure.
+     *  @param ctxt Points to the RECVCTXT structure.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    RenewRecvBuffer(
+        __in PCONN conn,
+        __in PRECVCTXT ctxt
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(FUNC);
+        TEnterMsg(("conn=%p,ctxt=%p", conn, ctxt));
+
+        if ((ctxt->dataBuffer != NULL) &&
+            (BUFF_TO_LEASE(ctxt->dataBuffer)->refCount != 1))
+        {
+            BuffPool::PBUFFCACHE cache = &conn->shard->poolCache.buffCache;
+
+            TInfo(("Receive buffer %p is leased, replacing it.",
+                   ctxt->dataBuffer));
+            ReleaseRecvBuffer(ctxt->dataBuffer, cache);
+            if ((ctxt->dataBuffer = AllocRecvBuffer(cache)) == NULL)
+            {
+                hr = E_OUTOFMEMORY;
+                TErr(("Failed to allocate receive buffer (len=%d).",
+                      m_buffPool.GetBlockSize()));
+            }
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //RenewRecvBuffer
+
+    /**
+     *  This function allocates a connection and its receive contexts from
+     *  the connection pool and a receive buffer for each context from the
+     *  buffer pool.
+     *
+     *  @param cache Points to the pool caches of the calling thread.
+     *
+     *  @return Success: Returns the zero initialized connection.
+     *  @return Failure: Returns NULL.
+     */
+    PCONN
+    AllocConnection(
+        __in PPOOLCACHE cache
+        )
+    {
+        PCONN conn;
+
+        TLevel(FUNC);
+        TEnterMsg(("cache=%p", cache));
+
+        conn = (PCONN)m_connPool.Alloc(&cache->connCache);
+        if (conn == NULL)
+        {
+            TErr(("Failed to allocate connection structure (len=%d).",
+                  m_connPool.GetBlockSize()));
+        }
+        else
+        {
+            //
+            // The receive contexts share the pool block of the connection.
+            //
+            ZeroMemory(conn, sizeof(CONN) + m_recvDepth*sizeof(RECVCTXT));
+            conn->recvCtxts = (PRECVCTXT)(conn + 1);
+            for (DWORD i = 0; i < m_recvDepth; i++)
+            {
+                conn->recvCtxts[i].conn = conn;
+                conn->recvCtxts[i].dataBuffer =
+                    AllocRecvBuffer(&cache->buffCache);
+                if (conn->recvCtxts[i].dataBuffer == NULL)
+                {
+                    TErr(("Failed to allocate receive buffer (len=%d).",
+                          m_buffPool.GetBlockSize()));
+                    FreeConnection(conn, cache);
+                    conn = NULL;
+                    break;
+                }
+            }
+        }
+
+        TExitMsg(("=%p", conn));
+        return conn;
+    }   //AllocConnection
+
+    /**
+     *  This function returns a connection and its receive buffers to the
+     *  pools.
+     *
+     *  @param conn Points to the CONN structure.
+     *  @param cache Points to the pool caches of the calling thread, can be
+     *         NULL.
+     */
+    VOID
+    FreeConnection(
+        __in     PCONN conn,
+        __in_opt PPOOLCACHE cache
+        )
+    {
+        TLevel(FUNC);
+        TEnterMsg(("conn=%p,cache=%p", conn, cache));
+
+        for (DWORD i = 0; i < m_recvDepth; i++)
+        {
+            if (conn->recvCtxts[i].dataBuffer != NULL)
+            {
+                ReleaseRecvBuffer(conn->recvCtxts[i].dataBuffer,
+                                  (cache != NULL)? &cache->buffCache: NULL);
+            }
+        }
+        m_connPool.Free(conn, (cache != NULL)? &cache->connCache: NULL);
+
+        TExit();
+        return;
+    }   //FreeConnection
+
+    /**
+     *  This function starts a connection. This includes creating a connection
+     *  thread to monitor data from the message socket.
+     *
+     *  @param socket Specifies the socket for the connection to receive
+     *         message from.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    StartConnection(
+        __in SOCKET socket
+        )
+    {
+        HRESULT hr = S_OK;
+        PSHARD shard;
+
+        TLevel(FUNC);
+        TEnterMsg(("socket=%x", socket));
+
+        if ((shard = SelectShard()) == NULL)
+        {
+            hr = HRESULT_FROM_WIN32(WSAEMFILE);
+            TErr(("All connection shards are full (hr=%x).", hr));
+            closesocket(socket);
+        }
+        else if (shard->hConnectionThread == NULL)
+        {
+            //
+            // If we haven't started the shard's connection thread yet, start
+            // it now.
+            //
+            hr = StartConnectionThread(shard);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            PCONN conn = AllocConnection(&m_listenerCache);
+
+            if (conn == NULL)
+            {
+                hr = E_OUTOFMEMORY;
+                TErr(("Failed to allocate connection."));
+                closesocket(socket);
+            }
+            else
+            {
+                conn->dwSig = SIG_SERVERCONNECTION;
+                conn->shard = shard;
+                conn->socket = socket;
+
+                if (!(m_dwFlags & LISTENF_IOCP) &&
+                         ((conn->hRecvEvent = CreateEvent(NULL,
+                                                          FALSE,
+                                                          FALSE,
+                                                          NULL)) == NULL))
+                {
+                    hr = GETLASTHRESULT();
+                    TErr(("Failed to create overlapped event for the connection."));
+                }
+                else if ((conn->hClosedEvent = CreateEvent(NULL,
+                                                           FALSE,
+                                                           FALSE,
+                                                           NULL)) == NULL)
+                {
+                    hr = GETLASTHRESULT();
+                    TErr(("Failed to create closed event (hr=%x).", hr));
+                }
+                else if ((m_dwFlags & LISTENF_IOCP) &&
+                         FAILED(hr = AttachCompletionPort(conn)))
+                {
+                    TErr(("Failed to attach connection to completion port (hr=%x).",
+                          hr));
+                }
+                else
+                {
+                    for (DWORD i = 0; i < m_recvDepth; i++)
+                    {
+                        conn->recvCtxts[i].overlapped.hEvent =
+                            conn->hRecvEvent;
+                    }
+                    //
+                    // The completion thread may see the connection before
+                    // we return, so the CONN must be registered by then.
+                    //
+                    if ((conn->regIdx = shard->connections.Insert(conn)) ==
+                        LFREG_INVALID_INDEX)
+                    {
+                        hr = HRESULT_FROM_WIN32(WSAEMFILE);
+                        TErr(("Failed to register connection (hr=%x).", hr));
+                    }
+                    else if (m_dwFlags & LISTENF_IOCP)
+                    {
+                        //
+                        // Let the completion thread post the receives so that
+                        // they are always posted in ring order by one thread.
+                        //
+                        conn->numPosted = 1;
+                        if (!PostQueuedCompletionStatus(shard->hCompletionPort,
+                                                        0,
+                                                        (ULONG_PTR)conn,
+                                                        NULL))
+                        {
+                            hr = GETLASTHRESULT();
+                            TErr(("Failed to queue completion packet (hr=%x).",
+                                  hr));
+                        }
                     }
+                    else
+                    {
+                        DWORD dwcb;
+                        //
+                        // Do the async reads for this connection here.
+                        //
+                        for (DWORD i = 0;
+                             SUCCEEDED(hr) && (i < m_recvDepth);
+                             i++)
+                        {
+                            hr = PostReceive(conn, &conn->recvCtxts[i], &dwcb);
+                        }
+
+                        if (SUCCEEDED(hr))
+                        {
+                            shard->pendingList.InsertTail(conn);
+                            SetEvent(shard->hChangedEvent);
+                        }
+                    }
+
+                    if (FAILED(hr))
+                    {
+                        shard->connections.Remove(conn->regIdx, conn);
+                    }
+                }
+
+                if (FAILED(hr))
+                {
+                    //
+                    // Make sure no receive is still outstanding on the
+                    // buffers before freeing them.
+                    //
+                    conn->socket = INVALID_SOCKET;
+                    closesocket(socket);
+                    if (WaitPendingReceives(conn))
+                    {
+                        CleanupConnection(conn, &m_listenerCache);
+                    }
+                    else
+                    {
+                        //
+                        // Leak the connection rather than free buffers the
+                        // system may still write to.
+                        //
+                        TErr(("Leaking connection %p.", conn));
+                    }
+                }
+            }
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //StartConnection
+
+    /**
+     *  This function stops the connection thread of a shard and cleans up
+     *  its connections.
+     *
+     *  @param shard Points to the SHARD structure.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    StopConnectionThread(
+        __in PSHARD shard
+        )
+    {
+        HRESULT hr = S_OK;
+        DWORD rcWait;
+        CONNLIST pendingList;
+        PCONN conn;
+        DWORD idx = 0;
+
+        TLevel(FUNC);
+        TEnterMsg(("shard=%d", shard->index));
+        //
+        // Connections the thread has not picked up yet will never be
+        // signaled closed by it. Close them here and wait for their
+        // receives to abort before freeing the buffers.
+        //
+        pendingList.SpliceTail(shard->pendingList);
+        while ((conn = pendingList.RemoveHead()) != NULL)
+        {
+            if (shard->connections.Remove(conn->regIdx, conn))
+            {
+                SOCKET socket = conn->socket;
+
+                conn->socket = INVALID_SOCKET;
+                closesocket(socket);
+                if (WaitPendingReceives(conn))
+                {
+                    CleanupConnection(conn, NULL);
+                }
+                else
+                {
+                    TErr(("Leaking connection %p.", conn));
+                }
+            }
+        }
+        //
+        // Close and free all connections we manage to claim. The ones the
+        // connection thread claims first are cleaned up by it.
+        //
+        while ((conn = (PCONN)shard->connections.GetNext(&idx)) != NULL)
+        {
+            if (shard->connections.Remove(idx - 1, conn))
+            {
+                CloseConnection(conn);
+                CleanupConnection(conn, NULL);
+            }
+        }
+
+        if (shard->hChangedEvent != NULL)
+        {
+            TInfo(("Signaling connection thread to die..."));
+            SetEvent(shard->hChangedEvent);
+        }
+
+        if (shard->hCompletionPort != NULL)
+        {
+            TInfo(("Signaling completion thread to die..."));
+            PostQueuedCompletionStatus(shard->hCompletionPort, 0, 0, NULL);
+        }
+
+        if (shard->hConnectionThread != NULL)
+        {
+            //
+            // Terminate the connection thread.
+            //
+            TInfo(("Waiting for the connection thread to die..."));
+            rcWait = WaitForSingleObject(shard->hConnectionThread,
+                                         TERMINATE_TIMEOUT);
+            if (rcWait == WAIT_OBJECT_0)
+            {
+                CloseHandle(shard->hConnectionThread);
+                shard->hConnectionThread = NULL;
+            }
+            else
+            {
+                hr = (rcWait == WAIT_FAILED)? GETLASTHRESULT():
+                                              HRESULT_FROM_WIN32(rcWait);
+                TErr(("Failed waiting for the connection thread to die (hr=%x).",
+                      hr));
+            }
+        }
+
+        //
+        // A connection thread that didn't die still uses its events and
+        // pool cache, leave them to it.
+        //
+        if (SUCCEEDED(hr))
+        {
+            if (shard->hChangedEvent != NULL)
+            {
+                CloseHandle(shard->hChangedEvent);
+                shard->hChangedEvent = NULL;
+            }
+
+            if (shard->hCompletionPort != NULL)
+            {
+                CloseHandle(shard->hCompletionPort);
+                shard->hCompletionPort = NULL;
+            }
+            //
+            // Give the blocks the connection thread has cached back to the
+            // pools.
+            //
+            m_connPool.FlushCache(&shard->poolCache.connCache);
+            m_buffPool.FlushCache(&shard->poolCache.buffCache);
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //StopConnectionThread
+
+    /**
+     *  This function stops all connection threads and clean up.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    StopConnection(
+        VOID
+        )
+    {
+        HRESULT hr = S_OK;
+        HRESULT hrStop;
+
+        TLevel(FUNC);
+        TEnter();
+
+        if (m_shards != NULL)
+        {
+            m_dwFlags |= LISTENF_TERMINATING;
+            for (DWORD i = 0; i < m_numShards; i++)
+            {
+                if (FAILED(hrStop = StopConnectionThread(&m_shards[i])))
+                {
+                    hr = hrStop;
                 }
+            }
+
+            //
+            // The connection threads are gone, let the dispatch thread
+            // deliver what they queued.
+            //
+            if (SUCCEEDED(hr) && FAILED(hrStop = StopDispatchThread()))
+            {
+                hr = hrStop;
+            }
+
+            if (SUCCEEDED(hr))
+            {
+                m_connPool.FlushCache(&m_listenerCache.connCache);
+                m_buffPool.FlushCache(&m_listenerCache.buffCache);
+                delete [] m_shards;
+                m_shards = NULL;
+                m_numShards = 0;
+                //
+                // The pool slabs are kept until the listener is restarted or
+                // the server is destroyed since callbacks may still hold
+                // leased buffers.
+                //
+            }
+            else
+            {
                 //
-                // Walk the Conn entry list and fill the handle array and
-                // initiate an async recv on the connection.
+                // Some thread is stuck and still using the shards, the
+                // dispatch queue and the pools, leave them to it.
                 //
-                if ((hr == S_OK) && (n > 0))
+                TErr(("Leaking the connection state (hr=%x).", hr));
+            }
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //StopConnection
+
+    /**
+     *  This function closes the connection.
+     *
+     *  @param conn Points to the CONN structure.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    CloseConnection(
+        __in PCONN conn
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(FUNC);
+        TEnterMsg(("conn=%p", conn));
+
+        if (conn->socket != INVALID_SOCKET)
+        {
+            SOCKET socket = conn->socket;
+
+            TInfo(("Shutting down connection socket %x.",
+                   (unsigned int)socket));
+            //
+            // Invalidate the socket before closing it so that the connection
+            // thread sees WSAENOTSOCK when the pending receive is aborted.
+            //
+            conn->socket = INVALID_SOCKET;
+            shutdown(socket, SD_BOTH);
+            closesocket(socket);
+            if (conn->hClosedEvent != NULL)
+            {
+                DWORD rcWait = WaitForSingleObject(conn->hClosedEvent,
+                                                   TERMINATE_TIMEOUT);
+                if (rcWait != WAIT_OBJECT_0)
+                {
+                    hr = (rcWait == WAIT_FAILED)? GETLASTHRESULT():
+                                                  HRESULT_FROM_WIN32(rcWait);
+                    TErr(("Failed waiting for connection close (hr=%x).", hr));
+                }
+                CloseHandle(conn->hClosedEvent);
+                conn->hClosedEvent = NULL;
+            }
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //CloseConnection
+
+    /**
+     *  This function deallocates the connection.
+     *
+     *  @param conn Points to the CONN structure.
+     *  @param cache Points to the pool caches of the calling thread, can be
+     *         NULL.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    CleanupConnection(
+        __in     PCONN conn,
+        __in_opt PPOOLCACHE cache
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(FUNC);
+        TEnterMsg(("conn=%p,cache=%p", conn, cache));
+
+        if (conn->socket != INVALID_SOCKET)
+        {
+            //
+            // If we come here, the connection must have been aborted from
+            // the client side, so we close the socket here.
+            //
+            TInfo(("Shutting down connection socket %x.",
+                   (unsigned int)conn->socket));
+            closesocket(conn->socket);
+            conn->socket = INVALID_SOCKET;
+        }
+
+        if (conn->hClosedEvent != NULL)
+        {
+            TInfo(("Closing closed event handle %p.", conn->hClosedEvent));
+            CloseHandle(conn->hClosedEvent);
+            conn->hClosedEvent = NULL;
+        }
+
+        if (conn->hRecvEvent != NULL)
+        {
+            TInfo(("Closing overlappedRead event handle %p.",
+                   conn->hRecvEvent));
+            CloseHandle(conn->hRecvEvent);
+            conn->hRecvEvent = NULL;
+        }
+
+        FreeConnection(conn, cache);
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //CleanupConnection
+
+    /**
+     *  This function waits for the receives still outstanding on an event
+     *  backend connection to complete, cancelling them first if the socket
+     *  is still open. The receive buffers must not be freed before that.
+     *
+     *  @param conn Points to the CONN structure.
+     *
+     *  @return Success: Returns TRUE if no receive is outstanding.
+     *  @return Failure: Returns FALSE if a receive did not abort in time.
+     */
+    BOOL
+    WaitPendingReceives(
+        __in PCONN conn
+        )
+    {
+        BOOL rc = TRUE;
+
+        TLevel(FUNC);
+        TEnterMsg(("conn=%p", conn));
+
+        if ((conn->recvCtxts != NULL) && (conn->hRecvEvent != NULL))
+        {
+            if (conn->socket != INVALID_SOCKET)
+            {
+                CancelIoEx((HANDLE)conn->socket, NULL);
+            }
+
+            for (DWORD i = 0; i < m_recvDepth; i++)
+            {
+                while (!HasOverlappedIoCompleted(
+                            &conn->recvCtxts[i].overlapped))
+                {
+                    if (WaitForSingleObject(conn->hRecvEvent,
+                                            TERMINATE_TIMEOUT) !=
+                        WAIT_OBJECT_0)
+                    {
+                        TErr(("Timed out waiting for receive %d to abort.",
+                              i));
+                        rc = FALSE;
+                        break;
+                    }
+                }
+            }
+        }
+
+        TExitMsg(("=%d", rc));
+        return rc;
+    }   //WaitPendingReceives
+
+    /**
+     *  This function handles a connection whose receive has failed.
+     *
+     *  @param conn Points to the CONN structure.
+     *  @param hr Specifies the failure code of the receive.
+     */
+    VOID
+    ConnectionClosed(
+        __in PCONN conn,
+        __in HRESULT hr
+        )
+    {
+        TLevel(FUNC);
+        TEnterMsg(("conn=%p,hr=%x", conn, hr));
+
+        //
+        // If the connection is aborted from the client side, we get
+        // WSAECONNRESET or ERROR_OPERATION_ABORTED. If the socket is closed
+        // from our side, we get WSAENOTSOCK.
+        //
+        UNREFERENCED_PARAMETER(hr);
+        TInfo(("Connection %p is closed.", conn));
+        if (!(m_dwFlags & LISTENF_IOCP))
+        {
+            //
+            // The overlapped event is about to be closed, stop waiting on it.
+            //
+            RemoveWaitSlot(conn->shard, conn);
+        }
+
+        if (conn->shard->connections.Remove(conn->regIdx, conn))
+        {
+            //
+            // The connection is shutting down by the client, so we need to
+            // clean up here.
+            //
+            CleanupConnection(conn, &conn->shard->poolCache);
+        }
+        else
+        {
+            //
+            // The connection is shutting down from our side. Whoever
+            // unregistered it is waiting for the connection to close. So
+            // let's signal it.
+            //
+            if (conn->hClosedEvent != NULL)
+            {
+                SetEvent(conn->hClosedEvent);
+            }
+        }
+
+        TExit();
+        return;
+    }   //ConnectionClosed
+
+    /**
+     *  This function adds a connection to the wait set of its shard. It is
+     *  only called on the shard connection thread.
+     *
+     *  @param shard Points to the SHARD structure.
+     *  @param conn Points to the CONN structure.
+     */
+    VOID
+    AddWaitSlot(
+        __in PSHARD shard,
+        __in PCONN conn
+        )
+    {
+        TLevel(FUNC);
+        TEnterMsg(("shard=%d,conn=%p", shard->index, conn));
+
+        TAssert(shard->numWaits < ARRAYSIZE(shard->ahWaits));
+        conn->waitIdx = shard->numWaits;
+        shard->ahWaits[conn->waitIdx] = conn->hRecvEvent;
+        shard->aConns[conn->waitIdx] = conn;
+        shard->numWaits++;
+
+        TExitMsg(("!(idx=%d)", conn->waitIdx));
+        return;
+    }   //AddWaitSlot
+
+    /**
+     *  This function removes a connection from the wait set of its shard by
+     *  moving the last slot into its place. It is only called on the shard
+     *  connection thread.
+     *
+     *  @param shard Points to the SHARD structure.
+     *  @param conn Points to the CONN structure.
+     */
+    VOID
+    RemoveWaitSlot(
+        __in PSHARD shard,
+        __in PCONN conn
+        )
+    {
+        TLevel(FUNC);
+        TEnterMsg(("shard=%d,conn=%p,idx=%d",
+                   shard->index, conn, conn->waitIdx));
+
+        if (conn->waitIdx != 0)
+        {
+            DWORD idxLast = --shard->numWaits;
+
+            if (conn->waitIdx != idxLast)
+            {
+                shard->ahWaits[conn->waitIdx] = shard->ahWaits[idxLast];
+                shard->aConns[conn->waitIdx] = shard->aConns[idxLast];
+                shard->aConns[conn->waitIdx]->waitIdx = conn->waitIdx;
+            }
+            shard->ahWaits[idxLast] = NULL;
+            shard->aConns[idxLast] = NULL;
+            conn->waitIdx = 0;
+        }
+
+        TExit();
+        return;
+    }   //RemoveWaitSlot
+
+    /**
+     *  This function implements the connection thread of a shard. Slot 0 of
+     *  the wait set is the changed event; new connections are queued on the
+     *  pending list by StartConnection and moved into the wait set when the
+     *  changed event fires. Closed connections are swapped out of the set
+     *  in place, so the set is never rebuilt.
+     *
+     *  @param shard Points to the SHARD structure.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    ConnectionThread(
+        __in PSHARD shard
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(CALLBK);
+        TEnterMsg(("shard=%d", shard->index));
+
+        shard->ahWaits[0] = shard->hChangedEvent;
+        shard->aConns[0] = NULL;
+        shard->numWaits = 1;
+
+        while (hr == S_OK)
+        {
+            DWORD rcWait;
+
+            TInfo(("Waiting for connection data (n=%d)...",
+                   shard->numWaits - 1));
+            rcWait = WaitForMultipleObjects(shard->numWaits,
+                                            shard->ahWaits,
+                                            FALSE,
+                                            INFINITE);
+            if (rcWait == WAIT_OBJECT_0)
+            {
+                if (m_dwFlags & LISTENF_TERMINATING)
+                {
+                    TInfo(("Received a termination event."));
+                    break;
+                }
+                else
                 {
-                    PLIST_ENTRY entry;
+                    CONNLIST pendingList;
                     PCONN conn;
-                    int i;
+                    //
+                    // New connections have been queued, take them all and
+                    // add them to the wait set in the order they came.
+                    //
+                    TInfo(("Received changed event."));
+                    pendingList.SpliceTail(shard->pendingList);
+                    while ((conn = pendingList.RemoveHead()) != NULL)
+                    {
+                        AddWaitSlot(shard, conn);
+                    }
+                }
+            }
+            else if (rcWait < WAIT_OBJECT_0 + shard->numWaits)
+            {
+                PCONN conn = shard->aConns[rcWait - WAIT_OBJECT_0];
+
+                TInfo(("Received data for connection %p.", conn));
+                hr = ProcessConnectionData(conn);
+                if (hr != S_OK)
+                {
+                    ConnectionClosed(conn, hr);
+                    hr = S_OK;
+                }
+            }
+            else
+            {
+                hr = (rcWait == WAIT_FAILED)? GETLASTHRESULT():
+                                              HRESULT_FROM_WIN32(rcWait);
+                TErr(("Received unexpected event (hr=%x).", hr));
+            }
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //ConnectionThread
+
+    /**
+     *  This function implements the connection thread for the completion
+     *  port backend. Unlike the event backend, it is not limited by
+     *  MAXIMUM_WAIT_OBJECTS and does not need to rebuild anything when
+     *  connections come and go. Completions are dequeued in batches of up to
+     *  IOCP_BATCH_SIZE packets and the received data is delivered to the
+     *  callback in one call. Each connection keeps a ring of receive
+     *  contexts; receives are posted and delivered in ring order so the data
+     *  stays in order however many receives are outstanding. Connections
+     *  whose receives complete inline when re-posted are carried over into
+     *  the next batch instead of going back through the port.
+     *
+     *  @param shard Points to the SHARD structure.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    CompletionThread(
+        __in PSHARD shard
+        )
+    {
+        HRESULT hr = S_OK;
+        OVERLAPPED_ENTRY aEntries[IOCP_BATCH_SIZE];
+        PCONN aReadyConns[IOCP_BATCH_SIZE];
+        PCONN aWorkConns[IOCP_BATCH_SIZE*2];
+        WsaCallback::WSAPACKET aPackets[IOCP_BATCH_SIZE*2];
+        ULONG nReady = 0;
+        BOOL fTerminate = FALSE;
 
-                    entry = m_connectionList.GetHeadDList();
-                    for (i = 0;
-                         (i < n) && (entry != NULL);
-                         entry = m_connectionList.GetNextDList(entry), i++)
-                    {
-                        conn = CONTAINING_RECORD(entry, CONN, list);
-                        aConns[i] = conn;
-                        ahWaits[i] = conn->overlapped.hEvent;
-                    }
-                    TAssert((entry == NULL) && (i == n));
+        TLevel(CALLBK);
+        TEnterMsg(("shard=%d", shard->index));
+
+        while ((hr == S_OK) && !fTerminate)
+        {
+            ULONG nEntries = 0;
+            DWORD nWork = 0;
+            DWORD nPackets = 0;
+
+            //
+            // If we carried over inline completions, only poll the port so
+            // they are not held up behind an empty queue.
+            //
+            TInfo(("Waiting for connection completion (ready=%d)...",
+                   nReady));
+            if (!GetQueuedCompletionStatusEx(shard->hCompletionPort,
+                                             aEntries,
+                                             ARRAYSIZE(aEntries),
+                                             &nEntries,
+                                             (nReady > 0)? 0: INFINITE,
+                                             FALSE))
+            {
+                nEntries = 0;
+                if (GetLastError() != WAIT_TIMEOUT)
+                {
+                    hr = GETLASTHRESULT();
+                    TErr(("Failed to dequeue completion packets (hr=%x).",
+                          hr));
+                    break;
                 }
-                m_connectionList.LeaveCritSect();
             }
 
-            if (SUCCEEDED(hr))
+            for (ULONG i = 0; i < nReady; i++)
             {
-                DWORD rcWait;
+                aReadyConns[i]->dwFlags |= CONNF_WORK;
+                aWorkConns[nWork] = aReadyConns[i];
+                nWork++;
+            }
+            nReady = 0;
 
-                TInfo(("Waiting for connection data..."));
-                rcWait = WaitForMultipleObjects(n + 1,
-                                                ahWaits,
-                                                FALSE,
-                                                INFINITE);
-                if (rcWait == WAIT_OBJECT_0 + n)
+            //
+            // Record the completed receives.
+            //
+            for (ULONG i = 0; i < nEntries; i++)
+            {
+                PCONN conn = (PCONN)aEntries[i].lpCompletionKey;
+                LPOVERLAPPED overlapped = aEntries[i].lpOverlapped;
+                PRECVCTXT ctxt = (overlapped == NULL)?
+                                    NULL:
+                                    CONTAINING_RECORD(overlapped,
+                                                      RECVCTXT,
+                                                      overlapped);
+
+                if (conn == NULL)
+                {
+                    TInfo(("Received a termination packet."));
+                    fTerminate = TRUE;
+                    continue;
+                }
+                else if (ctxt == NULL)
+                {
+                    //
+                    // The connection was queued to us by StartConnection or
+                    // by ourselves when it didn't fit in a batch.
+                    //
+                    conn->numPosted--;
+                }
+                else if ((ctxt < conn->recvCtxts) ||
+                         (ctxt >= conn->recvCtxts + m_recvDepth))
                 {
-                    if (m_dwFlags & LISTENF_TERMINATING)
+                    //
+                    // This is the completion of an AsyncRead or AsyncWrite
+                    // issued by the caller with its own overlapped structure.
+                    //
+                    TInfo(("Ignoring caller I/O completion on connection %p.",
+                           conn));
+                    continue;
+                }
+                else
+                {
+                    HRESULT hrRecv = GetReceiveResult(conn, ctxt, &ctxt->dwcb);
+
+                    conn->numPosted--;
+                    if (SUCCEEDED(hrRecv))
                     {
-                        TInfo(("Received a termination event."));
-                        break;
+                        ctxt->state = RECV_DONE;
                     }
                     else
                     {
-                        //
-                        // Something has changed, either a new CONN was added
-                        // or an existing CONN was removed.  Let's re-evaluate
-                        // the link list.
-                        //
-                        fChanged = TRUE;
-                        TInfo(("Received changed event."));
+                        ctxt->state = RECV_IDLE;
+                        if (SUCCEEDED(conn->hrClosed))
+                        {
+                            conn->hrClosed = hrRecv;
+                        }
                     }
                 }
-                else if (rcWait < WAIT_OBJECT_0 + n)
+
+                if (!(conn->dwFlags & CONNF_WORK))
+                {
+                    conn->dwFlags |= CONNF_WORK;
+                    aWorkConns[nWork] = conn;
+                    nWork++;
+                }
+            }
+
+            if (fTerminate)
+            {
+                break;
+            }
+
+            //
+            // Collect the received data in ring order.
+            //
+            for (DWORD i = 0; i < nWork; i++)
+            {
+                PCONN conn = aWorkConns[i];
+
+                while (SUCCEEDED(conn->hrClosed) &&
+                       (nPackets < ARRAYSIZE(aPackets)) &&
+                       (conn->recvCtxts[conn->recvHead].state == RECV_DONE))
+                {
+                    PRECVCTXT ctxt = &conn->recvCtxts[conn->recvHead];
+
+                    conn->fromAddr = ctxt->fromAddr;
+                    conn->fromLen = ctxt->fromLen;
+                    aPackets[nPackets].connHandle = (HANDLE)conn;
+                    aPackets[nPackets].hLease =
+                        (HANDLE)BUFF_TO_LEASE(ctxt->dataBuffer);
+                    aPackets[nPackets].recvBuff = ctxt->dataBuffer;
+                    aPackets[nPackets].recvLen = ctxt->dwcb;
+                    aPackets[nPackets].fromAddr = (PSOCKADDR)&ctxt->fromAddr;
+                    aPackets[nPackets].fromLen = ctxt->fromLen;
+                    nPackets++;
+                    //
+                    // The buffer is not re-posted before the callback
+                    // returns.
+                    //
+                    ctxt->state = RECV_IDLE;
+                    conn->recvHead = (conn->recvHead + 1)%m_recvDepth;
+                }
+            }
+
+            if (nPackets > 0)
+            {
+                TInfo(("Got a batch of %d data packets.", nPackets));
+                DeliverPackets(aPackets, nPackets);
+            }
+
+            //
+            // Re-post the free buffers and retire the closed connections.
+            //
+            for (DWORD i = 0; i < nWork; i++)
+            {
+                PCONN conn = aWorkConns[i];
+
+                conn->dwFlags &= ~CONNF_WORK;
+                if (SUCCEEDED(conn->hrClosed))
                 {
-                    PCONN conn = aConns[rcWait - WAIT_OBJECT_0];
+                    conn->hrClosed = PostReceives(conn);
+                }
 
-                    TInfo(("Received data for connection %p.", conn));
-                    hr = ProcessConnectionData(conn);
-                    if (hr != S_OK)
+                if (SUCCEEDED(conn->hrClosed) &&
+                    (conn->recvCtxts[conn->recvHead].state == RECV_DONE))
+                {
+                    //
+                    // There is more data already, either from inline
+                    // completions or because it didn't fit in this batch.
+                    //
+                    if (nReady < ARRAYSIZE(aReadyConns))
                     {
-                        //
-                        // If the connection is aborted from the client side,
-                        // we get WSAECONNRESET or ERROR_OPERATION_ABORTED.
-                        // If the socket is closed from our side, we get
-                        // WSAENOTSOCK.
-                        //
-                        TInfo(("Connection %p is closed.", conn));
-                        if (HRESULT_CODE(hr) == WSAENOTSOCK)
-                        {
-                            //
-                            // The connection is shutting down from our side.
-                            // Somebody is waiting for the connection to close.
-                            // So let's signal it.
-                            //
-                            if (conn->hClosedEvent != NULL)
-                            {
-                                SetEvent(conn->hClosedEvent);
-                            }
-                        }
-                        else
+                        aReadyConns[nReady] = conn;
+                        nReady++;
+                    }
+                    else
+                    {
+                        conn->numPosted++;
+                        if (!PostQueuedCompletionStatus(shard->hCompletionPort,
+                                                        0,
+                                                        (ULONG_PTR)conn,
+                                                        NULL))
                         {
-                            //
-                            // The connection is shutting down by the client,
-                            // so we need to clean up here.
-                            //
-                            m_connectionList.RemoveEntryDList(&conn->list);
-                            CleanupConnection(conn);
+                            conn->numPosted--;
+                            conn->hrClosed = GETLASTHRESULT();
+                            TErr(("Failed to requeue connection %p (hr=%x).",
+                                  conn, conn->hrClosed));
                         }
-                        fChanged = TRUE;
-                        hr = S_OK;
                     }
                 }
-                else
+
+                if (FAILED(conn->hrClosed) && (conn->numPosted == 0))
                 {
-                    hr = (rcWait == WAIT_FAILED)? GETLASTHRESULT():
-                                                  HRESULT_FROM_WIN32(rcWait);
-                    TErr(("Received unexpected event (hr=%x).", hr));
+                    //
+                    // All outstanding receives have come back, it is now safe
+                    // to let go of the connection.
+                    //
+                    ConnectionClosed(conn, conn->hrClosed);
                 }
             }
         }
 
-        if (ahWaits != NULL)
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //CompletionThread
+
+    /**
+     *  This function posts receives on all free receive contexts of a
+     *  completion port connection in ring order. Receives that complete
+     *  inline are marked done.
+     *
+     *  @param conn Points to the CONN structure.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    PostReceives(
+        __in PCONN conn
+        )
+    {
+        HRESULT hr = S_OK;
+
+        TLevel(FUNC);
+        TEnterMsg(("conn=%p,postIdx=%d", conn, conn->postIdx));
+
+        while (conn->recvCtxts[conn->postIdx].state == RECV_IDLE)
         {
-            delete [] ahWaits;
+            PRECVCTXT ctxt = &conn->recvCtxts[conn->postIdx];
+
+            if (FAILED(hr = RenewRecvBuffer(conn, ctxt)) ||
+                FAILED(hr = PostReceive(conn, ctxt, &ctxt->dwcb)))
+            {
+                break;
+            }
+            else if (hr == S_FALSE)
+            {
+                if (ctxt->dwcb == 0)
+                {
+                    TInfo(("Connection is shutdown by client."));
+                    hr = HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED);
+                    break;
+                }
+                ctxt->state = RECV_DONE;
+                hr = S_OK;
+            }
+            else
+            {
+                ctxt->state = RECV_POSTED;
+                conn->numPosted++;
+            }
+            conn->postIdx = (conn->postIdx + 1)%m_recvDepth;
         }
 
-        if (aConns != NULL)
+        TExitMsg(("=%x (posted=%d)", hr, conn->numPosted));
+        return hr;
+    }   //PostReceives
+
+    /**
+     *  This function posts a receive on a receive context of a connection.
+     *
+     *  @param conn Points to the CONN structure.
+     *  @param ctxt Points to the RECVCTXT structure.
+     *  @param lpdwcb Points to a variable to hold the number of bytes
+     *         received if the receive completes inline.
+     *
+     *  @return Success: Returns S_OK, or S_FALSE if the receive completed
+     *          inline and no completion packet will be queued for it.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    PostReceive(
+        __in  PCONN conn,
+        __in  PRECVCTXT ctxt,
+        __out LPDWORD lpdwcb
+        )
+    {
+        HRESULT hr;
+
+        TLevel(FUNC);
+        TEnterMsg(("conn=%p,ctxt=%p,lpdwcb=%p", conn, ctxt, lpdwcb));
+
+        if (conn->socket == INVALID_SOCKET)
+        {
+            //
+            // The socket was closed from our side.
+            //
+            *lpdwcb = 0;
+            hr = HRESULT_FROM_WIN32(WSAENOTSOCK);
+        }
+        else
         {
-            delete [] aConns;
+            ctxt->fromLen = sizeof(ctxt->fromAddr);
+            hr = IssueRecv(conn,
+                           ctxt->dataBuffer,
+                           m_dataBufferSize,
+                           lpdwcb,
+                           &ctxt->overlapped,
+                           (PSOCKADDR)&ctxt->fromAddr,
+                           &ctxt->fromLen);
         }
 
         TExitMsg(("=%x", hr));
         return hr;
-    }   //ConnectionThread
+    }   //PostReceive
 
     /**
-     *  This function processes the data received from a connection.
+     *  This function retrieves the result of a completed receive on a
+     *  connection.
      *
      *  @param conn Points to the CONN structure.
+     *  @param ctxt Points to the RECVCTXT structure of the receive.
+     *  @param pdwcb Points to the variable to receive the number of bytes
+     *         received.
      *
      *  @return Success: Returns S_OK.
      *  @return Failure: Returns HRESULT code.
      */
     HRESULT
-    ProcessConnectionData(
-        __in PCONN conn
+    GetReceiveResult(
+        __in  PCONN     conn,
+        __in  PRECVCTXT ctxt,
+        __out LPDWORD   pdwcb
         )
     {
         HRESULT hr = S_OK;
         DWORD dwFlags = 0;
-        DWORD dwcb;
 
         TLevel(FUNC);
-        TEnterMsg(("conn=%p", conn));
+        TEnterMsg(("conn=%p,ctxt=%p,pdwcb=%p", conn, ctxt, pdwcb));
 
         if (!WSAGetOverlappedResult(conn->socket,
-                                    &conn->overlapped,
-                                    &dwcb,
+                                    &ctxt->overlapped,
+                                    pdwcb,
                                     FALSE,
                                     &dwFlags))
         {
@@ -779,45 +2202,232 @@ private:
                 TErr(("Failed to get overlappedRead result (hr=%x).", hr));
             }
         }
-        else if (dwcb > 0)
+        else if (*pdwcb == 0)
+        {
+            //
+            // Connection has been terminated from the client side.
+            //
+            TInfo(("Connection is shutdown by client."));
+            hr = HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED);
+        }
+
+        TExitMsg(("=%x (len=%d)", hr, *pdwcb));
+        return hr;
+    }   //GetReceiveResult
+
+    /**
+     *  This function processes the data received from an event backend
+     *  connection. All receives that have completed, up to the receive
+     *  depth, are collected in ring order and handed to the callback as
+     *  one batch with their sender addresses. The buffers are then
+     *  re-posted. It stops at the first receive still in flight, whose
+     *  completion will signal the connection event again.
+     *
+     *  @param conn Points to the CONN structure.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    ProcessConnectionData(
+        __in PCONN conn
+        )
+    {
+        HRESULT hr = S_OK;
+        WsaCallback::WSAPACKET aPackets[MAX_RECV_DEPTH];
+        DWORD nPackets = 0;
+        DWORD idx = conn->recvHead;
+
+        TLevel(FUNC);
+        TEnterMsg(("conn=%p", conn));
+
+        while (nPackets < m_recvDepth)
+        {
+            PRECVCTXT ctxt = &conn->recvCtxts[idx];
+
+            if (!HasOverlappedIoCompleted(&ctxt->overlapped))
+            {
+                break;
+            }
+
+            hr = GetReceiveResult(conn, ctxt, &ctxt->dwcb);
+            if (FAILED(hr))
+            {
+                break;
+            }
+
+            aPackets[nPackets].connHandle = (HANDLE)conn;
+            aPackets[nPackets].hLease = (HANDLE)BUFF_TO_LEASE(ctxt->dataBuffer);
+            aPackets[nPackets].recvBuff = ctxt->dataBuffer;
+            aPackets[nPackets].recvLen = ctxt->dwcb;
+            aPackets[nPackets].fromAddr = (PSOCKADDR)&ctxt->fromAddr;
+            aPackets[nPackets].fromLen = ctxt->fromLen;
+            nPackets++;
+            idx = (idx + 1)%m_recvDepth;
+        }
+
+        if (nPackets > 0)
         {
-            TInfo(("Got a data packet (Len=%d).", dwcb));
+            PRECVCTXT ctxtLast = &conn->recvCtxts[(idx + m_recvDepth - 1)%
+                                                  m_recvDepth];
+
+            TInfo(("Got %d data packets.", nPackets));
+            conn->fromAddr = ctxtLast->fromAddr;
+            conn->fromLen = ctxtLast->fromLen;
             //
             // Note: If the callback is going to take substantial amount
-            // of time to process, the callback function should process
-            // the request with a different thread and return this thread
-            // immediately.  The callback function is responsible for
-            // deallocating the buffer.
+            // of time to process, the listener should be started with
+            // LISTENF_DISPATCH so that the callback is called on the
+            // dispatch thread and this thread goes back to receiving
+            // immediately.
             //
-            m_dataCallback->DataReceived((HANDLE)conn,
-                                         m_callbackContext,
-                                         conn->dataBuffer,
-                                         dwcb);
-            hr = AsyncRead((HANDLE)conn,
-                           conn->dataBuffer,
-                           m_dataBufferSize,
-                           &dwcb,
-                           &conn->overlapped);
+            DeliverPackets(aPackets, nPackets);
+        }
+
+        //
+        // Re-post the delivered buffers in ring order, unless the connection
+        // is going away.
+        //
+        for (DWORD i = 0; SUCCEEDED(hr) && (i < nPackets); i++)
+        {
+            PRECVCTXT ctxt = &conn->recvCtxts[conn->recvHead];
+            DWORD dwcb;
+
+            if (SUCCEEDED(hr = RenewRecvBuffer(conn, ctxt)))
+            {
+                hr = PostReceive(conn, ctxt, &dwcb);
+            }
+
+            if (SUCCEEDED(hr))
+            {
+                conn->recvHead = (conn->recvHead + 1)%m_recvDepth;
+            }
+        }
+
+        if (FAILED(hr))
+        {
+            WaitPendingReceives(conn);
+        }
+        else if (HasOverlappedIoCompleted(
+                    &conn->recvCtxts[conn->recvHead].overlapped))
+        {
+            //
+            // There is more data waiting, come back to it after the other
+            // connections had their turn.
+            //
+            SetEvent(conn->hRecvEvent);
+        }
+
+        TExitMsg(("=%x", hr));
+        return hr;
+    }   //ProcessConnectionData
+
+    /**
+     *  This function issues an overlapped receive on the connection socket.
+     *
+     *  @param conn Points to the CONN structure.
+     *  @param pbBuff Points to the buffer.
+     *  @param dwcbLen Specifies the buffer size in bytes.
+     *  @param lpdwcb Points to a variable to hold the number of characters
+     *         read.
+     *  @param overlapped Points to the overlapped structure.
+     *  @param fromAddr Points to the buffer to hold the sender address of
+     *         a datagram.
+     *  @param fromLen Points to the size of the fromAddr buffer.
+     *
+     *  @return Success: Returns S_OK, or S_FALSE if the read completed
+     *          inline on a completion port connection and no completion
+     *          packet will be queued for it.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    IssueRecv(
+        __in                  PCONN conn,
+        __out_bcount(dwcbLen) LPBYTE pbBuff,
+        __in                  DWORD dwcbLen,
+        __out                 LPDWORD lpdwcb,
+        __inout               LPWSAOVERLAPPED overlapped,
+        __out                 PSOCKADDR fromAddr,
+        __inout               LPINT fromLen
+        )
+    {
+        HRESULT hr = S_OK;
+        DWORD dwErr;
+        WSABUF WSABuff[1];
+        DWORD dwFlags = 0;
+
+        TLevel(FUNC);
+        TEnterMsg(("conn=%p,buff=%p,len=%d,lpdwcb=%p,overlapped=%p",
+                   conn, pbBuff, dwcbLen, lpdwcb, overlapped));
+
+        *lpdwcb = 0;
+        WSABuff[0].len = dwcbLen;
+        WSABuff[0].buf = (LPSTR)pbBuff;
+        if (m_sockType == SOCK_DGRAM)
+        {
+            dwErr = WSARecvFrom(conn->socket,
+                                WSABuff,
+                                1,
+                                lpdwcb,
+                                &dwFlags,
+                                fromAddr,
+                                fromLen,
+                                overlapped,
+                                NULL);
+        }
+        else
+        {
+            dwErr = WSARecv(conn->socket,
+                            WSABuff,
+                            1,
+                            lpdwcb,
+                            &dwFlags,
+                            overlapped,
+                            NULL);
+        }
+
+        if (dwErr == ERROR_SUCCESS)
+        {
+            if (overlapped->hEvent != NULL)
+            {
+                SetEvent(overlapped->hEvent);
+            }
+            else if (conn->dwFlags & CONNF_SKIPONSUCCESS)
+            {
+                //
+                // The read completed inline and no completion packet
+                // will be queued for it.
+                //
+                hr = S_FALSE;
+            }
+        }
+        else
+        {
+            dwErr = WSAGetLastError();
+            if (dwErr == WSA_IO_PENDING)
+            {
+                //
+                // The read is successfully queued.
+                //
+                dwErr = ERROR_SUCCESS;
+            }
+            else
+            {
+                TWarn(("Failed to receive data from the socket (err=%d).",
+                       dwErr));
+            }
         }
-        else
+
+        if (dwErr != ERROR_SUCCESS)
         {
-            //
-            // Connection has been terminated from the client side.
-            //
-            TInfo(("Connection is shutdown by client."));
-            hr = HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED);
+            hr = HRESULT_FROM_WIN32(dwErr);
         }
 
-        TExitMsg(("=%x", hr));
+        TExitMsg(("=%x (len=%d)", hr, *lpdwcb));
         return hr;
-    }   //ProcessConnectionData
+    }   //IssueRecv
 
 public:
-    //
-    // Public constants.
-    //
-    #define LISTENF_ASYNC               0x00000001
-
     /**
      *  Constructor of the class object.
      */
@@ -831,11 +2441,15 @@ public:
          , m_dataCallback(NULL)
          , m_callbackContext(NULL)
          , m_dataBufferSize(0)
+         , m_recvDepth(1)
          , m_dwFlags(0)
          , m_hListenerThread(NULL)
-         , m_hConnectionThread(NULL)
-         , m_hChangedEvent(NULL)
-         , m_connectionList()
+         , m_shards(NULL)
+         , m_numShards(0)
+         , m_hDispatchThread(NULL)
+         , m_hDispatchEvent(NULL)
+         , m_hSpaceEvent(NULL)
+         , m_dispatchDepth(DEF_DISPATCH_DEPTH)
     {
         TLevel(INIT);
         TEnter();
@@ -848,7 +2462,8 @@ public:
     }   //WsaServer
 
     /**
-     *  Desctructor of the class object.
+     *  Desctructor of the class object. The owner must call StopListener
+     *  first and must not delete the object if it fails.
      */
     ~WsaServer(
         VOID
@@ -934,7 +2549,17 @@ public:
      *  @param dataCallback Points to the data callback interface.
      *  @param callbackContext Specifies the callback context.
      *  @param dataBufferSize Specifies the read/write buffer size.
-     *  @param dwFlags Specifies option flags.
+     *  @param dwFlags Specifies option flags:
+     *          LISTENF_ASYNC - run the listener on its own thread.
+     *          LISTENF_IOCP - monitor connections with an I/O completion
+     *              port instead of one event per connection. This lifts
+     *              the MAXIMUM_WAIT_OBJECTS limit on connections.
+     *          LISTENF_DISPATCH - call the data callback from a dedicated
+     *              dispatch thread fed by a lock-free queue, so a slow
+     *              callback never holds up receiving. The connection may
+     *              be gone by the time a packet is delivered, so the
+     *              callback gets NULL for its connection handle.
+     *  @param listenParams Points to optional listener parameters.
      *
      *  @return Success: Returns S_OK.
      *  @return Failure: Returns HRESULT code.
@@ -944,16 +2569,29 @@ public:
         __in     WsaCallback *dataCallback,
         __in_opt LPVOID callbackContext,
         __in     DWORD dataBufferSize,
-        __in     DWORD dwFlags
+        __in     DWORD dwFlags,
+        __in_opt PLISTEN_PARAMS listenParams = NULL
         )
     {
         HRESULT hr = S_OK;
+        DWORD numShards = ((listenParams != NULL) &&
+                           (listenParams->numShards > 0))?
+                                listenParams->numShards: 1;
+        DWORD recvDepth = ((listenParams != NULL) &&
+                           (listenParams->recvDepth > 0))?
+                                listenParams->recvDepth: 1;
+        DWORD dispatchDepth = ((listenParams != NULL) &&
+                               (listenParams->dispatchDepth > 0))?
+                                    listenParams->dispatchDepth:
+                                    DEF_DISPATCH_DEPTH;
 
         TLevel(API);
-        TEnterMsg(("callbk=%p,ctxt=%p,buffSize=%d,flags=%x",
-                   dataCallback, callbackContext, dataBufferSize, dwFlags));
+        TEnterMsg(("callbk=%p,ctxt=%p,buffSize=%d,flags=%x,shards=%d,depth=%d",
+                   dataCallback, callbackContext, dataBufferSize, dwFlags,
+                   numShards, recvDepth));
 
-        if ((dataCallback == NULL) || (dataBufferSize == 0))
+        if ((dataCallback == NULL) || (dataBufferSize == 0) ||
+            (numShards > MAX_SHARDS) || (recvDepth > MAX_RECV_DEPTH))
         {
             TWarn(("Invalid parameter."));
             hr = E_INVALIDARG;
@@ -963,14 +2601,66 @@ public:
             TErr(("WsaServer was not initialized."));
             hr = HRESULT_FROM_WIN32(ERROR_NOT_READY);
         }
+        else if (m_shards != NULL)
+        {
+            TErr(("WsaServer listener has already been started."));
+            hr = HRESULT_FROM_WIN32(ERROR_ALREADY_INITIALIZED);
+        }
+        else if (FAILED(hr = m_connPool.Uninitialize()) ||
+                 FAILED(hr = m_buffPool.Uninitialize()))
+        {
+            //
+            // The pools of the previous run can only go once the callbacks
+            // have released all their leases, try again later.
+            //
+            TErr(("Buffers of the previous listener are still leased "
+                  "(hr=%x).", hr));
+        }
+        else if ((m_shards = new SHARD[numShards]) == NULL)
+        {
+            hr = E_OUTOFMEMORY;
+            TErr(("Failed to allocate %d connection shards.", numShards));
+        }
         else
         {
             m_dataCallback = dataCallback;
             m_callbackContext = callbackContext;
             m_dataBufferSize = dataBufferSize;
+            m_recvDepth = recvDepth;
+            m_dispatchDepth = dispatchDepth;
             m_dwFlags = dwFlags & LISTENF_MASK;
+            m_numShards = numShards;
+            for (DWORD i = 0; i < m_numShards; i++)
+            {
+                m_shards[i].server = this;
+                m_shards[i].index = i;
+                m_shards[i].hConnectionThread = NULL;
+                m_shards[i].hChangedEvent = NULL;
+                m_shards[i].hCompletionPort = NULL;
+                m_shards[i].numWaits = 0;
+                ZeroMemory(&m_shards[i].poolCache,
+                           sizeof(m_shards[i].poolCache));
+            }
+            ZeroMemory(&m_listenerCache, sizeof(m_listenerCache));
 
-            if (m_sockType == SOCK_DGRAM)
+            if (FAILED(hr = m_connPool.Initialize(
+                                sizeof(CONN) + m_recvDepth*sizeof(RECVCTXT),
+                                POOL_SLAB_CONNS)))
+            {
+                TErr(("Failed to initialize connection pool (hr=%x).", hr));
+            }
+            else if (FAILED(hr = m_buffPool.Initialize(
+                                    sizeof(LEASE) + m_dataBufferSize + 1,
+                                    POOL_SLAB_CONNS*m_recvDepth)))
+            {
+                TErr(("Failed to initialize buffer pool (hr=%x).", hr));
+            }
+            else if ((m_dwFlags & LISTENF_DISPATCH) &&
+                     FAILED(hr = StartDispatchThread()))
+            {
+                TErr(("Failed to start dispatch thread (hr=%x).", hr));
+            }
+            else if (m_sockType == SOCK_DGRAM)
             {
                 //
                 // No need for listener when using datagram.
@@ -1007,6 +2697,11 @@ public:
                 //
                 hr = ListenerThread();
             }
+
+            if (FAILED(hr))
+            {
+                StopConnection();
+            }
         }
 
         TExitMsg(("=%x", hr));
@@ -1045,18 +2740,38 @@ public:
             TInfo(("Waiting for the listener thread to die..."));
             DWORD rcWait = WaitForSingleObject(m_hListenerThread,
                                                TERMINATE_TIMEOUT);
-            if (rcWait != WAIT_OBJECT_0)
+            if (rcWait == WAIT_OBJECT_0)
+            {
+                CloseHandle(m_hListenerThread);
+                m_hListenerThread = NULL;
+            }
+            else
             {
                 hr = (rcWait == WAIT_FAILED)? GETLASTHRESULT():
                                               HRESULT_FROM_WIN32(rcWait);
                 TErr(("Failed waiting for the listener thread to die (hr=%x).",
                       hr));
             }
-            CloseHandle(m_hListenerThread);
-            m_hListenerThread = NULL;
+        }
+        else if (m_sockType == SOCK_DGRAM)
+        {
+            //
+            // There is no listener thread to clean up the datagram
+            // connection, so do it here.
+            //
+            hr = StopConnection();
         }
 
-        TExit();
+        if (SUCCEEDED(hr) && (m_shards != NULL))
+        {
+            //
+            // The listener thread failed to stop the connection threads.
+            //
+            hr = HRESULT_FROM_WIN32(ERROR_BUSY);
+            TErr(("Connection threads are still running."));
+        }
+
+        TExitMsg(("=%x", hr));
         return hr;
     }   //StopListener
 
@@ -1070,7 +2785,9 @@ public:
      *         read.
      *  @param overlapped Points to the overlapped structure.
      *
-     *  @return Success: Returns S_OK.
+     *  @return Success: Returns S_OK, or S_FALSE if the read completed
+     *          inline on a completion port connection and no completion
+     *          packet will be queued for it.
      *  @return Failure: Returns HRESULT code.
      */
     HRESULT
@@ -1099,61 +2816,14 @@ public:
         }
         else
         {
-            DWORD dwErr;
-            WSABUF WSABuff[1];
-            DWORD dwFlags = 0;
-
             conn->fromLen = sizeof(conn->fromAddr);
-            WSABuff[0].len = dwcbLen;
-            WSABuff[0].buf = (LPSTR)pbBuff;
-            if (m_sockType == SOCK_DGRAM)
-            {
-                dwErr = WSARecvFrom(conn->socket,
-                                    WSABuff,
-                                    1,
-                                    lpdwcb,
-                                    &dwFlags,
-                                    &conn->fromAddr,
-                                    &conn->fromLen,
-                                    overlapped,
-                                    NULL);
-            }
-            else
-            {
-                dwErr = WSARecv(conn->socket,
-                                WSABuff,
-                                1,
-                                lpdwcb,
-                                &dwFlags,
-                                overlapped,
-                                NULL);
-            }
-
-            if (dwErr == ERROR_SUCCESS)
-            {
-                SetEvent(overlapped->hEvent);
-            }
-            else
-            {
-                dwErr = WSAGetLastError();
-                if (dwErr == WSA_IO_PENDING)
-                {
-                    //
-                    // The read is successfully queued.
-                    //
-                    dwErr = ERROR_SUCCESS;
-                }
-                else
-                {
-                    TWarn(("Failed to receive data from the socket (err=%d).",
-                           dwErr));
-                }
-            }
-
-            if (dwErr != ERROR_SUCCESS)
-            {
-                hr = HRESULT_FROM_WIN32(dwErr);
-            }
+            hr = IssueRecv(conn,
+                           pbBuff,
+                           dwcbLen,
+                           lpdwcb,
+                           overlapped,
+                           (PSOCKADDR)&conn->fromAddr,
+                           &conn->fromLen);
         }
 
         TExitMsg(("=%x (len=%d)", hr, *lpdwcb));
@@ -1161,12 +2831,15 @@ public:
     }   //AsyncRead
 
     /**
-     *  This function does an asynchronous write to the socket.
+     *  This function does an asynchronous gathering write to the socket.
+     *  The buffers go out as one message, so a header and its payload can
+     *  be sent without copying them together first.
      *
      *  @param hConn Specifies the handle of the connection.
-     *  @param pbBuff Points to the buffer.
-     *  @param pbBuff Points to the buffer.
-     *  @param dwcbLen Specifies the buffer size in bytes.
+     *  @param buffs Points to the array of buffers. The array only needs to
+     *         stay valid until the function returns, the buffers until the
+     *         write completes.
+     *  @param numBuffs Specifies the number of buffers.
      *  @param lpdwcb Points to a variable to hold the number of characters
      *         written.
      *  @param overlapped Points to the overlapped structure.
@@ -1175,20 +2848,20 @@ public:
      *  @return Failure: Returns HRESULT code.
      */
     HRESULT
-    AsyncWrite(
-        __in                 HANDLE hConn,
-        __in_bcount(dwcbLen) LPBYTE pbBuff,
-        __in                 DWORD dwcbLen,
-        __out                LPDWORD lpdwcb,
-        __inout              LPWSAOVERLAPPED overlapped
+    AsyncWriteV(
+        __in                  HANDLE hConn,
+        __in_ecount(numBuffs) LPWSABUF buffs,
+        __in                  DWORD numBuffs,
+        __out                 LPDWORD lpdwcb,
+        __inout               LPWSAOVERLAPPED overlapped
         )
     {
         HRESULT hr = S_OK;
         PCONN conn = (PCONN)hConn;
 
         TLevel(API);
-        TEnterMsg(("conn=%p,buff=%p,len=%d,lpdwcb=%p,overlapped=%p",
-                   conn, pbBuff, dwcbLen, lpdwcb, overlapped));
+        TEnterMsg(("conn=%p,buffs=%p,n=%d,lpdwcb=%p,overlapped=%p",
+                   conn, buffs, numBuffs, lpdwcb, overlapped));
 
         *lpdwcb = 0;
         if ((conn == NULL) ||
@@ -1200,19 +2873,16 @@ public:
         }
         else
         {
-            WSABUF WSABuff[1];
             DWORD dwErr;
 
-            WSABuff[0].len = dwcbLen;
-            WSABuff[0].buf = (LPSTR)pbBuff;
             if (m_sockType == SOCK_DGRAM)
             {
                 dwErr = WSASendTo(conn->socket,
-                                  WSABuff,
-                                  1,
+                                  buffs,
+                                  numBuffs,
                                   lpdwcb,
                                   0,
-                                  &conn->fromAddr,
+                                  (PSOCKADDR)&conn->fromAddr,
                                   conn->fromLen,
                                   overlapped,
                                   NULL);
@@ -1220,19 +2890,19 @@ public:
             else
             {
                 dwErr = WSASend(conn->socket,
-                                WSABuff,
-                                1,
+                                buffs,
+                                numBuffs,
                                 lpdwcb,
                                 0,
                                 overlapped,
                                 NULL);
             }
 
-            if (dwErr == ERROR_SUCCESS)
+            if ((dwErr == ERROR_SUCCESS) && (overlapped->hEvent != NULL))
             {
                 SetEvent(overlapped->hEvent);
             }
-            else
+            else if (dwErr != ERROR_SUCCESS)
             {
                 dwErr = WSAGetLastError();
                 if (dwErr == WSA_IO_PENDING)
@@ -1255,6 +2925,43 @@ public:
             }
         }
 
+        TExitMsg(("=%x (len=%d)", hr, *lpdwcb));
+        return hr;
+    }   //AsyncWriteV
+
+    /**
+     *  This function does an asynchronous write to the socket.
+     *
+     *  @param hConn Specifies the handle of the connection.
+     *  @param pbBuff Points to the buffer.
+     *  @param dwcbLen Specifies the buffer size in bytes.
+     *  @param lpdwcb Points to a variable to hold the number of characters
+     *         written.
+     *  @param overlapped Points to the overlapped structure.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    AsyncWrite(
+        __in                 HANDLE hConn,
+        __in_bcount(dwcbLen) LPBYTE pbBuff,
+        __in                 DWORD dwcbLen,
+        __out                LPDWORD lpdwcb,
+        __inout              LPWSAOVERLAPPED overlapped
+        )
+    {
+        HRESULT hr;
+        WSABUF WSABuff[1];
+
+        TLevel(API);
+        TEnterMsg(("conn=%p,buff=%p,len=%d,lpdwcb=%p,overlapped=%p",
+                   hConn, pbBuff, dwcbLen, lpdwcb, overlapped));
+
+        WSABuff[0].len = dwcbLen;
+        WSABuff[0].buf = (LPSTR)pbBuff;
+        hr = AsyncWriteV(hConn, WSABuff, 1, lpdwcb, overlapped);
+
         TExitMsg(("=%x (len=%d)", hr, *lpdwcb));
         return hr;
     }   //AsyncWrite
@@ -1352,12 +3059,12 @@ public:
     }   //SyncRead
 
     /**
-     *  This function does an synchronous write to the socket.
+     *  This function does an synchronous gathering write to the socket. The
+     *  buffers go out as one message.
      *
      *  @param hConn Specifies the handle of the connection.
-     *  @param pbBuff Points to the buffer.
-     *  @param pbBuff Points to the buffer.
-     *  @param dwcbLen Specifies the buffer size in bytes.
+     *  @param buffs Points to the array of buffers.
+     *  @param numBuffs Specifies the number of buffers.
      *  @param lpdwcb Points to a variable to hold the number of characters
      *         written.
      *  @param dwTimeout Specifies the timeout value in milli-seconds, can be
@@ -1367,12 +3074,12 @@ public:
      *  @return Failure: Returns HRESULT code.
      */
     HRESULT
-    SyncWrite(
-        __in                 HANDLE hConn,
-        __in_bcount(dwcbLen) LPBYTE pbBuff,
-        __in                 DWORD dwcbLen,
-        __out                LPDWORD lpdwcb,
-        __in                 DWORD dwTimeout
+    SyncWriteV(
+        __in                  HANDLE hConn,
+        __in_ecount(numBuffs) LPWSABUF buffs,
+        __in                  DWORD numBuffs,
+        __out                 LPDWORD lpdwcb,
+        __in                  DWORD dwTimeout
         )
     {
         HRESULT hr = S_OK;
@@ -1380,8 +3087,8 @@ public:
         OVERLAPPED overlapped;
 
         TLevel(API);
-        TEnterMsg(("conn=%p,Socket=<%ws>,pbBuff=%p,dwcbLen=%d,lpdwcb=%p,Timeout=%d",
-                   conn, m_szPort, pbBuff, dwcbLen, lpdwcb, dwTimeout));
+        TEnterMsg(("conn=%p,Socket=<%ws>,buffs=%p,n=%d,lpdwcb=%p,Timeout=%d",
+                   conn, m_szPort, buffs, numBuffs, lpdwcb, dwTimeout));
 
         ZeroMemory(&overlapped, sizeof(overlapped));
         overlapped.hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
@@ -1392,7 +3099,7 @@ public:
         }
         else
         {
-            hr = AsyncWrite(hConn, pbBuff, dwcbLen, lpdwcb, &overlapped);
+            hr = AsyncWriteV(hConn, buffs, numBuffs, lpdwcb, &overlapped);
             if (SUCCEEDED(hr))
             {
                 DWORD dwErr = WaitForSingleObject(overlapped.hEvent,
@@ -1439,10 +3146,98 @@ public:
             CloseHandle(overlapped.hEvent);
         }
 
+        TExitMsg(("=%x (len=%d)", hr, *lpdwcb));
+        return hr;
+    }   //SyncWriteV
+
+    /**
+     *  This function does an synchronous write to the socket.
+     *
+     *  @param hConn Specifies the handle of the connection.
+     *  @param pbBuff Points to the buffer.
+     *  @param dwcbLen Specifies the buffer size in bytes.
+     *  @param lpdwcb Points to a variable to hold the number of characters
+     *         written.
+     *  @param dwTimeout Specifies the timeout value in milli-seconds, can be
+     *         INFINITE.
+     *
+     *  @return Success: Returns S_OK.
+     *  @return Failure: Returns HRESULT code.
+     */
+    HRESULT
+    SyncWrite(
+        __in                 HANDLE hConn,
+        __in_bcount(dwcbLen) LPBYTE pbBuff,
+        __in                 DWORD dwcbLen,
+        __out                LPDWORD lpdwcb,
+        __in                 DWORD dwTimeout
+        )
+    {
+        HRESULT hr;
+        WSABUF WSABuff[1];
+
+        TLevel(API);
+        TEnterMsg(("conn=%p,Socket=<%ws>,pbBuff=%p,dwcbLen=%d,lpdwcb=%p,Timeout=%d",
+                   hConn, m_szPort, pbBuff, dwcbLen, lpdwcb, dwTimeout));
+
+        WSABuff[0].len = dwcbLen;
+        WSABuff[0].buf = (LPSTR)pbBuff;
+        hr = SyncWriteV(hConn, WSABuff, 1, lpdwcb, dwTimeout);
+
         TExitMsg(("=%x (len=%d)", hr, *lpdwcb));
         return hr;
     }   //SyncWrite
 
+    /**
+     *  This function takes a reference on a leased receive buffer so that it
+     *  stays valid after the data callback returns.
+     *
+     *  @param hLease Specifies the lease handle passed to the callback.
+     */
+    static
+    VOID
+    AddRefLease(
+        __in HANDLE hLease
+        )
+    {
+        PLEASE lease = (PLEASE)hLease;
+
+        TLevel(API);
+        TEnterMsg(("hLease=%p", hLease));
+
+        InterlockedIncrement(&lease->refCount);
+
+        TExitMsg(("! (refCount=%d)", lease->refCount));
+        return;
+    }   //AddRefLease
+
+    /**
+     *  This function drops a reference taken with AddRefLease. It may be
+     *  called from any thread. The buffer goes back to the pool when the
+     *  last reference is gone.
+     *
+     *  @param hLease Specifies the lease handle passed to the callback.
+     */
+    static
+    VOID
+    ReleaseLease(
+        __in HANDLE hLease
+        )
+    {
+        PLEASE lease = (PLEASE)hLease;
+
+        TLevel(API);
+        TEnterMsg(("hLease=%p,refCount=%d", hLease, lease->refCount));
+
+        if (InterlockedDecrement(&lease->refCount) == 0)
+        {
+            lease->pool->Free(lease);
+        }
+
+        TExit();
+        return;
+    }   //ReleaseLease
+
 };  //class WsaServer
 
 #ifdef _MAIN_FILE
@@ -1486,16 +3281,66 @@ ConnectionThreadProc(
     )
 {
     DWORD rc;
-    WsaServer *server = (WsaServer *)lpParam;
+    WsaServer::PSHARD shard = (WsaServer::PSHARD)lpParam;
 
     TLevel(CALLBK);
     TEnterMsg(("param=%p", lpParam));
 
-    rc = (DWORD)server->ConnectionThread();
+    rc = (DWORD)shard->server->ConnectionThread(shard);
 
     TExitMsg(("=%x", rc));
     return rc;
 }   //ConnectionThreadProc
 
+/**
+ *  This function implements the completion port connection thread.
+ *
+ *  @param lpParam Points to thread data passed to the function.
+ *
+ *  @return Success: Returns ERROR_SUCCESS.
+ *  @return Failure: Returns Win32 error code.
+ */
+DWORD WINAPI
+CompletionThreadProc(
+    __in LPVOID lpParam
+    )
+{
+    DWORD rc;
+    WsaServer::PSHARD shard = (WsaServer::PSHARD)lpParam;
+
+    TLevel(CALLBK);
+    TEnterMsg(("param=%p", lpParam));
+
+    rc = (DWORD)shard->server->CompletionThread(shard);
+
+    TExitMsg(("=%x", rc));
+    return rc;
+}   //CompletionThreadProc
+
+/**
+ *  This function implements the dispatch thread.
+ *
+ *  @param lpParam Points to thread data passed to the function.
+ *
+ *  @return Success: Returns ERROR_SUCCESS.
+ *  @return Failure: Returns Win32 error code.
+ */
+DWORD WINAPI
+DispatchThreadProc(
+    __in LPVOID lpParam
+    )
+{
+    DWORD rc;
+    WsaServer *server = (WsaServer *)lpParam;
+
+    TLevel(CALLBK);
+    TEnterMsg(("param=%p", lpParam));
+
+    rc = (DWORD)server->DispatchThread();
+
+    TExitMsg(("=%x", rc));
+    return rc;
+}   //DispatchThreadProc
+
 #endif
 